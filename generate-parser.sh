@@ -1 +1,5 @@
-node_modules/syntax-cli/bin/syntax -g eva-grammar.bnf -m LALR1 -o src/parser/eva_parser.h
\ No newline at end of file
+set -e
+node_modules/syntax-cli/bin/syntax -g eva-grammar.bnf -m LALR1 -o src/parser/eva_parser.h
+# The actions of the grammar locate their values with the last shifted token,
+# which the parser template of syntax-cli keeps as a local of parse()
+patch -p1 < eva-parser.patch
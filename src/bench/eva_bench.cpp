@@ -0,0 +1,359 @@
+// Before logger.h, which defines a `log` macro
+#include <cmath>
+
+#include "../vm/evavm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+/*
+ * Benchmark suite: every program of the corpus runs in a new VM, a few
+ * times to warm up the caches and the allocator, then the measured
+ * repetitions. A run includes the parsing and the compilation.
+ *
+ * Usage: eva_bench [--warmup N] [--repetitions N] [--filter TEXT]
+ *                  [--json FILE] [--baseline FILE] [--threshold PERCENT]
+ *
+ * --json writes one JSON object per benchmark and per line, "-" for
+ * stdout; such a file is also the baseline read by --baseline. Against a
+ * baseline, the exit status is 1 when the median time of a benchmark grew
+ * by more than the threshold (5% by default).
+ */
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct Benchmark
+{
+    std::string name;
+    std::string source;
+    // Result of the program, checked after every run
+    double expected;
+    // Operations done by a run, for the throughput: loop iterations,
+    // calls or compiled functions
+    double operations;
+};
+
+// Functions defined and called once, for the parser and the compiler: `fi`
+// returns i + 1
+std::string largeSource(int functions)
+{
+    std::ostringstream source;
+    for (int i = 0; i < functions; ++i) {
+        source << "(def f" << i << " (x) (begin (var y (* x 2)) (var z (- y x))"
+               << " (if (> z 1000000) (- z y) (+ z " << i << "))))\n";
+    }
+    source << "(var total 0)\n";
+    for (int i = 0; i < functions; ++i) {
+        source << "(set total (+ total (f" << i << " 1)))\n";
+    }
+    source << "total\n";
+    return source.str();
+}
+
+std::vector<Benchmark> corpus()
+{
+    return {
+        {"numeric_loop", R"#(
+        (var i 0)
+        (var sum 0)
+        (while (< i 200000)
+            (begin
+                (set sum (+ sum (* i 2)))
+                (set i (+ i 1))
+            ))
+        sum
+        )#",
+         39999800000, 200000},
+        {"fib", R"#(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))
+            ))
+        (fib 20)
+        )#",
+         6765, 21891},
+        {"factorial", R"#(
+        (def factorial (x)
+            (if (= x 1)
+                1
+                (* x (factorial (- x 1)))
+            ))
+        (var n 0)
+        (var result 0)
+        (while (< n 2000)
+            (begin
+                (set result (factorial 20))
+                (set n (+ n 1))
+            ))
+        result
+        )#",
+         2432902008176640000.0, 40000},
+        {"string_build", R"#(
+        (var s "")
+        (var n 0)
+        (while (< n 3000)
+            (begin
+                (set s (+ s "x"))
+                (set n (+ n 1))
+            ))
+        n
+        )#",
+         3000, 3000},
+        {"closure_calls", R"#(
+        (def adder (k)
+            (begin
+                (def add (x) (+ x k))
+                add
+            ))
+        (var inc (adder 1))
+        (var n 0)
+        (while (< n 100000)
+            (set n (inc n)))
+        n
+        )#",
+         100000, 100000},
+        {"allocation", R"#(
+        (def cons (head tail)
+            (begin
+                (def get (i) (if (= i 0) head tail))
+                get
+            ))
+        (var list 0)
+        (var n 0)
+        (while (< n 20000)
+            (begin
+                (set list (cons n list))
+                (var garbage (+ "a" "b"))
+                (set n (+ n 1))
+            ))
+        (list 0)
+        )#",
+         19999, 20000},
+        // The tokenizer matches its rules against the rest of the source,
+        // so the time grows quadratically with the size of the source
+        {"compile_large", largeSource(20), 20 * 21 / 2, 20},
+    };
+}
+
+struct Run
+{
+    double seconds;
+    size_t allocatedObjects;
+    size_t allocatedBytes;
+    double gcSeconds;
+    size_t collections;
+};
+
+Run run(const Benchmark &benchmark)
+{
+    EvaVM vm;
+    vm.setPrintListing(false);
+    const auto before = vm.collector().telemetry().counters();
+    const auto start = Clock::now();
+    const auto result = vm.exec(benchmark.source);
+    const auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (!isNumber(result) || result.asNumber() != benchmark.expected) {
+        DIE << "Benchmark " << benchmark.name << ": wrong result " << toString(result);
+    }
+    const auto after = vm.collector().telemetry().counters();
+    return {seconds,
+            after.allocatedObjects - before.allocatedObjects,
+            after.allocatedBytes - before.allocatedBytes,
+            std::chrono::duration<double>(after.totalPause).count(),
+            after.minorCollections + after.fullCollections};
+}
+
+struct Summary
+{
+    double min;
+    double median;
+    double mean;
+    double stddev;
+    double max;
+};
+
+Summary summarize(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    const auto n = values.size();
+    Summary summary{values.front(), 0, 0, 0, values.back()};
+    summary.median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    for (auto value : values) {
+        summary.mean += value / n;
+    }
+    for (auto value : values) {
+        summary.stddev += (value - summary.mean) * (value - summary.mean);
+    }
+    summary.stddev = n > 1 ? std::sqrt(summary.stddev / (n - 1)) : 0;
+    return summary;
+}
+
+struct Result
+{
+    std::string name;
+    size_t repetitions;
+    Summary seconds;
+    double operationsPerSecond;
+    // Of one run
+    Run last;
+    // Mean of the runs
+    double gcSeconds;
+};
+
+void writeJson(std::ostream &out, const Result &result)
+{
+    auto ns = [](double seconds) { return (long long) std::llround(seconds * 1e9); };
+    out << "{\"name\":\"" << result.name << "\",\"repetitions\":" << result.repetitions
+        << ",\"min_ns\":" << ns(result.seconds.min) << ",\"median_ns\":" << ns(result.seconds.median)
+        << ",\"mean_ns\":" << ns(result.seconds.mean)
+        << ",\"stddev_ns\":" << ns(result.seconds.stddev)
+        << ",\"max_ns\":" << ns(result.seconds.max) << ",\"ops_per_sec\":" << std::fixed
+        << std::setprecision(1) << result.operationsPerSecond << std::defaultfloat
+        << ",\"allocated_objects\":" << result.last.allocatedObjects
+        << ",\"allocated_bytes\":" << result.last.allocatedBytes
+        << ",\"collections\":" << result.last.collections << ",\"gc_pause_ns\":" << ns(result.gcSeconds)
+        << "}\n";
+}
+
+// Median time in seconds of each benchmark of a file written by --json
+std::map<std::string, double> readBaseline(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in) {
+        DIE << "Cannot open the baseline " << path;
+    }
+    auto field = [](const std::string &line, const std::string &key) -> std::string {
+        const auto pattern = "\"" + key + "\":";
+        auto start = line.find(pattern);
+        if (start == std::string::npos)
+            return "";
+        start += pattern.size();
+        if (line[start] == '"') {
+            return line.substr(start + 1, line.find('"', start + 1) - start - 1);
+        }
+        return line.substr(start, line.find_first_of(",}", start) - start);
+    };
+    std::map<std::string, double> baseline;
+    std::string line;
+    while (std::getline(in, line)) {
+        const auto name = field(line, "name");
+        const auto median = field(line, "median_ns");
+        if (!name.empty() && !median.empty()) {
+            baseline[name] = std::atof(median.c_str()) / 1e9;
+        }
+    }
+    return baseline;
+}
+
+struct Options
+{
+    size_t warmup{2};
+    size_t repetitions{10};
+    std::string filter;
+    std::string json;
+    std::string baseline;
+    double threshold{5};
+};
+
+Options parseOptions(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 == argc) {
+            DIE << "eva_bench: missing value of " << arg;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--warmup") {
+            options.warmup = std::atoi(value.c_str());
+        } else if (arg == "--repetitions") {
+            options.repetitions = std::max(std::atoi(value.c_str()), 1);
+        } else if (arg == "--filter") {
+            options.filter = value;
+        } else if (arg == "--json") {
+            options.json = value;
+        } else if (arg == "--baseline") {
+            options.baseline = value;
+        } else if (arg == "--threshold") {
+            options.threshold = std::atof(value.c_str());
+        } else {
+            DIE << "eva_bench: unknown option " << arg;
+        }
+    }
+    return options;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const auto options = parseOptions(argc, argv);
+    const auto baseline = options.baseline.empty() ? std::map<std::string, double>{}
+                                                   : readBaseline(options.baseline);
+    std::ofstream jsonFile;
+    std::ostream *json = nullptr;
+    if (options.json == "-") {
+        json = &std::cout;
+    } else if (!options.json.empty()) {
+        jsonFile.open(options.json);
+        json = &jsonFile;
+    }
+
+    // The table goes to stderr when stdout has the JSON
+    std::ostream &table = json == &std::cout ? std::cerr : std::cout;
+    table << std::left << std::setw(16) << "benchmark" << std::right << std::setw(11) << "median ms"
+          << std::setw(9) << "stddev" << std::setw(11) << "min ms" << std::setw(13) << "ops/s"
+          << std::setw(11) << "allocs" << std::setw(10) << "alloc KB" << std::setw(9) << "GCs"
+          << std::setw(10) << "GC ms" << "  baseline\n";
+
+    bool regression = false;
+    for (const auto &benchmark : corpus()) {
+        if (benchmark.name.find(options.filter) == std::string::npos)
+            continue;
+        for (size_t i = 0; i < options.warmup; ++i) {
+            run(benchmark);
+        }
+        std::vector<double> seconds;
+        double gcSeconds = 0;
+        Run last{};
+        for (size_t i = 0; i < options.repetitions; ++i) {
+            last = run(benchmark);
+            seconds.push_back(last.seconds);
+            gcSeconds += last.gcSeconds / options.repetitions;
+        }
+        Result result{benchmark.name, options.repetitions, summarize(seconds), 0, last, gcSeconds};
+        result.operationsPerSecond = benchmark.operations / result.seconds.median;
+        if (json) {
+            writeJson(*json, result);
+        }
+
+        table << std::left << std::setw(16) << benchmark.name << std::right << std::fixed
+              << std::setprecision(3) << std::setw(11) << result.seconds.median * 1e3
+              << std::setprecision(1) << std::setw(8)
+              << 100 * result.seconds.stddev / result.seconds.mean << "%" << std::setprecision(3)
+              << std::setw(11) << result.seconds.min * 1e3 << std::setprecision(0) << std::setw(13)
+              << result.operationsPerSecond << std::setw(11) << last.allocatedObjects
+              << std::setw(10) << last.allocatedBytes / 1024 << std::setw(9) << last.collections
+              << std::setprecision(3) << std::setw(10) << gcSeconds * 1e3;
+        if (auto it = baseline.find(benchmark.name); it != baseline.end()) {
+            const auto change = 100 * (result.seconds.median / it->second - 1);
+            table << std::setprecision(1) << std::showpos << std::setw(9) << change << "%"
+                  << std::noshowpos;
+            if (change > options.threshold) {
+                table << " slower";
+                regression = true;
+            } else if (change < -options.threshold) {
+                table << " faster";
+            }
+        }
+        table << std::defaultfloat << "\n";
+    }
+    return regression ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+// Before logger.h, which defines a `log` macro
+#include <cmath>
+
+#include "../vm/eva_executor.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+
+/*
+ * Throughput of the executor on CPU bound scripts with 1 to N worker
+ * threads: the same batch of jobs runs with every pool size, and the
+ * speedup is relative to one worker. A job computes fib(n) recursively,
+ * without allocating.
+ *
+ * Usage: eva_executor_scaling [jobs] [max threads] [n]
+ */
+
+int main(int argc, char **argv)
+{
+    const int jobs = argc > 1 ? std::atoi(argv[1]) : 64;
+    const size_t maxThreads = argc > 2 ? std::atoi(argv[2]) : std::thread::hardware_concurrency();
+    const int n = argc > 3 ? std::atoi(argv[3]) : 20;
+
+    const auto program = EvaVM::parse(R"#(
+    (def fib (n)
+        (if (< n 2)
+            n
+            (+ (fib (- n 1)) (fib (- n 2)))
+        ))
+    (fib )#" + std::to_string(n) + ")");
+    const double expected = std::round((std::pow((1 + std::sqrt(5)) / 2, n)) / std::sqrt(5));
+
+    std::cout << std::setw(8) << "threads" << std::setw(12) << "jobs/s" << std::setw(10)
+              << "speedup" << "\n";
+    double single = 0;
+    for (size_t threads = 1; threads <= std::max<size_t>(maxThreads, 1); ++threads) {
+        EvaExecutor::Options options;
+        options.threads = threads;
+        EvaExecutor executor(options);
+        // Warms up the workers: every one compiles the program once
+        std::vector<EvaExecutor::Ticket> tickets;
+        for (size_t i = 0; i < threads * 2; ++i) {
+            tickets.push_back(executor.submit(program));
+        }
+        for (auto &ticket : tickets) {
+            ticket.result.get();
+        }
+        tickets.clear();
+
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < jobs; ++i) {
+            tickets.push_back(executor.submit(program));
+        }
+        for (auto &ticket : tickets) {
+            const auto result = ticket.result.get();
+            if (std::get<double>(result.value) != expected) {
+                DIE << "eva_executor_scaling: wrong result " << std::get<double>(result.value);
+            }
+        }
+        const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        const auto throughput = jobs / seconds.count();
+        if (threads == 1) {
+            single = throughput;
+        }
+        std::cout << std::setw(8) << threads << std::fixed << std::setprecision(1)
+                  << std::setw(12) << throughput << std::setprecision(2) << std::setw(10)
+                  << throughput / single << std::defaultfloat << "\n";
+    }
+    return 0;
+}
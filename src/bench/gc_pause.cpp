@@ -0,0 +1,49 @@
+#include "../vm/evavm.h"
+
+/*
+ * Longest GC pause of a program that keeps a growing list of closures
+ * alive while allocating garbage, with the stop the world and with the
+ * incremental collector, sweeping on the interpreter thread or on a helper.
+ *
+ * The results go to stderr, stdout has the dumps of the compiler and of
+ * the collector: run with `eva_gc_pause > /dev/null`.
+ */
+
+namespace {
+const char *program = R"#(
+(def cons (head tail)
+    (begin
+        (def get (i) (if (= i 0) head tail))
+        get
+    ))
+(var list 0)
+(var n 0)
+(while (< n 20000)
+    (begin
+        (set list (cons n list))
+        (var garbage (+ "a" "b"))
+        (set n (+ n 1))
+    ))
+n
+)#";
+
+double maxPauseMs(const GCOptions &options)
+{
+    EvaVM vm;
+    vm.collector().setOptions(options);
+    vm.exec(program);
+    return vm.collector().telemetry().counters().maxPause.count() / 1e6;
+}
+} // namespace
+
+int main()
+{
+    std::cerr << "stop the world: max pause " << maxPauseMs(GCOptions{false}) << " ms\n";
+    std::cerr << "stop the world, concurrent sweep: max pause "
+              << maxPauseMs(GCOptions{false, 0, true}) << " ms\n";
+    for (size_t budget : {64, 256, 1024}) {
+        std::cerr << "incremental, budget " << budget << ": max pause "
+                  << maxPauseMs(GCOptions{true, budget}) << " ms\n";
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "../vm/eva_isolate.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+
+/*
+ * Message passing between isolates:
+ *  - latency of a round trip between two isolates playing ping-pong,
+ *  - messages per second from the host to a group of isolates which
+ *    receive them from a shared channel. The text of the strings is never
+ *    copied, the rate doesn't depend on their size: no bytes per second.
+ *
+ * Usage: eva_isolates [round trips] [messages] [isolates] [message bytes]
+ */
+
+static std::string channelVars(const EvaChannel &in, const EvaChannel &out)
+{
+    return "(var in " + std::to_string(in.id()) + ")(var out " + std::to_string(out.id()) + ")";
+}
+
+int main(int argc, char **argv)
+{
+    const int roundTrips = argc > 1 ? std::atoi(argv[1]) : 10000;
+    const int messages = argc > 2 ? std::atoi(argv[2]) : 100000;
+    const int isolates = argc > 3 ? std::atoi(argv[3]) : 4;
+    const size_t bytes = argc > 4 ? std::atoi(argv[4]) : 1 << 20;
+
+    {
+        auto pings = EvaChannel::create();
+        auto pongs = EvaChannel::create();
+        const auto count = std::to_string(roundTrips);
+        const auto start = std::chrono::steady_clock::now();
+        EvaIsolate ponger(channelVars(*pings, *pongs) + R"#(
+        (var i 0)
+        (while (< i )#" + count + R"#()
+            (begin
+                (send out (+ (receive in) 1))
+                (set i (+ i 1))
+            ))
+        i)#");
+        EvaIsolate pinger(channelVars(*pongs, *pings) + R"#(
+        (var i 0)
+        (while (< i )#" + count + R"#()
+            (begin
+                (send out i)
+                (set i (receive in))
+            ))
+        i)#");
+        pinger.join();
+        ponger.join();
+        const std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << "ping-pong: " << roundTrips << " round trips, " << std::fixed
+                  << std::setprecision(2) << elapsed.count() / roundTrips
+                  << " us per round trip\n"
+                  << std::defaultfloat;
+    }
+
+    {
+        auto work = EvaChannel::create();
+        auto done = EvaChannel::create();
+        // Every isolate takes its share of the messages from the channel
+        const auto share = std::to_string(messages / isolates);
+        std::vector<std::unique_ptr<EvaIsolate>> group;
+        for (int i = 0; i < isolates; ++i) {
+            group.push_back(std::make_unique<EvaIsolate>(channelVars(*work, *done) + R"#(
+            (var n 0)
+            (while (< n )#" + share + R"#()
+                (begin
+                    (receive in)
+                    (set n (+ n 1))
+                ))
+            (send out n)
+            n)#"));
+        }
+        const int sent = messages / isolates * isolates;
+        const auto text = std::make_shared<const std::string>(std::string(bytes, 'x'));
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < sent; ++i) {
+            work->send(text);
+        }
+        double received = 0;
+        for (int i = 0; i < isolates; ++i) {
+            received += std::get<double>(done->receive());
+        }
+        const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        if (received != sent) {
+            DIE << "eva_isolates: " << received << " messages received out of " << sent;
+        }
+        std::cout << "fan-out: " << sent << " messages of " << bytes << " bytes to "
+                  << isolates << " isolates, " << std::fixed << std::setprecision(0)
+                  << sent / seconds.count() << " messages/s\n" << std::defaultfloat;
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "../vm/eva_collector.h"
+
+#include <cstdlib>
+
+/*
+ * Time of the full collection marking a synthetic heap with 1 to N marking
+ * threads. The heap is a balanced binary tree: every node is a function
+ * with two cells pointing to the children, 2^(depth + 1) objects in all.
+ *
+ * Usage: eva_mark_scaling [depth] [max threads]
+ * The results go to stderr, stdout has the dumps of the collector.
+ */
+
+namespace {
+EvaValue buildTree(int depth)
+{
+    auto node = allocFunction(nullptr);
+    if (depth > 0) {
+        node.asFunction()->cells.push_back(allocCell(buildTree(depth - 1)).asCell());
+        node.asFunction()->cells.push_back(allocCell(buildTree(depth - 1)).asCell());
+    }
+    return node;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const int depth = argc > 1 ? std::atoi(argv[1]) : 19;
+    const size_t maxThreads = argc > 2 ? std::atoi(argv[2]) : std::thread::hardware_concurrency();
+
+    Traceable *root;
+    {
+        EvaHeap::PretenureScope pretenure;
+        root = buildTree(depth).asObject();
+    }
+    std::cerr << "heap of " << Traceable::objects.size() << " objects\n";
+
+    for (size_t threads = 1; threads <= std::max<size_t>(maxThreads, 1); ++threads) {
+        EvaCollector collector;
+        // The sweep runs on a helper thread, only the marking pause is timed
+        collector.setOptions(GCOptions{false, 0, true, threads});
+        const auto start = std::chrono::steady_clock::now();
+        collector.runGC([root](auto &&visit, bool) mutable { visit(root); });
+        const std::chrono::duration<double, std::milli> pause =
+            std::chrono::steady_clock::now() - start;
+        collector.waitForSweep();
+        std::cerr << threads << " marking threads: " << pause.count() << " ms\n";
+    }
+
+    Traceable::clear();
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "../vm/eva_image.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+
+/*
+ * Cost of starting a VM with a prelude: compiled by every VM, compiled
+ * once and shared, or loaded from an image file by every VM, like a new
+ * process would. Each VM runs a short program calling into the prelude.
+ * The heap bytes are those allocated by a VM until the end of its program.
+ *
+ * Usage: eva_vm_startup [vms] [prelude functions]
+ */
+
+int main(int argc, char **argv)
+{
+    const int vms = argc > 1 ? std::atoi(argv[1]) : 2000;
+    const int functions = argc > 2 ? std::atoi(argv[2]) : 50;
+
+    std::string prelude = "(var banner \"eva\")";
+    for (int i = 0; i < functions; ++i) {
+        const auto n = std::to_string(i);
+        prelude += "(def f" + n + " (x) (if (< x " + n + ") (+ x " + n + ") (* x 2)))";
+    }
+    const std::string program = "(+ (f0 1) (f" + std::to_string(functions - 1) + " 2))";
+
+    auto measure = [&](const char *name, auto &&boot) {
+        size_t bytes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < vms; ++i) {
+            const auto before = EvaHeap::allocatedBytesTotal();
+            auto vm = boot();
+            vm->setPrintListing(false);
+            vm->exec(program);
+            bytes += EvaHeap::allocatedBytesTotal() - before;
+        }
+        const std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << std::setw(10) << name << std::fixed << std::setprecision(1) << std::setw(12)
+                  << elapsed.count() / vms << " us/VM" << std::setw(12) << bytes / vms
+                  << " heap bytes/VM\n"
+                  << std::defaultfloat;
+    };
+
+    measure("compiled", [&] {
+        auto vm = std::make_unique<EvaVM>();
+        vm->setPrintListing(false);
+        vm->exec(prelude);
+        return vm;
+    });
+    const auto shared = EvaVM::compileShared({prelude});
+    measure("shared", [&] { return std::make_unique<EvaVM>(shared); });
+    std::cout << "shared code: " << shared->objects() << " frozen objects\n";
+
+    char path[] = "/tmp/eva_vm_startup_XXXXXX";
+    ::close(mkstemp(path));
+    {
+        std::ofstream out(path, std::ios::binary);
+        EvaImage::write(out, *shared);
+    }
+    measure("image", [&] { return std::make_unique<EvaVM>(EvaImage::load(path)); });
+    std::ifstream image(path, std::ios::binary | std::ios::ate);
+    std::cout << "image: " << image.tellg() << " bytes\n";
+    std::remove(path);
+    return 0;
+}
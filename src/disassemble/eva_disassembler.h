@@ -4,8 +4,10 @@
 #include "../vm/opcodes.h"
 
 #include <cstdio>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <string>
 
 class EvaDisassembler
 {
@@ -13,22 +15,47 @@ public:
     EvaDisassembler(std::shared_ptr<Globals> g)
         : m_globals(g){};
 
-    void disassemble(CodeObject *co)
+    // Text printed before an instruction, given its offset
+    using Annotation = std::function<std::string(size_t offset)>;
+
+    /*
+     * Prints the instructions of `co`, each prefixed by `annotate(offset)`
+     * when given; the header is prefixed by `annotate(SIZE_MAX)`. The
+     * source line is printed above the first instruction of each line.
+     */
+    void disassemble(CodeObject *co, std::ostream &out = std::cout, const Annotation &annotate = {})
     {
-        std::cout << "----------- Opcodes for " << co->name << " ------------------\n";
-        printf("%.4s %.2s %20s %s\n", "addr", "op", "name", "value");
+        out << "----------- Opcodes for " << co->name << " ------------------\n";
+        if (annotate)
+            out << annotate(SIZE_MAX);
+        out << format("%.4s %.2s %20s %s\n", "addr", "op", "name", "value");
         size_t offset = 0;
+        int line = 0;
         while (offset < co->code.size()) {
-            offset = disassembleInstruction(co, offset);
+            if (auto position = co->positions.at(offset); position.line != line) {
+                line = position.line;
+                out << "; line " << line << "\n";
+            }
+            if (annotate)
+                out << annotate(offset);
+            offset = disassembleInstruction(co, offset, out);
         }
-        std::cout << std::endl;
+        out << std::endl;
     }
 
 private:
-    size_t disassembleInstruction(CodeObject *co, size_t offset)
+    template<typename... Args>
+    static std::string format(const char *pattern, Args... args)
+    {
+        std::string text(snprintf(nullptr, 0, pattern, args...), '\0');
+        snprintf(text.data(), text.size() + 1, pattern, args...);
+        return text;
+    }
+
+    size_t disassembleInstruction(CodeObject *co, size_t offset, std::ostream &out)
     {
         auto op = co->code[offset];
-        printf("%04zX %02X %20s ", offset, op, opcodeToString(op).c_str());
+        out << format("%04zX %02X %20s ", offset, op, opcodeToString(op).c_str());
         switch (op) {
         case OP_HALT:
         case OP_ADD:
@@ -36,50 +63,85 @@ private:
         case OP_MUL:
         case OP_DIV:
         case OP_POP:
+        case OP_RESUME:
+        case OP_YIELD:
             break;
         case OP_CONST: {
             auto index = co->code[++offset];
-            printf("%4d (%s)", index, toString(co->constants[index]).c_str());
+            out << format("%4d (%s)", index, toString(co->constants[index]).c_str());
             break;
         }
         case OP_COMP:
         case OP_SCOPE_EXIT:
         case OP_CALL:
-            printf("%4d", co->code[++offset]);
+            out << format("%4d", co->code[++offset]);
             break;
         case OP_JMP: {
             uint16_t address = (co->code[offset + 1] << 8) | (co->code[offset + 2]);
             offset += 2;
-            printf("%04X", address);
+            out << format("%04X", address);
             break;
         }
         case OP_JMP_IF_FALSE: {
             uint16_t address = (co->code[offset + 1] << 8) | (co->code[offset + 2]);
             offset += 2;
-            printf("%04X", address);
+            out << format("%04X", address);
             break;
         }
         case OP_GET_GLOBAL: {
             auto index = co->code[++offset];
-            printf("%4d (%s)", index, m_globals->nameForIndex(index).c_str());
+            out << format("%4d (%s)", index, m_globals->nameForIndex(index).c_str());
             break;
         }
         case OP_SET_GLOBAL: {
             auto index = co->code[++offset];
-            printf("%4d (%s)", index, m_globals->nameForIndex(index).c_str());
+            out << format("%4d (%s)", index, m_globals->nameForIndex(index).c_str());
+            break;
+        }
+        case OP_GUARD_GLOBAL: {
+            auto index = co->code[offset + 1];
+            auto constant = co->code[offset + 2];
+            uint16_t address = (co->code[offset + 3] << 8) | (co->code[offset + 4]);
+            offset += 4;
+            out << format("%4d (%s) %d (%s) %04X", index, m_globals->nameForIndex(index).c_str(),
+                          constant, toString(co->constants[constant]).c_str(), address);
             break;
         }
         case OP_SET_LOCAL:
-        case OP_GET_LOCAL: {
+        case OP_GET_LOCAL:
+        case OP_MAKE_CELL:
+        case OP_GET_CELL:
+        case OP_SET_CELL: {
+            auto index = co->code[++offset];
+            out << format("%4d (%s)", index, localName(co, index).c_str());
+            break;
+        }
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE: {
+            auto index = co->code[++offset];
+            out << format("%4d (%s)", index, co->upvalues[index].name.c_str());
+            break;
+        }
+        case OP_CLOSURE: {
             auto index = co->code[++offset];
-            printf("%4d (%s)", index, co->locals[index].name.c_str());
+            out << format("%4d (%s)", index, co->constants[index].asCodeObject()->name.c_str());
             break;
         }
         }
-        printf("\n");
+        out << "\n";
         offset++;
         return offset;
     }
 
+    // Locals of finished blocks are already gone at disassembly time
+    std::string localName(CodeObject *co, uint8_t slot)
+    {
+        for (const auto &local : co->locals) {
+            if (local.slot == slot)
+                return local.name;
+        }
+        return "";
+    }
+
     std::shared_ptr<Globals> m_globals;
 };
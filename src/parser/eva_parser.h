@@ -67,6 +67,11 @@ struct Exp {
   std::string string;
   std::vector<Exp> list;
 
+  // Of the atom or of the opening parenthesis: lines from 1, columns from 0,
+  // line 0 when unknown
+  int line{0};
+  int column{0};
+
   Exp(double number) : type(ExpType::NUMBER), number(number) {}
   Exp(std::string str) {
     if (str[0] == '"') {
@@ -525,6 +530,11 @@ class eva_parser {
    */
   Tokenizer tokenizer;
 
+  /**
+   * The last shifted token, which locates the values of the actions.
+   */
+  SharedToken shiftedToken;
+
   /**
    * Previous state to calculate the next one.
    */
@@ -550,7 +560,7 @@ class eva_parser {
     statesStack.push_back(0);
 
     auto token = tokenizer.getNextToken();
-    auto shiftedToken = token;
+    shiftedToken = token;
 
     // Main parsing loop.
     for (;;) {
@@ -690,7 +700,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stod(_1)) ;
+auto __ = Exp(std::stod(_1)) ; __.line = parser.shiftedToken->startLine; __.column = parser.shiftedToken->startColumn;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -701,7 +711,7 @@ void _handler5(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1) ; __.line = parser.shiftedToken->startLine; __.column = parser.shiftedToken->startColumn;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -712,7 +722,7 @@ void _handler6(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1) ; __.line = parser.shiftedToken->startLine; __.column = parser.shiftedToken->startColumn;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -748,7 +758,7 @@ void _handler9(yyparse& parser) {
 // Semantic action prologue.
 
 
-auto __ = Exp(std::vector<Exp>{}) ;
+auto __ = Exp(std::vector<Exp>{}) ; __.line = parser.shiftedToken->startLine; __.column = parser.shiftedToken->startColumn;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -0,0 +1,322 @@
+#include "../vm/eva_heap_snapshot.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+/*
+ * Reads a snapshot written by EvaVM::writeHeapSnapshot() and reports:
+ * - the retained size by object type and by allocation site
+ * - the largest strings
+ * - the objects retaining the most memory, with a path from a root
+ *
+ * The retained size of an object is the memory freed if it was collected:
+ * its own size plus the size of the objects it dominates, i.e. the objects
+ * that are reachable from the roots only through it.
+ *
+ * Usage: eva_heap_analyzer snapshot [number of entries per table]
+ */
+
+namespace {
+struct Analysis
+{
+    // The nodes of the snapshot plus a synthetic root pointing to the roots
+    size_t root;
+    std::vector<uint32_t> dominator;
+    std::vector<size_t> retained;
+    // Parent on a shortest path from a root, for the reachable nodes
+    std::vector<uint32_t> parent;
+    std::vector<bool> reachable;
+};
+
+constexpr uint32_t NONE = UINT32_MAX;
+
+/*
+ * Dominators from "A Simple, Fast Dominance Algorithm" (Cooper, Harvey,
+ * Kennedy): iterate over the nodes in reverse postorder, intersecting the
+ * dominators of the processed predecessors, until nothing changes.
+ */
+Analysis analyze(const HeapSnapshot &snapshot)
+{
+    Analysis analysis;
+    const size_t count = snapshot.nodes.size() + 1;
+    analysis.root = count - 1;
+
+    std::vector<uint32_t> roots;
+    for (const auto &root : snapshot.roots) {
+        roots.push_back(root.node);
+    }
+    auto referencesOf = [&](uint32_t node) -> const std::vector<uint32_t> & {
+        return node == analysis.root ? roots : snapshot.nodes[node].references;
+    };
+
+    // Postorder without recursion, the heap may be deep
+    std::vector<uint32_t> postorder;
+    std::vector<uint32_t> order(count, NONE);
+    std::vector<bool> visited(count, false);
+    std::vector<std::pair<uint32_t, size_t>> stack{{analysis.root, 0}};
+    visited[analysis.root] = true;
+    while (!stack.empty()) {
+        auto &[node, next] = stack.back();
+        const auto &out = referencesOf(node);
+        if (next < out.size()) {
+            const auto successor = out[next++];
+            if (!visited[successor]) {
+                visited[successor] = true;
+                stack.push_back({successor, 0});
+            }
+            continue;
+        }
+        order[node] = postorder.size();
+        postorder.push_back(node);
+        stack.pop_back();
+    }
+
+    std::vector<std::vector<uint32_t>> predecessors(count);
+    for (auto node : postorder) {
+        for (auto successor : referencesOf(node)) {
+            predecessors[successor].push_back(node);
+        }
+    }
+
+    auto &dominator = analysis.dominator;
+    dominator.assign(count, NONE);
+    dominator[analysis.root] = analysis.root;
+    auto intersect = [&](uint32_t a, uint32_t b) {
+        while (a != b) {
+            while (order[a] < order[b])
+                a = dominator[a];
+            while (order[b] < order[a])
+                b = dominator[b];
+        }
+        return a;
+    };
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto it = postorder.rbegin() + 1; it != postorder.rend(); ++it) {
+            uint32_t idom = NONE;
+            for (auto predecessor : predecessors[*it]) {
+                if (dominator[predecessor] == NONE)
+                    continue;
+                idom = idom == NONE ? predecessor : intersect(predecessor, idom);
+            }
+            if (dominator[*it] != idom) {
+                dominator[*it] = idom;
+                changed = true;
+            }
+        }
+    }
+
+    // Children come before their dominator in postorder
+    analysis.retained.assign(count, 0);
+    for (auto node : postorder) {
+        if (node != analysis.root) {
+            analysis.retained[node] += snapshot.nodes[node].size;
+            analysis.retained[dominator[node]] += analysis.retained[node];
+        }
+    }
+
+    analysis.reachable = visited;
+    analysis.parent.assign(count, NONE);
+    std::vector<uint32_t> queue{uint32_t(analysis.root)};
+    std::vector<bool> seen(count, false);
+    seen[analysis.root] = true;
+    for (size_t i = 0; i < queue.size(); ++i) {
+        const auto node = queue[i];
+        for (auto successor : referencesOf(node)) {
+            if (!seen[successor]) {
+                seen[successor] = true;
+                analysis.parent[successor] = node;
+                queue.push_back(successor);
+            }
+        }
+    }
+    return analysis;
+}
+
+std::string describe(const HeapSnapshot &snapshot, uint32_t node)
+{
+    const auto &n = snapshot.nodes[node];
+    std::string description = std::string(objectTypeName(n.type)) + "#" + std::to_string(node);
+    if (!n.label.empty()) {
+        description += " \"" + n.label + "\"";
+    }
+    return description;
+}
+
+std::string siteName(const HeapSnapshot &snapshot, uint32_t site)
+{
+    if (site == 0 || site > snapshot.sites.size()) {
+        return "(unknown)";
+    }
+    const auto &s = snapshot.sites[site - 1];
+    return s.function + "+" + std::to_string(s.offset);
+}
+
+std::string rootPath(const HeapSnapshot &snapshot, const Analysis &analysis, uint32_t node)
+{
+    std::vector<uint32_t> path;
+    for (auto n = node; n != analysis.root; n = analysis.parent[n]) {
+        path.push_back(n);
+    }
+    std::string root = "?";
+    for (const auto &r : snapshot.roots) {
+        if (r.node == path.back()) {
+            root = r.label;
+            break;
+        }
+    }
+    // Long paths keep their ends
+    constexpr size_t ENDS = 4;
+    std::reverse(path.begin(), path.end());
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path.size() > 2 * ENDS + 1 && i == ENDS) {
+            root += " -> ... " + std::to_string(path.size() - 2 * ENDS) + " objects";
+            i = path.size() - ENDS - 1;
+            continue;
+        }
+        root += " -> " + describe(snapshot, path[i]);
+    }
+    return root;
+}
+
+struct Group
+{
+    size_t objects{0};
+    size_t shallow{0};
+    size_t retained{0};
+};
+
+/*
+ * Objects dominated by an object of the same group are already part of its
+ * retained size, so only the topmost ones add their retained size. The
+ * dominator tree is walked keeping the number of ancestors in each group.
+ */
+template<typename KeyOf>
+std::map<std::string, Group> groupBy(const HeapSnapshot &snapshot, const Analysis &analysis,
+                                     KeyOf keyOf)
+{
+    std::map<std::string, Group> groups;
+    std::vector<Group *> groupOf(snapshot.nodes.size(), nullptr);
+    std::vector<std::vector<uint32_t>> children(analysis.dominator.size());
+    for (uint32_t node = 0; node < snapshot.nodes.size(); ++node) {
+        if (analysis.reachable[node]) {
+            groupOf[node] = &groups[keyOf(node)];
+            children[analysis.dominator[node]].push_back(node);
+        }
+    }
+
+    std::map<const Group *, size_t> ancestors;
+    std::vector<std::pair<uint32_t, size_t>> stack{{uint32_t(analysis.root), 0}};
+    while (!stack.empty()) {
+        auto &[node, next] = stack.back();
+        if (next < children[node].size()) {
+            const auto child = children[node][next++];
+            auto group = groupOf[child];
+            group->objects++;
+            group->shallow += snapshot.nodes[child].size;
+            if (ancestors[group]++ == 0) {
+                group->retained += analysis.retained[child];
+            }
+            stack.push_back({child, 0});
+            continue;
+        }
+        if (node != analysis.root) {
+            ancestors[groupOf[node]]--;
+        }
+        stack.pop_back();
+    }
+    return groups;
+}
+
+void printGroups(const std::string &title, const std::map<std::string, Group> &groups, size_t top)
+{
+    std::vector<std::pair<std::string, Group>> sorted(groups.begin(), groups.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto &a, const auto &b) { return a.second.retained > b.second.retained; });
+    std::cout << "\n" << title << "\n";
+    std::cout << std::setw(12) << "retained" << std::setw(12) << "shallow" << std::setw(10)
+              << "objects" << "  name\n";
+    for (size_t i = 0; i < std::min(top, sorted.size()); ++i) {
+        const auto &[key, group] = sorted[i];
+        std::cout << std::setw(12) << group.retained << std::setw(12) << group.shallow
+                  << std::setw(10) << group.objects << "  " << key << "\n";
+    }
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " snapshot [number of entries per table]\n";
+        return 1;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open " << argv[1] << "\n";
+        return 1;
+    }
+    const size_t top = argc > 2 ? std::atoi(argv[2]) : 10;
+    const auto snapshot = HeapSnapshot::read(in);
+    const auto analysis = analyze(snapshot);
+
+    size_t total = 0, unreachable = 0, unreachableBytes = 0;
+    for (uint32_t node = 0; node < snapshot.nodes.size(); ++node) {
+        total += snapshot.nodes[node].size;
+        if (!analysis.reachable[node]) {
+            unreachable++;
+            unreachableBytes += snapshot.nodes[node].size;
+        }
+    }
+    std::cout << snapshot.nodes.size() << " objects, " << total << " bytes, "
+              << snapshot.roots.size() << " roots\n";
+    std::cout << "garbage not collected yet: " << unreachable << " objects, " << unreachableBytes
+              << " bytes\n";
+
+    auto byType = groupBy(snapshot, analysis, [&snapshot](uint32_t node) {
+        return std::string(objectTypeName(snapshot.nodes[node].type));
+    });
+    printGroups("By type:", byType, top);
+
+    auto bySite = groupBy(snapshot, analysis, [&snapshot](uint32_t node) {
+        return siteName(snapshot, snapshot.nodes[node].site);
+    });
+    printGroups("By allocation site:", bySite, top);
+
+    std::vector<uint32_t> strings;
+    for (uint32_t node = 0; node < snapshot.nodes.size(); ++node) {
+        if (snapshot.nodes[node].type == ObjectType::STRING) {
+            strings.push_back(node);
+        }
+    }
+    std::sort(strings.begin(), strings.end(), [&snapshot](uint32_t a, uint32_t b) {
+        return snapshot.nodes[a].size > snapshot.nodes[b].size;
+    });
+    std::cout << "\nLargest strings:\n";
+    for (size_t i = 0; i < std::min(top, strings.size()); ++i) {
+        std::cout << std::setw(12) << snapshot.nodes[strings[i]].size << "  "
+                  << describe(snapshot, strings[i]) << "\n";
+    }
+
+    // The dominator tree, summarized by its heaviest nodes
+    std::vector<uint32_t> dominators;
+    for (uint32_t node = 0; node < snapshot.nodes.size(); ++node) {
+        if (analysis.reachable[node]) {
+            dominators.push_back(node);
+        }
+    }
+    std::sort(dominators.begin(), dominators.end(), [&analysis](uint32_t a, uint32_t b) {
+        return analysis.retained[a] > analysis.retained[b];
+    });
+    std::cout << "\nLargest retained sizes:\n";
+    for (size_t i = 0; i < std::min(top, dominators.size()); ++i) {
+        const auto node = dominators[i];
+        std::cout << std::setw(12) << analysis.retained[node] << "  "
+                  << describe(snapshot, node) << "\n"
+                  << std::setw(14) << "" << rootPath(snapshot, analysis, node) << "\n";
+    }
+    return 0;
+}
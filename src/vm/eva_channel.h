@@ -0,0 +1,179 @@
+#pragma once
+
+#include "evavalue.h"
+#include "logger.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <variant>
+
+/*
+ * A value crossing from one isolate to another. Numbers and booleans are
+ * copied, strings keep their text in a buffer counted by reference: the
+ * receiving heap gets a new string object reading the same buffer.
+ */
+using EvaMessage = std::variant<double, bool, std::shared_ptr<const std::string>>;
+
+inline EvaMessage toMessage(const EvaValue &value)
+{
+    if (isNumber(value)) {
+        return value.asNumber();
+    }
+    if (isBool(value)) {
+        return value.asBool();
+    }
+    if (isString(value)) {
+        return value.asString()->share();
+    }
+    DIE << "VM: only numbers, booleans and strings can be sent, got " << toString(value);
+    return false;
+}
+
+// Allocates on the heap of the calling thread
+inline EvaValue fromMessage(const EvaMessage &message)
+{
+    if (auto number = std::get_if<double>(&message)) {
+        return NUMBER(*number);
+    }
+    if (auto boolean = std::get_if<bool>(&message)) {
+        return BOOLEAN(*boolean);
+    }
+    return allocString(std::get<std::shared_ptr<const std::string>>(message));
+}
+
+/*
+ * Unbounded queue of messages between threads, any number of senders and
+ * receivers. Host threads receive by blocking on a condition variable.
+ * VMs wait on the event loop instead: an eventfd is signaled while the
+ * queue isn't empty, so a script waiting for a message lets the other
+ * tasks of its VM run.
+ *
+ * Scripts name the channels by their id, like file descriptors: a channel
+ * is found by its id while the host holds it.
+ */
+class EvaChannel
+{
+public:
+    static std::shared_ptr<EvaChannel> create()
+    {
+        std::shared_ptr<EvaChannel> channel(new EvaChannel());
+        std::lock_guard<std::mutex> lock(registryMutex());
+        channel->m_id = s_nextId++;
+        registry()[channel->m_id] = channel;
+        return channel;
+    }
+
+    // nullptr once the channel is destroyed
+    static std::shared_ptr<EvaChannel> find(size_t id)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        auto it = registry().find(id);
+        return it != registry().end() ? it->second.lock() : nullptr;
+    }
+
+    ~EvaChannel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            registry().erase(m_id);
+        }
+        close(m_eventFd);
+    }
+
+    EvaChannel(const EvaChannel &) = delete;
+    EvaChannel &operator=(const EvaChannel &) = delete;
+
+    size_t id() const { return m_id; }
+
+    void send(EvaMessage message)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_messages.push_back(std::move(message));
+        }
+        m_received.notify_one();
+        signal();
+    }
+
+    // Blocks until a message comes
+    EvaMessage receive()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_received.wait(lock, [this] { return !m_messages.empty(); });
+        return take();
+    }
+
+    std::optional<EvaMessage> tryReceive()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_messages.empty())
+            return std::nullopt;
+        return take();
+    }
+
+    /*
+     * Readable while messages may be waiting. Readers clear it with
+     * clearSignal() before tryReceive(), which signals again when it
+     * leaves messages for the other readers.
+     */
+    int eventFd() const { return m_eventFd; }
+
+    void clearSignal()
+    {
+        uint64_t count;
+        [[maybe_unused]] auto n = read(m_eventFd, &count, sizeof(count));
+    }
+
+private:
+    EvaChannel()
+        : m_eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if (m_eventFd < 0) {
+            DIE << "Channel: cannot create the eventfd";
+        }
+    }
+
+    // Called with the lock held
+    EvaMessage take()
+    {
+        auto message = std::move(m_messages.front());
+        m_messages.pop_front();
+        if (!m_messages.empty()) {
+            signal();
+        }
+        return message;
+    }
+
+    void signal()
+    {
+        const uint64_t one = 1;
+        [[maybe_unused]] auto n = write(m_eventFd, &one, sizeof(one));
+    }
+
+    static std::mutex &registryMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::map<size_t, std::weak_ptr<EvaChannel>> &registry()
+    {
+        static std::map<size_t, std::weak_ptr<EvaChannel>> channels;
+        return channels;
+    }
+
+    static inline size_t s_nextId{1};
+
+    size_t m_id{0};
+    int m_eventFd;
+    std::mutex m_mutex;
+    std::condition_variable m_received;
+    std::deque<EvaMessage> m_messages;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include "evavalue.h"
+#include "globals.h"
+#include "logger.h"
+#include "opcodes.h"
+
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+/*
+ * A pure function and everything its calls can reach, out of any heap:
+ * the code objects with their constants, and the globals the code reads,
+ * by name. Built on the thread of the VM owning the function, immutable
+ * then: VMs of any thread load it into their own heap, without compiling.
+ *
+ * A function is pure when it can't change anything outside its own call:
+ * it sets no global, resumes or yields no coroutine, captures no variable,
+ * and only reads globals that are numbers, booleans, strings, pure
+ * functions or natives known to be pure. The globals are read when the
+ * image is built.
+ */
+class EvaCodeImage
+{
+public:
+    // A code object of the image, by index in codes()
+    struct CodeRef
+    {
+        size_t index;
+    };
+    // A function without captured variables over a code object of the image
+    struct FunctionRef
+    {
+        size_t index;
+    };
+    // Bound by name to the native of the VM loading the image
+    struct NativeRef
+    {
+        std::string name;
+    };
+    using Constant = std::variant<double, bool, std::shared_ptr<const std::string>, CodeRef,
+                                  FunctionRef, NativeRef>;
+
+    struct Code
+    {
+        std::string name;
+        int arity;
+        std::vector<uint8_t> code;
+        PositionTable positions;
+        std::vector<Constant> constants;
+        std::vector<UpvalueInfo> upvalues;
+        // Offsets of the global operands of OP_GET_GLOBAL and
+        // OP_GUARD_GLOBAL, relocated by load()
+        std::vector<size_t> globalOperands;
+    };
+
+    struct Global
+    {
+        std::string name;
+        Constant value;
+    };
+
+    /*
+     * Dies naming what makes `function` impure, `who` tells who asked.
+     * Strings are shared with the heap of the function, see
+     * StringObject::share().
+     */
+    static std::shared_ptr<const EvaCodeImage> ofPureFunction(
+        FunctionObject *function, Globals &globals, const std::set<std::string> &pureNatives,
+        const std::string &who)
+    {
+        auto image = std::make_shared<EvaCodeImage>();
+        Builder builder{*image, globals, pureNatives, who, {}, {}};
+        builder.addFunction(function);
+        return image;
+    }
+
+    /*
+     * The function in the heap of the current thread. The globals read by
+     * the code are set in `globals`, defined when missing: their indexes
+     * in the code are those of `globals`.
+     */
+    EvaValue load(Globals &globals) const
+    {
+        std::vector<size_t> globalIndexes;
+        for (const auto &global : m_globals) {
+            auto index = globals.getGlobalIndex(global.name);
+            if (!index) {
+                index = globals.define(global.name);
+            }
+            if (*index > UINT8_MAX) {
+                DIE << "Code image: no room for the global " << global.name;
+            }
+            globalIndexes.push_back(*index);
+        }
+
+        std::vector<CodeObject *> codes;
+        for (const auto &code : m_codes) {
+            auto co = allocCode(code.name, code.arity).asCodeObject();
+            co->code = code.code;
+            co->positions = code.positions;
+            co->upvalues = code.upvalues;
+            // The global index follows the opcode, see globalOperands
+            for (auto offset : code.globalOperands) {
+                co->code[offset] = uint8_t(globalIndexes[co->code[offset]]);
+            }
+            codes.push_back(co);
+        }
+        std::vector<EvaValue> functions(m_codes.size(), BOOLEAN(false));
+        auto value = [&](const Constant &constant) -> EvaValue {
+            if (auto number = std::get_if<double>(&constant)) {
+                return NUMBER(*number);
+            }
+            if (auto boolean = std::get_if<bool>(&constant)) {
+                return BOOLEAN(*boolean);
+            }
+            if (auto text = std::get_if<std::shared_ptr<const std::string>>(&constant)) {
+                return allocString(*text);
+            }
+            if (auto code = std::get_if<CodeRef>(&constant)) {
+                return EvaValue{.type = EvaValueType::OBJECT, .object = codes[code->index]};
+            }
+            if (auto function = std::get_if<FunctionRef>(&constant)) {
+                auto &loaded = functions[function->index];
+                if (!isObject(loaded)) {
+                    loaded = allocFunction(codes[function->index]);
+                }
+                return loaded;
+            }
+            const auto &name = std::get<NativeRef>(constant).name;
+            auto native = globals.getNativeFunction(name);
+            if (native == nullptr) {
+                DIE << "Code image: no native " << name;
+            }
+            return EvaValue{.type = EvaValueType::OBJECT, .object = native};
+        };
+        for (size_t i = 0; i < m_codes.size(); ++i) {
+            for (const auto &constant : m_codes[i].constants) {
+                codes[i]->constants.push_back(value(constant));
+            }
+        }
+        for (size_t i = 0; i < m_globals.size(); ++i) {
+            globals.set(globalIndexes[i], value(m_globals[i].value));
+        }
+        return value(FunctionRef{0});
+    }
+
+    const std::vector<Code> &codes() const { return m_codes; }
+    const std::vector<Global> &globals() const { return m_globals; }
+
+private:
+    struct Builder
+    {
+        EvaCodeImage &image;
+        Globals &globals;
+        const std::set<std::string> &pureNatives;
+        const std::string &who;
+        std::unordered_map<CodeObject *, size_t> codes;
+        std::unordered_map<size_t, size_t> globalSlots;
+
+        size_t addFunction(FunctionObject *function)
+        {
+            if (!function->cells.empty()) {
+                DIE << who << ": " << function->co->name << " captures variables, it isn't pure";
+            }
+            return addCode(function->co);
+        }
+
+        size_t addCode(CodeObject *co)
+        {
+            if (auto it = codes.find(co); it != codes.end()) {
+                return it->second;
+            }
+            const auto index = image.m_codes.size();
+            codes[co] = index;
+            image.m_codes.push_back({co->name, co->arity, co->code, co->positions, {}, co->upvalues, {}});
+
+            for (size_t offset = 0; offset < co->code.size();
+                 offset += 1 + operandBytes(co->code[offset])) {
+                switch (co->code[offset]) {
+                case OP_SET_GLOBAL:
+                    DIE << who << ": " << co->name << " sets the global "
+                        << globals.nameForIndex(co->code[offset + 1]) << ", it isn't pure";
+                    break;
+                case OP_RESUME:
+                case OP_YIELD:
+                    DIE << who << ": " << co->name << " runs coroutines, it isn't pure";
+                    break;
+                case OP_GET_GLOBAL:
+                case OP_GUARD_GLOBAL: {
+                    const auto slot = addGlobal(co->code[offset + 1]);
+                    image.m_codes[index].code[offset + 1] = uint8_t(slot);
+                    image.m_codes[index].globalOperands.push_back(offset + 1);
+                    break;
+                }
+                }
+            }
+            std::vector<Constant> constants;
+            for (const auto &constant : co->constants) {
+                constants.push_back(toConstant(constant, co->name));
+            }
+            image.m_codes[index].constants = std::move(constants);
+            return index;
+        }
+
+        // Index of the global in the image, the code refers to it by that
+        // index until load() relocates it
+        size_t addGlobal(size_t index)
+        {
+            if (auto it = globalSlots.find(index); it != globalSlots.end()) {
+                return it->second;
+            }
+            const auto slot = image.m_globals.size();
+            globalSlots[index] = slot;
+            const auto name = globals.nameForIndex(index);
+            image.m_globals.push_back({name, false});
+            auto value = toConstant(globals.get(index), name);
+            image.m_globals[slot].value = std::move(value);
+            return slot;
+        }
+
+        Constant toConstant(const EvaValue &value, const std::string &name)
+        {
+            if (isNumber(value)) {
+                return value.asNumber();
+            }
+            if (isBool(value)) {
+                return value.asBool();
+            }
+            switch (value.asObject()->type) {
+            case ObjectType::STRING:
+                return value.asString()->share();
+            case ObjectType::CODE:
+                return CodeRef{addCode(value.asCodeObject())};
+            case ObjectType::FUNCTION:
+                return FunctionRef{addFunction(value.asFunction())};
+            case ObjectType::NATIVE: {
+                const auto &native = value.asNativeFunction()->name;
+                if (pureNatives.count(native) == 0) {
+                    DIE << who << ": " << name << " calls the native " << native
+                        << ", which isn't pure";
+                }
+                return NativeRef{native};
+            }
+            default:
+                DIE << who << ": " << name << " reads " << toString(value) << ", it isn't pure";
+                return false;
+            }
+        }
+    };
+
+    std::vector<Code> m_codes;
+    std::vector<Global> m_globals;
+};
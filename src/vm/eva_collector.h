@@ -1,53 +1,588 @@
 #pragma once
 
+#include "eva_marker.h"
+#include "eva_telemetry.h"
 #include "evavalue.h"
+#include "logger.h"
 
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+struct GCOptions
+{
+    // Interleave the full collection with the program execution, in slices
+    // of at most `sliceBudget` objects marked or swept.
+    bool incremental{false};
+    size_t sliceBudget{256};
+    // Free the dead objects on a helper thread, the program resumes as soon
+    // as the marking is done. Not used with the compaction, nor while its
+    // chunks hold objects after it is disabled.
+    bool concurrentSweep{false};
+    // Threads tracing the heap in the marking pauses. The slices of the
+    // incremental marking are always traced by the interpreter thread.
+    size_t markThreads{1};
+    // The next full collection starts when the old space reaches
+    // `heapGrowthFactor` times the bytes that survived the last one, within
+    // [minHeap, maxHeap]. The program is stopped when the surviving objects
+    // don't fit in maxHeap.
+    double heapGrowthFactor{2.0};
+    size_t minHeap{256 * 1024};
+    size_t maxHeap{SIZE_MAX};
+    // Bytes allocated between two slices of the incremental collection
+    size_t sliceInterval{4096};
+    // Allocate the old space in chunks, and move the live objects to new
+    // chunks instead of sweeping once the holes left by the dead objects
+    // reach `fragmentationLimit` of the chunk space in use
+    bool compaction{false};
+    double fragmentationLimit{0.5};
+};
+
+/*
+ * Root visitors are callables `visitRoots(visit, youngOnly)` calling
+ * `visit(Traceable *&)` for every root. Roots are passed by reference so
+ * that the collector can update them when objects are moved. When
+ * `youngOnly` is true only the roots that may point to young objects are
+ * needed.
+ *
+ * Objects are white (not marked), gray (marked and waiting in m_gray or in
+ * EvaHeap::shadedObjects() to be traced) or black (marked and traced).
+ */
 class EvaCollector
 {
 public:
-    EvaCollector() = default;
+    EvaCollector() { setOptions(GCOptions{}); }
+    ~EvaCollector() { waitForSweep(); }
+
+    void setOptions(const GCOptions &options)
+    {
+        m_options = options;
+        EvaHeap::setOldSpaceChunks(options.compaction);
+        updateHeapLimit();
+        scheduleSafepoint();
+    }
+    const GCOptions &options() const { return m_options; }
+
+    EvaTelemetry &telemetry() { return m_telemetry; }
+
+    /*
+     * Called by the VM at its safepoints: runs a minor collection if the
+     * nursery is full and starts or continues the full collection.
+     */
+    template<typename RootVisitor>
+    void safepoint(RootVisitor &&visitRoots)
+    {
+        if (m_sweepDone) {
+            waitForSweep();
+        }
+
+        const auto start = Clock::now();
+        // Steps of an incremental collection add up to its pause
+        bool incrementalStep = EvaHeap::phase() != EvaHeap::Phase::IDLE;
+
+        switch (EvaHeap::phase()) {
+        case EvaHeap::Phase::IDLE:
+            // The marks of the previous cycle must be cleared before the
+            // next one, and the old space size is known after the sweep
+            if (!m_sweeper.joinable() && EvaHeap::oldBytes() >= m_nextFullGC) {
+                if (m_options.incremental) {
+                    startIncremental(visitRoots);
+                    incrementalStep = true;
+                } else {
+                    runGC(visitRoots);
+                }
+            } else if (EvaHeap::isNurseryFull()) {
+                minorCollection(visitRoots);
+            }
+            break;
+        case EvaHeap::Phase::MARKING: {
+            if (EvaHeap::isNurseryFull()) {
+                scavenge(visitRoots, m_cycle);
+            }
+            const auto markStart = Clock::now();
+            const bool marked = markSlice(m_options.sliceBudget);
+            m_cycle.markTime += Clock::now() - markStart;
+            if (marked) {
+                finishMarking(visitRoots);
+            }
+            break;
+        }
+        case EvaHeap::Phase::SWEEPING: {
+            if (EvaHeap::isNurseryFull()) {
+                scavenge(visitRoots, m_cycle);
+            }
+            const auto sweepStart = Clock::now();
+            const bool swept = sweepSlice(m_options.sliceBudget);
+            m_cycle.sweepTime += Clock::now() - sweepStart;
+            if (swept) {
+                EvaHeap::setPhase(EvaHeap::Phase::IDLE);
+            }
+            break;
+        }
+        }
+
+        if (incrementalStep) {
+            m_cycle.addPause(Clock::now() - start);
+            if (EvaHeap::phase() == EvaHeap::Phase::IDLE && !m_sweeper.joinable()) {
+                finishCycle();
+            }
+        }
+        scheduleSafepoint();
+    }
+
+    /*
+     * Minor collection: the young objects reachable from the roots and from
+     * the remembered set are moved to the old space, then the nursery is
+     * emptied. The cost depends only on the surviving young objects. The
+     * dead young objects are counted in `record`.
+     */
+    template<typename RootVisitor>
+    void scavenge(RootVisitor &&visitRoots, GCRecord &record)
+    {
+        std::vector<Traceable *> promoted;
+        auto evacuate = [&promoted](Traceable *&ref) {
+            if (ref == nullptr || !EvaHeap::isYoung(ref))
+                return;
+            if (ref->forward == nullptr) {
+                ref->forward = ref->moveTo(EvaHeap::allocateOld(ref->size));
+                promoted.push_back(ref->forward);
+            }
+            ref = ref->forward;
+        };
+
+        visitRoots(evacuate, true);
+        for (auto object : EvaHeap::rememberedSet()) {
+            forEachReference(object, evacuate);
+        }
+        // Promoted objects may point to other young objects
+        while (!promoted.empty()) {
+            auto object = promoted.back();
+            promoted.pop_back();
+            forEachReference(object, evacuate);
+            // Objects promoted during a cycle must survive it: while marking
+            // they are gray, because they may point to white objects
+            if (EvaHeap::phase() == EvaHeap::Phase::MARKING) {
+                EvaHeap::shade(object);
+            } else {
+                object->marked = EvaHeap::phase() == EvaHeap::Phase::SWEEPING;
+            }
+        }
 
-    // Use sets to eliminate duplicates
-    void runGC(std::set<Traceable *> roots)
+        EvaHeap::clearRememberedSet();
+        EvaHeap::forEachYoung([&record](Traceable *object) {
+            if (object->forward == nullptr) {
+                record.addFreed(object);
+            }
+        });
+        EvaHeap::resetNursery();
+    }
+
+    /*
+     * Stop the world full collection: the nursery is evacuated first,
+     * then the old space is marked and swept.
+     */
+    template<typename RootVisitor>
+    void runGC(RootVisitor &&visitRoots)
     {
-        std::cout << "---- Before GC stats ----\n";
-        Traceable::printStats();
-        mark(roots);
-        sweep();
-        std::cout << "---- After GC stats ----\n";
-        Traceable::printStats();
+        const auto start = Clock::now();
+        startCycle(false);
+        scavenge(visitRoots, m_cycle);
+        markRoots(visitRoots);
+        markAll();
+        const auto markEnd = Clock::now();
+        m_cycle.markTime = markEnd - start;
+
+        if (shouldCompact()) {
+            compact(visitRoots);
+        } else if (sweepsConcurrently()) {
+            startConcurrentSweep();
+        } else {
+            sweep();
+        }
+        const auto end = Clock::now();
+        if (!m_sweeper.joinable()) {
+            m_cycle.sweepTime = end - markEnd;
+        }
+        m_cycle.addPause(end - start);
+        if (!m_sweeper.joinable()) {
+            finishCycle();
+        }
+    }
+
+    /*
+     * Blocks until the helper thread has swept, then gives the surviving
+     * objects back to the old space.
+     */
+    void waitForSweep()
+    {
+        if (!m_sweeper.joinable())
+            return;
+        m_sweeper.join();
+        m_sweepDone = false;
+        Traceable::objects.splice(Traceable::objects.end(), m_sweeping);
+        EvaHeap::releaseSwept(m_swept.freedBytes);
+        m_cycle.sweepTime = m_swept.sweepTime;
+        m_cycle.freedBytes += m_swept.freedBytes;
+        for (size_t type = 0; type < OBJECT_TYPES; ++type) {
+            m_cycle.freedObjects[type] += m_swept.freedObjects[type];
+        }
+        finishCycle();
+    }
+
+    // Calls `visit(Traceable *&)` for every object referenced by `node`
+    template<typename Visitor>
+    static void forEachReference(Traceable *node, Visitor &&visit)
+    {
+        auto visitValue = [&visit](EvaValue &v) {
+            if (isObject(v)) {
+                Traceable *ref = v.object;
+                visit(ref);
+                v.object = static_cast<Object *>(ref);
+            }
+        };
+        auto visitPointer = [&visit](auto *&pointer) {
+            Traceable *ref = pointer;
+            visit(ref);
+            pointer = static_cast<std::remove_reference_t<decltype(pointer)>>(ref);
+        };
+        auto object = static_cast<Object *>(node);
+        switch (object->type) {
+        case ObjectType::CODE:
+            for (auto &c : static_cast<CodeObject *>(object)->constants)
+                visitValue(c);
+            break;
+        case ObjectType::FUNCTION: {
+            auto function = static_cast<FunctionObject *>(object);
+            Traceable *co = function->co;
+            visit(co);
+            function->co = static_cast<CodeObject *>(co);
+            for (auto &cell : function->cells) {
+                Traceable *ref = cell;
+                visit(ref);
+                cell = static_cast<CellObject *>(ref);
+            }
+            break;
+        }
+        case ObjectType::CELL:
+            visitValue(static_cast<CellObject *>(object)->value);
+            break;
+        case ObjectType::COROUTINE: {
+            auto coroutine = static_cast<CoroutineObject *>(object);
+            visitPointer(coroutine->function);
+            visitPointer(coroutine->resumer);
+            visitValue(coroutine->result);
+            if (coroutine->stack) {
+                for (auto slot = coroutine->stack.get(); slot < coroutine->context.sp; ++slot)
+                    visitValue(*slot);
+                for (auto frame = coroutine->frames.get(); frame < coroutine->context.fp; ++frame) {
+                    visitPointer(frame->co);
+                    visitPointer(frame->fn);
+                }
+                visitPointer(coroutine->context.frame.co);
+                visitPointer(coroutine->context.frame.fn);
+            }
+            break;
+        }
+        case ObjectType::STRING:
+        case ObjectType::NATIVE:
+            break;
+        }
     }
 
 private:
-    void mark(std::set<Traceable *> roots)
+    void shade(Traceable *ref)
+    {
+        // Young objects are traced when promoted
+        if (ref != nullptr && !ref->marked && !EvaHeap::isYoung(ref)) {
+            ref->marked = true;
+            m_gray.push_back(ref);
+        }
+    }
+
+    template<typename RootVisitor>
+    void markRoots(RootVisitor &&visitRoots)
+    {
+        visitRoots([this](Traceable *&ref) { shade(ref); }, false);
+    }
+
+    // Objects shaded by the write barrier and the allocator become gray
+    void takeShaded()
+    {
+        auto &shaded = EvaHeap::shadedObjects();
+        m_gray.insert(m_gray.end(), shaded.begin(), shaded.end());
+        shaded.clear();
+    }
+
+    // Traces up to `budget` gray objects, returns true when none is left
+    bool markSlice(size_t budget)
     {
-        std::vector<Traceable *> openNodes{roots.begin(), roots.end()};
+        takeShaded();
 
-        while (!openNodes.empty()) {
-            auto node = openNodes.back();
-            openNodes.pop_back();
-            // TODO: handle cases where we have objects pointing to each other
-            //            if (!node->marked) {
-            //                openNodes.push_back(childNodes(node));
-            //                node->marked = true;
-            //            }
-            node->marked = true;
+        for (size_t work = 0; work < budget && !m_gray.empty(); ++work) {
+            auto node = m_gray.back();
+            m_gray.pop_back();
+            forEachReference(node, [this](Traceable *&ref) { shade(ref); });
         }
+        return m_gray.empty();
     }
 
-    void sweep()
+    // Traces every gray object
+    void markAll()
     {
-        auto it = Traceable::objects.begin();
-        while (it != Traceable::objects.end()) {
+        if (m_options.markThreads <= 1) {
+            markSlice(SIZE_MAX);
+            return;
+        }
+        takeShaded();
+        ParallelMarker(m_options.markThreads).run(m_gray, [](Traceable *node, auto &&visit) {
+            forEachReference(node, visit);
+        });
+    }
+
+    template<typename RootVisitor>
+    void startIncremental(RootVisitor &&visitRoots)
+    {
+        startCycle(true);
+        scavenge(visitRoots, m_cycle);
+        EvaHeap::setPhase(EvaHeap::Phase::MARKING);
+        const auto markStart = Clock::now();
+        markRoots(visitRoots);
+        m_cycle.markTime += Clock::now() - markStart;
+    }
+
+    /*
+     * Final pause of the marking: the roots and the nursery are not covered
+     * by the write barrier, so the young objects are promoted (as gray
+     * objects) and the roots are traced again.
+     */
+    template<typename RootVisitor>
+    void finishMarking(RootVisitor &&visitRoots)
+    {
+        scavenge(visitRoots, m_cycle);
+        const auto markStart = Clock::now();
+        markRoots(visitRoots);
+        markAll();
+        const auto markEnd = Clock::now();
+        m_cycle.markTime += markEnd - markStart;
+        if (shouldCompact()) {
+            compact(visitRoots);
+            m_cycle.sweepTime += Clock::now() - markEnd;
+            EvaHeap::setPhase(EvaHeap::Phase::IDLE);
+            return;
+        }
+        if (sweepsConcurrently()) {
+            EvaHeap::setPhase(EvaHeap::Phase::IDLE);
+            startConcurrentSweep();
+            return;
+        }
+        EvaHeap::setPhase(EvaHeap::Phase::SWEEPING);
+        m_sweepCursor = Traceable::objects.begin();
+    }
+
+    // The sweeper frees with operator delete, the objects of the chunks are
+    // freed by the heap of the interpreter thread
+    bool sweepsConcurrently() const
+    {
+        return m_options.concurrentSweep && !m_options.compaction && EvaHeap::chunkBytes() == 0;
+    }
+
+    /*
+     * The marked objects are moved to a list owned by the helper thread:
+     * objects allocated meanwhile go to the empty Traceable::objects, so the
+     * two threads never share a list and allocations don't synchronize with
+     * the sweeper. The program doesn't reach the dead objects and doesn't
+     * read the marks until the next cycle, which waits for the sweep.
+     */
+    void startConcurrentSweep()
+    {
+        m_sweeping.splice(m_sweeping.end(), Traceable::objects);
+        m_swept = GCRecord{};
+        m_sweeper = std::thread([this] {
+            const auto start = Clock::now();
+            auto it = m_sweeping.begin();
+            while (it != m_sweeping.end()) {
+                auto t = *it;
+                if (t->marked) {
+                    t->marked = false;
+                    ++it;
+                    continue;
+                }
+                // Not `delete`: the heap counters belong to the interpreter
+                // thread, they are updated by waitForSweep()
+                m_swept.addFreed(t);
+                t->~Traceable();
+                ::operator delete(t);
+                it = m_sweeping.erase(it);
+            }
+            m_swept.sweepTime = Clock::now() - start;
+            m_sweepDone = true;
+        });
+    }
+
+    // Sweeps up to `budget` objects, returns true when the sweep is done
+    bool sweepSlice(size_t budget)
+    {
+        for (size_t work = 0; work < budget && m_sweepCursor != Traceable::objects.end();
+             ++work) {
+            m_sweepCursor = sweepObject(m_sweepCursor);
+        }
+        return m_sweepCursor == Traceable::objects.end();
+    }
+
+    bool shouldCompact() const
+    {
+        return m_options.compaction
+               && EvaHeap::fragmentation() >= m_options.fragmentationLimit;
+    }
+
+    /*
+     * Evacuating compaction, done instead of the sweep after the marking.
+     * The marked objects of the chunks are moved to new chunks, then the
+     * references to them are fixed in the roots and in the surviving
+     * objects, and the old chunks are freed with the dead objects.
+     */
+    template<typename RootVisitor>
+    void compact(RootVisitor &&visitRoots)
+    {
+        std::list<Traceable *> fromSpaceObjects;
+        fromSpaceObjects.splice(fromSpaceObjects.end(), Traceable::objects);
+        const auto fromSpace = EvaHeap::takeChunks();
+
+        m_cycle.compacted = true;
+        auto it = fromSpaceObjects.begin();
+        while (it != fromSpaceObjects.end()) {
             auto t = *it;
+            if (EvaHeap::contains(fromSpace, t)) {
+                if (t->marked) {
+                    t->forward = t->moveTo(EvaHeap::allocateOld(t->size));
+                    t->forward->marked = false;
+                } else {
+                    m_cycle.addFreed(t);
+                }
+                ++it;
+                continue;
+            }
+            // Allocated with malloc before the chunks were enabled, swept
+            // in place
             if (t->marked) {
                 t->marked = false;
-                ++it;
+                Traceable::objects.push_back(t);
             } else {
-                it = Traceable::objects.erase(it);
+                m_cycle.addFreed(t);
                 delete t;
             }
+            it = fromSpaceObjects.erase(it);
+        }
+
+        auto fixReference = [&fromSpace](Traceable *&ref) {
+            if (ref != nullptr && EvaHeap::contains(fromSpace, ref)) {
+                ref = ref->forward;
+            }
+        };
+        visitRoots(fixReference, false);
+        for (auto t : Traceable::objects) {
+            forEachReference(t, fixReference);
         }
+
+        // Moved and dead objects alike, the chunks are freed on return
+        size_t freedBytes = 0;
+        for (auto t : fromSpaceObjects) {
+            freedBytes += t->size;
+            t->~Traceable();
+        }
+        EvaHeap::releaseSwept(freedBytes);
     }
+
+    // Called after a full collection, when the old space holds live objects
+    void updateHeapLimit()
+    {
+        const auto live = EvaHeap::oldBytes();
+        if (live > m_options.maxHeap) {
+            DIE << "GC: " << live << " bytes are still alive, the maximum heap size is "
+                << m_options.maxHeap;
+        }
+        const auto limit = std::min(live * m_options.heapGrowthFactor, double(m_options.maxHeap));
+        m_nextFullGC = std::max(size_t(limit), m_options.minHeap);
+    }
+
+    // Sets when the allocations must reach the next safepoint
+    void scheduleSafepoint()
+    {
+        if (EvaHeap::phase() != EvaHeap::Phase::IDLE || m_sweeper.joinable()) {
+            // Next slice, or next check for the end of the concurrent sweep
+            EvaHeap::requestSafepointAfter(m_options.sliceInterval);
+        } else {
+            const auto oldBytes = EvaHeap::oldBytes();
+            EvaHeap::requestSafepointAfter(oldBytes < m_nextFullGC ? m_nextFullGC - oldBytes : 0);
+        }
+    }
+
+    template<typename RootVisitor>
+    void minorCollection(RootVisitor &&visitRoots)
+    {
+        const auto start = Clock::now();
+        GCRecord record;
+        record.bytesBefore = EvaHeap::youngBytes() + EvaHeap::oldBytes();
+        scavenge(visitRoots, record);
+        record.bytesAfter = EvaHeap::oldBytes();
+        record.addPause(Clock::now() - start);
+        m_telemetry.record(record);
+    }
+
+    void startCycle(bool incremental)
+    {
+        m_cycle = GCRecord{};
+        m_cycle.kind = GCRecord::Kind::FULL;
+        m_cycle.incremental = incremental;
+        m_cycle.bytesBefore = EvaHeap::youngBytes() + EvaHeap::oldBytes();
+    }
+
+    // The full collection is over, the old space only has live objects
+    void finishCycle()
+    {
+        updateHeapLimit();
+        m_cycle.bytesAfter = EvaHeap::youngBytes() + EvaHeap::oldBytes();
+        m_telemetry.record(m_cycle);
+    }
+
+    void sweep()
+    {
+        auto it = Traceable::objects.begin();
+        while (it != Traceable::objects.end()) {
+            it = sweepObject(it);
+        }
+    }
+
+    std::list<Traceable *>::iterator sweepObject(std::list<Traceable *>::iterator it)
+    {
+        auto t = *it;
+        if (t->marked) {
+            t->marked = false;
+            return ++it;
+        }
+        m_cycle.addFreed(t);
+        delete t;
+        return Traceable::objects.erase(it);
+    }
+
+    using Clock = std::chrono::steady_clock;
+
+    GCOptions m_options;
+    EvaTelemetry m_telemetry;
+    // Full collection in progress
+    GCRecord m_cycle;
+    // Size of the old space that triggers the next full collection
+    size_t m_nextFullGC{0};
+    std::vector<Traceable *> m_gray;
+    std::list<Traceable *>::iterator m_sweepCursor;
+
+    std::thread m_sweeper;
+    std::list<Traceable *> m_sweeping;
+    // Written by the helper thread, merged in m_cycle by waitForSweep()
+    GCRecord m_swept;
+    std::atomic<bool> m_sweepDone{false};
 };
@@ -6,25 +6,35 @@
 #include "globals.h"
 #include "opcodes.h"
 
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
 
 #define GEN_BINARY_OP(op) \
     do { \
-        generate(exp.list[1]); \
-        generate(exp.list[2]); \
-        emit(op); \
+        if (auto folded = foldConstant(exp); folded) { \
+            emitOp(OP_CONST); \
+            emit(getNumericConstant(folded.value())); \
+        } else { \
+            generate(exp.list[1]); \
+            generate(exp.list[2]); \
+            emitOp(op); \
+        } \
     } while (0)
 
 #define GEN_COMPARISON_OP(op) \
     do { \
         generate(exp.list[1]); \
         generate(exp.list[2]); \
-        emit(OP_COMP); \
+        emitOp(OP_COMP); \
         emit(uint8_t(op)); \
     } while (0)
 
+// Inlined bodies are measured in AST nodes
+constexpr size_t DEFAULT_INLINE_BUDGET = 24;
+constexpr int MAX_INLINE_DEPTH = 4;
+
 class EvaCompiler
 {
 public:
@@ -34,22 +44,42 @@ public:
 
     CodeObject *compile(const Value &input, std::string name_tag)
     {
+        // Code objects and constants live as long as the program
+        EvaHeap::PretenureScope pretenure;
+
         co = createCodeObject(std::move(name_tag), 0).asCodeObject();
 
+        // Find out which variables escape into inner functions before generating
+        // any code: only those will be boxed into cells.
+        m_capturedDeclarations.clear();
+        m_assignedNames.clear();
+        m_globalDeclarations.clear();
+        m_inlineCandidates.clear();
+        m_position = {};
+        analyzeCaptures(input, co->name == "main", 0);
+
         generate(input);
 
-        emit(OP_HALT);
+        emitOp(OP_HALT);
 
-        EvaDisassembler disasm(m_globals);
-        for (auto co : m_codeObjects) {
-            disasm.disassemble(co);
+        if (m_printListing) {
+            EvaDisassembler disasm(m_globals);
+            for (auto co : m_codeObjects) {
+                disasm.disassemble(co);
+            }
         }
 
         return co;
     }
 
-    void generate(Exp exp)
+    void generate(const Exp &exp)
     {
+        // Instructions are located at the innermost expression from the
+        // source, the desugared ones have no position
+        const auto enclosing = m_position;
+        if (exp.line > 0) {
+            m_position = {exp.line, exp.column};
+        }
         // Use a switch because it makes debugging easier
         switch (exp.type) {
         case ExpType::NUMBER:
@@ -65,19 +95,89 @@ public:
             genList(exp);
             break;
         }
+        m_position = enclosing;
+    }
+    /*
+     * The objects created by the compiler are roots for the collector.
+     * `visit(Traceable *&)` may move them, the references are updated.
+     */
+    template<typename Visitor>
+    void visitObjects(Visitor &&visit)
+    {
+        std::set<Traceable *> constantObjects;
+        for (auto object : m_constantObjects) {
+            visit(object);
+            constantObjects.insert(object);
+        }
+        m_constantObjects = std::move(constantObjects);
+        for (auto &code : m_codeObjects) {
+            Traceable *ref = code;
+            visit(ref);
+            code = static_cast<CodeObject *>(ref);
+        }
+        Traceable *ref = co;
+        visit(ref);
+        co = static_cast<CodeObject *>(ref);
     }
-    std::set<Traceable *> getConstantObjects() { return m_constantObjects; }
+
+    /*
+     * Calls to small global functions are replaced by their body, `budget`
+     * is the maximum size of an inlined body in AST nodes. 0 disables inlining.
+     */
+    void setInlineBudget(size_t budget) { m_inlineBudget = budget; }
+
+    // Print the listing of the code objects on stdout after compiling, on by default
+    void setPrintListing(bool print) { m_printListing = print; }
 
 private:
     void emit(uint8_t opcode) { co->code.push_back(opcode); }
+    // Emit an opcode tracking its effect on the stack, operands are emitted with emit()
+    void emitOp(uint8_t opcode)
+    {
+        co->positions.add(co->code.size(), m_position);
+        emit(opcode);
+        co->stackDepth += stackEffect(opcode);
+    }
+    void emitScopeExit(uint8_t count)
+    {
+        emitOp(OP_SCOPE_EXIT);
+        emit(count);
+        co->stackDepth -= count;
+    }
+    static int stackEffect(uint8_t opcode)
+    {
+        switch (opcode) {
+        case OP_CONST:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_CELL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+            return 1;
+        case OP_HALT:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_COMP:
+        case OP_JMP_IF_FALSE:
+        case OP_POP:
+        case OP_RESUME:
+            return -1;
+        default:
+            // Stores leave the value on the stack, OP_CALL and OP_SCOPE_EXIT
+            // depend on their operand and are accounted by their generators
+            return 0;
+        }
+    }
     void genNumber(const Exp &exp)
     {
-        emit(OP_CONST);
+        emitOp(OP_CONST);
         emit(getNumericConstant(exp.number));
     }
     void genString(const Exp &exp)
     {
-        emit(OP_CONST);
+        emitOp(OP_CONST);
         emit(getStringConstant(exp.string));
     }
     /*
@@ -86,19 +186,25 @@ private:
     void genSymbol(const Exp &exp)
     {
         if (exp.string == "true" || exp.string == "false") {
-            emit(OP_CONST);
+            emitOp(OP_CONST);
             emit(getBoolConstant(exp.string == "true" ? true : false));
         }
         // Handle variables
         else {
             // Handle local variables first
-            if (const auto localIndex = co->getLocalIndex(exp.string); localIndex) {
-                emit(OP_GET_LOCAL);
-                emit(localIndex.value());
+            if (const auto local = co->getLocal(exp.string); local) {
+                emitOp(local->captured ? OP_GET_CELL : OP_GET_LOCAL);
+                emit(local->slot);
+            }
+            // Variables captured from an enclosing function
+            else if (const auto upvalueIndex = resolveUpvalue(co, m_enclosing.size(), exp.string);
+                     upvalueIndex) {
+                emitOp(OP_GET_UPVALUE);
+                emit(upvalueIndex.value());
             }
             // Then try if it is a global variable
             else if (const auto globalIndex = m_globals->getGlobalIndex(exp.string); globalIndex) {
-                emit(OP_GET_GLOBAL);
+                emitOp(OP_GET_GLOBAL);
                 emit(globalIndex.value());
             } else
                 DIE << "[Compiler] Unkown global variable " << exp.string;
@@ -120,13 +226,13 @@ private:
             // Handle comparison operators
             // eg. (< 5 10)
             else if (comparison.count(op) > 0) {
-                GEN_COMPARISON_OP(comparison[op]);
+                GEN_COMPARISON_OP(comparison.at(op));
             }
             // (if <test> <true_branch> <false_branch>)
             else if (op == "if") {
                 generate(exp.list[1]);
 
-                emit(OP_JMP_IF_FALSE);
+                emitOp(OP_JMP_IF_FALSE);
 
                 // placeholder bytes for 16-bit address
                 emit(0);
@@ -134,11 +240,12 @@ private:
 
                 // get the address where the placeholder bytes are
                 auto jmpIfFalseAddress = getCurrentOffset() - 2;
+                const auto branchDepth = co->stackDepth;
 
                 // generate code for true_branch
                 generate(exp.list[2]);
 
-                emit(OP_JMP);
+                emitOp(OP_JMP);
                 // placeholder to jump over false_branch code
                 emit(0);
                 emit(0);
@@ -146,7 +253,8 @@ private:
 
                 auto falseBranchAddress = getCurrentOffset();
 
-                // generate false_branch code
+                // generate false_branch code, only one of the branches pushes its value
+                co->stackDepth = branchDepth;
                 generate(exp.list[3]);
 
                 patchAddress(jmpIfFalseAddress, falseBranchAddress);
@@ -157,18 +265,18 @@ private:
                 generate(exp.list[2]);
                 const auto &varName = exp.list[1].string;
                 if (!co->isGlobalScope()) {
-                    co->addLocal(varName);
-                    // The trick here is that it's not possible to have something on the stack
-                    // that are not variables, we use this fact to store the index in the bytecode.
-
-                    // Actually we don't need to emit a store when declaring the variable
-                    // because the value is already there
-                    //                    emit(OP_SET_LOCAL);
-                    //                    emit(co->getLocalIndex(varName).value());
+                    // The value just generated is on the top of the stack, that
+                    // slot becomes the variable: no store is needed.
+                    const uint8_t slot = co->stackDepth - 1;
+                    co->addLocal(varName, slot, isCaptured(exp));
+                    if (isCaptured(exp)) {
+                        emitOp(OP_MAKE_CELL);
+                        emit(slot);
+                    }
                 } else {
                     const auto idx = m_globals->define(varName);
                     if (idx) {
-                        emit(OP_SET_GLOBAL);
+                        emitOp(OP_SET_GLOBAL);
                         emit(idx.value());
                     }
                 }
@@ -176,16 +284,24 @@ private:
             // (set <variable> <value>)
             else if (op == "set") {
                 const auto &varName = exp.list[1].string;
-                if (auto idx = co->getLocalIndex(varName); idx) {
+                if (auto local = co->getLocal(varName); local) {
+                    // Read the local before generating the value, which may add locals
+                    const auto slot = local->slot;
+                    const auto opcode = local->captured ? OP_SET_CELL : OP_SET_LOCAL;
                     generate(exp.list[2]);
-                    emit(OP_SET_LOCAL);
-                    emit(idx.value());
+                    emitOp(opcode);
+                    emit(slot);
+                } else if (auto upvalueIndex = resolveUpvalue(co, m_enclosing.size(), varName);
+                           upvalueIndex) {
+                    generate(exp.list[2]);
+                    emitOp(OP_SET_UPVALUE);
+                    emit(upvalueIndex.value());
                 } else {
                     // Global variables
                     const auto index = m_globals->getGlobalIndex(varName);
                     if (index) {
                         generate(exp.list[2]);
-                        emit(OP_SET_GLOBAL);
+                        emitOp(OP_SET_GLOBAL);
                         emit(index.value());
                     }
                 }
@@ -193,28 +309,40 @@ private:
             // (def <name> (<parameters>) <expressions>)
             else if (op == "def") {
                 auto name = exp.list[1].string;
-                auto parameters = exp.list[2].list;
+                const auto &parameters = exp.list[2].list;
                 auto arity = parameters.size();
-                auto body = exp.list[3];
+                const auto &body = exp.list[3];
 
                 // Allocate code object
                 auto prevCo = co;
                 auto newCode = createCodeObject(name, parameters.size());
                 prevCo->addConst(newCode);
+                const auto codeIndex = prevCo->constants.size() - 1;
                 // Define the name for the function so that we can refer
-                // to it recursively
-                if (co->isGlobalScope()) {
+                // to it recursively. Local functions are declared once their
+                // value is on the stack, inside the body the function refers
+                // to itself through slot 0.
+                const bool isGlobal = co->isGlobalScope();
+                if (isGlobal) {
                     m_globals->define(name);
-                } else {
-                    co->addLocal(name);
                 }
 
                 // Now start generating code for the new function
+                m_enclosing.push_back(prevCo);
                 co = newCode.asCodeObject();
 
-                co->addLocal(name);
+                // The callee and its arguments are at the bottom of the frame
+                co->addLocal(name, 0, isCaptured(exp.list[1]));
                 for (int i = 0; i < parameters.size(); ++i) {
-                    co->addLocal(parameters[i].string);
+                    co->addLocal(parameters[i].string, i + 1, isCaptured(parameters[i]));
+                }
+                co->stackDepth = arity + 1;
+                // Captured parameters are boxed on function entry
+                for (const auto &local : co->locals) {
+                    if (local.captured) {
+                        emitOp(OP_MAKE_CELL);
+                        emit(local.slot);
+                    }
                 }
 
                 // generate code
@@ -224,29 +352,44 @@ private:
                 // to generate the instruction to pop all the parameters and
                 // the function name
                 if (!isBlock(body)) {
-                    emit(OP_SCOPE_EXIT);
-                    emit(arity + 1);
+                    emitScopeExit(arity + 1);
                 }
 
-                emit(OP_RETURN);
-
-                auto fn = allocFunction(newCode.asCodeObject());
-                m_constantObjects.insert(fn.asFunction());
+                emitOp(OP_RETURN);
 
                 // Now emit code in the previous function to store
                 // the function index
                 co = prevCo;
-                co->addConst(fn);
+                m_enclosing.pop_back();
 
-                emit(OP_CONST);
-                emit(co->constants.size() - 1);
+                EvaValue fn = BOOLEAN(false);
+                if (newCode.asCodeObject()->upvalues.empty()) {
+                    // No captured variables: the function object can be shared
+                    fn = allocFunction(newCode.asCodeObject());
+                    m_constantObjects.insert(fn.asFunction());
+                    co->addConst(fn);
 
-                if (co->isGlobalScope()) {
-                    emit(OP_SET_GLOBAL);
+                    emitOp(OP_CONST);
+                    emit(co->constants.size() - 1);
+                } else {
+                    // A new closure is created each time the definition is evaluated
+                    emitOp(OP_CLOSURE);
+                    emit(codeIndex);
+                }
+
+                if (isGlobal) {
+                    emitOp(OP_SET_GLOBAL);
                     emit(m_globals->getGlobalIndex(name).value());
+                    if (isObject(fn) && isInlineCandidate(exp)) {
+                        m_inlineCandidates[name] = {&exp, fn};
+                    }
                 } else {
-                    emit(OP_SET_LOCAL);
-                    emit(co->getLocalIndex(name).value());
+                    const uint8_t slot = co->stackDepth - 1;
+                    co->addLocal(name, slot, isCaptured(exp));
+                    if (isCaptured(exp)) {
+                        emitOp(OP_MAKE_CELL);
+                        emit(slot);
+                    }
                 }
             }
             // (begin <expression>)
@@ -262,7 +405,7 @@ private:
                     // We have generated a value on the stack, now
                     // we need to pop it except for the last one
                     if (i != lastElement && !(isLocalDeclaration || isFunction))
-                        emit(OP_POP);
+                        emitOp(OP_POP);
                     if (i == lastElement && isLocalDeclaration)
                         DIE << "[Compiler] Blocks must end with a value, not a variable "
                                "declaration";
@@ -274,7 +417,7 @@ private:
                 auto loopStart = getCurrentOffset();
 
                 generate(exp.list[1]);
-                emit(OP_JMP_IF_FALSE);
+                emitOp(OP_JMP_IF_FALSE);
 
                 // placeholder bytes for 16-bit address
                 emit(0);
@@ -283,19 +426,49 @@ private:
                 // get the address where the placeholder bytes are
                 auto loopEndJumpAddress = getCurrentOffset() - 2;
 
-                // generate code for <expression>
+                // generate code for <expression>, its value is dropped
+                // at every iteration so that the stack doesn't grow
                 generate(exp.list[2]);
+                emitOp(OP_POP);
 
-                emit(OP_JMP);
+                emitOp(OP_JMP);
                 // Go back to loop start
                 emit(0);
                 emit(0);
                 patchAddress(getCurrentOffset() - 2, loopStart);
-                patchAddress(loopEndJumpAddress, getCurrentOffset() + 1);
+                patchAddress(loopEndJumpAddress, getCurrentOffset());
+
+                // Like every expression the loop has a value: the failed test
+                emitOp(OP_CONST);
+                emit(getBoolConstant(false));
+            }
+            // (resume <coroutine> <value>): runs the coroutine until it
+            // yields or returns, `value` is the result of its pending yield
+            else if (op == "resume") {
+                if (exp.list.size() != 2 && exp.list.size() != 3)
+                    DIE << "[Compiler] resume expects a coroutine and an optional value";
+                generate(exp.list[1]);
+                if (exp.list.size() == 3) {
+                    generate(exp.list[2]);
+                } else {
+                    emitOp(OP_CONST);
+                    emit(getBoolConstant(false));
+                }
+                emitOp(OP_RESUME);
+            }
+            // (yield <value>): `value` is the result of the resume, out of
+            // a coroutine the program is suspended for the host
+            else if (op == "yield") {
+                if (exp.list.size() != 2)
+                    DIE << "[Compiler] yield expects a value";
+                generate(exp.list[1]);
+                emitOp(OP_YIELD);
             }
             // Function calls:
             // (square 2)
-            else {
+            else if (!tryInline(exp)) {
+                checkNativeArity(exp);
+
                 // Push the function on the stack
                 generate(exp.list[0]);
 
@@ -304,8 +477,29 @@ private:
                     generate(exp.list[i]);
                 }
 
-                emit(OP_CALL);
+                // The callee and the arguments are replaced by the result
+                emitOp(OP_CALL);
                 emit(exp.list.size() - 1);
+                co->stackDepth -= exp.list.size() - 1;
+            }
+        }
+    }
+
+    /*
+     * Calls to natives with a fixed global binding are checked here, so the
+     * mistake is reported before running the program.
+     */
+    void checkNativeArity(const Exp &exp)
+    {
+        const auto &callee = exp.list[0];
+        if (callee.type != ExpType::SYMBOL || isVisibleLocal(callee.string)) {
+            return;
+        }
+        if (auto native = m_globals->getNativeFunction(callee.string); native) {
+            const int args = exp.list.size() - 1;
+            if (native->arity != args) {
+                DIE << "[Compiler] Native " << native->name << " expects " << native->arity
+                    << " arguments, got " << args;
             }
         }
     }
@@ -328,7 +522,7 @@ private:
                 return i;
             }
         }
-        co->constants.push_back(NUMBER(value));
+        co->addConst(NUMBER(value));
         return co->constants.size() - 1;
     }
 
@@ -340,7 +534,19 @@ private:
                 return i;
             }
         }
-        co->constants.push_back(BOOLEAN(value));
+        co->addConst(BOOLEAN(value));
+        return co->constants.size() - 1;
+    }
+
+    int getObjectConstant(EvaValue value)
+    {
+        for (int i = 0; i < co->constants.size(); i++) {
+            const auto c = co->constants[i];
+            if (isObject(c) && c.asObject() == value.asObject()) {
+                return i;
+            }
+        }
+        co->addConst(value);
         return co->constants.size() - 1;
     }
 
@@ -353,31 +559,355 @@ private:
             }
         }
         auto str = allocString(value);
-        co->constants.push_back(str);
+        co->addConst(str);
         m_constantObjects.insert(str.asString());
         return co->constants.size() - 1;
     }
 
+    /*
+     * Looks up `name` in the functions enclosing `code`, adding the upvalue
+     * to every function in between. `depth` is the number of entries of
+     * m_enclosing that surround `code`.
+     */
+    std::optional<size_t> resolveUpvalue(CodeObject *code, size_t depth, const std::string &name)
+    {
+        if (depth == 0)
+            return {};
+
+        auto enclosing = m_enclosing[depth - 1];
+        if (auto local = enclosing->getLocal(name); local) {
+            if (!local->captured)
+                DIE << "[Compiler] Variable " << name << " captured but not boxed";
+            return code->addUpvalue(name, true, local->slot);
+        }
+        if (auto upvalueIndex = resolveUpvalue(enclosing, depth - 1, name); upvalueIndex) {
+            return code->addUpvalue(name, false, upvalueIndex.value());
+        }
+        return {};
+    }
+
+    /*
+     * Escape analysis: mirrors the scoping rules of the code generator and
+     * records the declarations (var, def or parameter expressions) that are
+     * referenced from an inner function. Variables in the global scope are
+     * never boxed because they are reachable through the globals table.
+     */
+    struct CaptureScope
+    {
+        bool isGlobal{false};
+        bool isFunction{false};
+        std::map<std::string, const Exp *> declarations;
+    };
+
+    void analyzeCaptures(const Exp &exp, bool isMain, int level)
+    {
+        if (exp.type == ExpType::SYMBOL) {
+            resolveCapture(exp.string);
+            return;
+        }
+        if (exp.type != ExpType::LIST || exp.list.empty())
+            return;
+
+        const auto &head = exp.list[0];
+        const auto op = head.type == ExpType::SYMBOL ? head.string : "";
+        if (op == "var") {
+            analyzeCaptures(exp.list[2], isMain, level);
+            declareCapture(exp.list[1].string, &exp);
+        } else if (op == "set") {
+            // Assigned names can't be inlined, the function may change
+            m_assignedNames.insert(exp.list[1].string);
+            resolveCapture(exp.list[1].string);
+            analyzeCaptures(exp.list[2], isMain, level);
+        } else if (op == "def") {
+            declareCapture(exp.list[1].string, &exp);
+            m_captureScopes.push_back({.isGlobal = false, .isFunction = true, .declarations = {}});
+            declareCapture(exp.list[1].string, &exp.list[1]);
+            for (const auto &param : exp.list[2].list) {
+                declareCapture(param.string, &param);
+            }
+            analyzeCaptures(exp.list[3], false, 0);
+            m_captureScopes.pop_back();
+        } else if (op == "begin") {
+            m_captureScopes.push_back(
+                {.isGlobal = isMain && level == 0, .isFunction = false, .declarations = {}});
+            for (size_t i = 1; i < exp.list.size(); ++i) {
+                analyzeCaptures(exp.list[i], isMain, level + 1);
+            }
+            m_captureScopes.pop_back();
+        } else {
+            // Operators, if, while and function calls: visit every
+            // operand, including the callee of a call.
+            const bool isBuiltin = op == "+" || op == "-" || op == "*" || op == "/"
+                                   || comparison.count(op) > 0 || op == "if"
+                                   || op == "while" || op == "resume" || op == "yield";
+            for (size_t i = isBuiltin ? 1 : 0; i < exp.list.size(); ++i) {
+                analyzeCaptures(exp.list[i], isMain, level);
+            }
+        }
+    }
+
+    void declareCapture(const std::string &name, const Exp *declaration)
+    {
+        if (m_captureScopes.empty())
+            return;
+        m_captureScopes.back().declarations[name] = declaration;
+        if (m_captureScopes.back().isGlobal)
+            m_globalDeclarations[name]++;
+    }
+
+    void resolveCapture(const std::string &name)
+    {
+        bool crossedFunction = false;
+        for (auto scope = m_captureScopes.rbegin(); scope != m_captureScopes.rend(); ++scope) {
+            if (auto it = scope->declarations.find(name); it != scope->declarations.end()) {
+                if (crossedFunction && !scope->isGlobal)
+                    m_capturedDeclarations.insert(it->second);
+                return;
+            }
+            if (scope->isFunction)
+                crossedFunction = true;
+        }
+    }
+
+    bool isCaptured(const Exp &declaration)
+    {
+        return m_capturedDeclarations.count(&declaration) > 0;
+    }
+
+    /*
+     * Function inlining: a call to a global function defined with a small
+     * body is replaced by the body itself, the arguments are bound to fresh
+     * locals of the caller. Arguments that are literals are substituted in
+     * the body instead, so that constant folding can see them.
+     *
+     * The code outlives the program and the global can be rebound by the
+     * next ones: the body is guarded by OP_GUARD_GLOBAL, which calls the
+     * function of the global when it isn't the inlined one anymore.
+     */
+    bool isInlineCandidate(const Exp &def)
+    {
+        const auto &name = def.list[1].string;
+        const auto &body = def.list[3];
+        return m_inlineBudget > 0 && m_assignedNames.count(name) == 0
+               && m_globalDeclarations[name] == 1 && countNodes(body) <= m_inlineBudget
+               && !containsSymbol(body, name) && !containsTag(body, "def");
+    }
+
+    bool tryInline(const Exp &call)
+    {
+        const auto &callee = call.list[0];
+        if (callee.type != ExpType::SYMBOL || m_inlineDepth >= MAX_INLINE_DEPTH)
+            return false;
+        auto candidate = m_inlineCandidates.find(callee.string);
+        if (candidate == m_inlineCandidates.end())
+            return false;
+
+        const auto &def = *candidate->second.def;
+        const auto &parameters = def.list[2].list;
+        const auto &body = def.list[3];
+        if (parameters.size() != call.list.size() - 1)
+            return false;
+
+        // The body must see the same bindings it sees in its own function:
+        // neither the callee nor the names the body uses may be shadowed here.
+        std::set<std::string> names{callee.string};
+        collectSymbols(body, names);
+        for (const auto &param : parameters) {
+            names.erase(param.string);
+        }
+        for (const auto &name : names) {
+            if (isVisibleLocal(name))
+                return false;
+        }
+
+        m_inlineDepth++;
+        co->enterBlock();
+        std::map<std::string, Exp> substitutions;
+        for (size_t i = 0; i < parameters.size(); ++i) {
+            const auto &param = parameters[i].string;
+            const auto &arg = call.list[i + 1];
+            if (isLiteral(arg) && !containsAssignment(body, param)) {
+                substitutions.emplace(param, arg);
+            } else {
+                generate(arg);
+                co->addLocal(param, co->stackDepth - 1);
+            }
+        }
+
+        // The body is the one of the function the global holds now: later
+        // programs may rebind it, the code then calls the new function
+        emitOp(OP_GUARD_GLOBAL);
+        emit(m_globals->getGlobalIndex(callee.string).value());
+        emit(getObjectConstant(candidate->second.function));
+        emit(0);
+        emit(0);
+        const auto guardAddress = getCurrentOffset() - 2;
+        const auto argsDepth = co->stackDepth;
+
+        generate(substitutions.empty() ? body : substitute(body, substitutions));
+
+        emitOp(OP_JMP);
+        emit(0);
+        emit(0);
+        const auto endJumpAddress = getCurrentOffset() - 2;
+
+        // The call, with the arguments already evaluated
+        patchAddress(guardAddress, getCurrentOffset());
+        co->stackDepth = argsDepth;
+        generate(callee);
+        for (size_t i = 0; i < parameters.size(); ++i) {
+            if (substitutions.count(parameters[i].string) > 0) {
+                generate(call.list[i + 1]);
+            } else {
+                emitOp(OP_GET_LOCAL);
+                emit(co->getLocal(parameters[i].string)->slot);
+            }
+        }
+        emitOp(OP_CALL);
+        emit(parameters.size());
+        co->stackDepth -= parameters.size();
+        patchAddress(endJumpAddress, getCurrentOffset());
+
+        // Drop the arguments, keeping the value of the body or the call
+        if (auto count = co->variableNumberInCurrentBlock(); count > 0) {
+            emitScopeExit(count);
+        }
+        co->exitBlock();
+        m_inlineDepth--;
+        return true;
+    }
+
+    bool isVisibleLocal(const std::string &name)
+    {
+        if (co->getLocal(name))
+            return true;
+        for (auto enclosing : m_enclosing) {
+            if (enclosing->getLocal(name))
+                return true;
+        }
+        return false;
+    }
+
+    static bool isLiteral(const Exp &exp)
+    {
+        return exp.type == ExpType::NUMBER || exp.type == ExpType::STRING
+               || (exp.type == ExpType::SYMBOL && (exp.string == "true" || exp.string == "false"));
+    }
+
+    static size_t countNodes(const Exp &exp)
+    {
+        size_t count = 1;
+        for (const auto &e : exp.list) {
+            count += countNodes(e);
+        }
+        return count;
+    }
+
+    static void collectSymbols(const Exp &exp, std::set<std::string> &symbols)
+    {
+        if (exp.type == ExpType::SYMBOL)
+            symbols.insert(exp.string);
+        for (const auto &e : exp.list) {
+            collectSymbols(e, symbols);
+        }
+    }
+
+    static bool containsSymbol(const Exp &exp, const std::string &name)
+    {
+        if (exp.type == ExpType::SYMBOL)
+            return exp.string == name;
+        return std::any_of(exp.list.begin(), exp.list.end(), [&name](const Exp &e) {
+            return containsSymbol(e, name);
+        });
+    }
+
+    bool containsTag(const Exp &exp, const std::string &tag)
+    {
+        if (isTagList(exp, tag))
+            return true;
+        return std::any_of(exp.list.begin(), exp.list.end(), [&](const Exp &e) {
+            return containsTag(e, tag);
+        });
+    }
+
+    // True if `name` is declared or assigned in `exp`
+    bool containsAssignment(const Exp &exp, const std::string &name)
+    {
+        if ((isTagList(exp, "var") || isTagList(exp, "set")) && exp.list[1].string == name)
+            return true;
+        return std::any_of(exp.list.begin(), exp.list.end(), [&](const Exp &e) {
+            return containsAssignment(e, name);
+        });
+    }
+
+    static Exp substitute(const Exp &exp, const std::map<std::string, Exp> &substitutions)
+    {
+        if (exp.type == ExpType::SYMBOL) {
+            auto it = substitutions.find(exp.string);
+            return it != substitutions.end() ? it->second : exp;
+        }
+        if (exp.type != ExpType::LIST)
+            return exp;
+        std::vector<Exp> list;
+        list.reserve(exp.list.size());
+        for (const auto &e : exp.list) {
+            list.push_back(substitute(e, substitutions));
+        }
+        return Exp(std::move(list));
+    }
+
+    /*
+     * Evaluates arithmetic on numeric literals at compile time
+     */
+    std::optional<double> foldConstant(const Exp &exp)
+    {
+        if (exp.type == ExpType::NUMBER)
+            return exp.number;
+        if (exp.type != ExpType::LIST || exp.list.size() != 3
+            || exp.list[0].type != ExpType::SYMBOL)
+            return {};
+
+        const auto &op = exp.list[0].string;
+        if (op != "+" && op != "-" && op != "*" && op != "/")
+            return {};
+        const auto op1 = foldConstant(exp.list[1]);
+        if (!op1)
+            return {};
+        const auto op2 = foldConstant(exp.list[2]);
+        if (!op2)
+            return {};
+
+        switch (op[0]) {
+        case '+':
+            return op1.value() + op2.value();
+        case '-':
+            return op1.value() - op2.value();
+        case '*':
+            return op1.value() * op2.value();
+        default:
+            return op1.value() / op2.value();
+        }
+    }
+
     void exitBlock()
     {
         auto varsCount = co->variableNumberInCurrentBlock();
-        if (varsCount > 0 || co->arity > 0) {
-            emit(OP_SCOPE_EXIT);
+        if (varsCount > 0 || isFunctionBody()) {
             if (isFunctionBody()) {
                 varsCount += co->arity + 1;
             }
-            emit(varsCount);
+            emitScopeExit(varsCount);
         }
         co->exitBlock();
     }
 
     bool isFunctionBody() { return co->name != "main" && co->currentLevel == 1; }
 
-    bool isVarDeclaration(Exp exp) { return isTagList(exp, "var"); }
-    const bool isFunctionDeclaration(Exp exp) { return isTagList(exp, "def"); };
-    bool isBlock(Exp exp) { return isTagList(exp, "begin"); }
+    bool isVarDeclaration(const Exp &exp) { return isTagList(exp, "var"); }
+    bool isFunctionDeclaration(const Exp &exp) { return isTagList(exp, "def"); };
+    bool isBlock(const Exp &exp) { return isTagList(exp, "begin"); }
 
-    bool isTagList(Exp exp, const std::string &tag)
+    bool isTagList(const Exp &exp, const std::string &tag)
     {
         return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL
                && exp.list[0].string == tag;
@@ -392,14 +922,33 @@ private:
     }
 
     CodeObject *co{nullptr};
+    // Functions being compiled around `co`, outermost first
+    std::vector<CodeObject *> m_enclosing;
+    std::vector<CaptureScope> m_captureScopes;
+    std::set<const Exp *> m_capturedDeclarations;
+    std::set<std::string> m_assignedNames;
+    std::map<std::string, int> m_globalDeclarations;
+    struct InlineCandidate
+    {
+        const Exp *def;
+        // The function the definition sets, to guard the inlined bodies
+        EvaValue function;
+    };
+    // Global functions that can be inlined, valid for the program being compiled
+    std::map<std::string, InlineCandidate> m_inlineCandidates;
+    size_t m_inlineBudget{DEFAULT_INLINE_BUDGET};
+    int m_inlineDepth{0};
+    // Of the expression being generated
+    SourcePosition m_position;
+    bool m_printListing{true};
     std::shared_ptr<Globals> m_globals;
     std::vector<CodeObject *> m_codeObjects;
     std::set<Traceable *> m_constantObjects;
 
-    static std::map<std::string, ComparisonType> comparison;
+    static const std::map<std::string, ComparisonType> comparison;
 };
 
-std::map<std::string, ComparisonType> EvaCompiler::comparison{
+const std::map<std::string, ComparisonType> EvaCompiler::comparison{
     {">", ComparisonType::GT},
     {">=", ComparisonType::GE},
     {"<", ComparisonType::LT},
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/*
+ * Single threaded event loop over epoll: callbacks run once when a file
+ * descriptor is ready, or when a timer expires. Timers are timerfds, so
+ * the loop waits on a single epoll descriptor for everything.
+ *
+ * Every watch is one-shot: a callback that wants more events watches
+ * again. A descriptor can have a reader and a writer waiting at the same
+ * time, not two of the same kind.
+ */
+class EvaEventLoop
+{
+public:
+    using Callback = std::function<void()>;
+
+    EvaEventLoop()
+        : m_epoll(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (m_epoll < 0) {
+            DIE << "event loop: cannot create the epoll descriptor";
+        }
+    }
+
+    ~EvaEventLoop()
+    {
+        clear();
+        close(m_epoll);
+    }
+
+    EvaEventLoop(const EvaEventLoop &) = delete;
+    EvaEventLoop &operator=(const EvaEventLoop &) = delete;
+
+    // Calls `callback` once when `fd` can be read without blocking
+    void whenReadable(int fd, Callback callback) { watch(fd, EPOLLIN, std::move(callback)); }
+
+    // Calls `callback` once when `fd` can be written without blocking
+    void whenWritable(int fd, Callback callback) { watch(fd, EPOLLOUT, std::move(callback)); }
+
+    // Calls `callback` once after `delay`
+    void after(std::chrono::milliseconds delay, Callback callback)
+    {
+        const int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer < 0) {
+            DIE << "event loop: cannot create a timer";
+        }
+        // A zero it_value disarms the timer, the shortest delay is 1ns
+        const auto ns = std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count(), 1);
+        itimerspec spec{};
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+        timerfd_settime(timer, 0, &spec, nullptr);
+        m_timers.insert(timer);
+        watch(timer, EPOLLIN, std::move(callback));
+    }
+
+    // No callback left to run
+    bool idle() const { return m_watches.empty(); }
+
+    /*
+     * Waits up to `timeoutMs`, -1 forever, for ready descriptors and runs
+     * their callbacks. Returns the number of callbacks run, 0 when idle.
+     */
+    size_t runOnce(int timeoutMs = -1)
+    {
+        if (idle())
+            return 0;
+        epoll_event events[EVENTS];
+        int count;
+        do {
+            count = epoll_wait(m_epoll, events, EVENTS, timeoutMs);
+        } while (count < 0 && errno == EINTR);
+        if (count < 0) {
+            DIE << "event loop: epoll_wait failed, errno " << errno;
+        }
+
+        // Take the callbacks first, they may watch the same descriptors again
+        std::vector<Callback> ready;
+        for (int i = 0; i < count; ++i) {
+            const int fd = events[i].data.fd;
+            auto it = m_watches.find(fd);
+            if (it == m_watches.end())
+                continue;
+            // Errors and hang ups wake both sides, the callbacks see them
+            // when they read or write
+            const auto happened = events[i].events;
+            if (happened & (EPOLLIN | EPOLLERR | EPOLLHUP) && it->second.reader) {
+                ready.push_back(std::move(it->second.reader));
+                it->second.reader = nullptr;
+            }
+            if (happened & (EPOLLOUT | EPOLLERR | EPOLLHUP) && it->second.writer) {
+                ready.push_back(std::move(it->second.writer));
+                it->second.writer = nullptr;
+            }
+            update(fd, it);
+        }
+        for (auto &callback : ready) {
+            callback();
+        }
+        return ready.size();
+    }
+
+    // Runs until idle
+    void run()
+    {
+        while (!idle()) {
+            runOnce();
+        }
+    }
+
+    // Drops every callback without running it
+    void clear()
+    {
+        for (auto &[fd, watch] : m_watches) {
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        m_watches.clear();
+        for (auto timer : m_timers) {
+            close(timer);
+        }
+        m_timers.clear();
+    }
+
+private:
+    struct Watch
+    {
+        Callback reader;
+        Callback writer;
+    };
+
+    void watch(int fd, uint32_t event, Callback callback)
+    {
+        auto [it, added] = m_watches.try_emplace(fd);
+        auto &slot = event == EPOLLIN ? it->second.reader : it->second.writer;
+        if (slot) {
+            DIE << "event loop: descriptor " << fd << " is already watched for "
+                << (event == EPOLLIN ? "reading" : "writing");
+        }
+        slot = std::move(callback);
+        epoll_event ev{};
+        ev.events = interest(it->second);
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epoll, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) < 0) {
+            DIE << "event loop: cannot watch descriptor " << fd << ", errno " << errno;
+        }
+    }
+
+    static uint32_t interest(const Watch &watch)
+    {
+        return (watch.reader ? uint32_t(EPOLLIN) : 0u) | (watch.writer ? uint32_t(EPOLLOUT) : 0u);
+    }
+
+    // After callbacks were taken: stops watching `fd` or watches what is left
+    void update(int fd, std::unordered_map<int, Watch>::iterator it)
+    {
+        if (it->second.reader || it->second.writer) {
+            epoll_event ev{};
+            ev.events = interest(it->second);
+            ev.data.fd = fd;
+            epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &ev);
+            return;
+        }
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        m_watches.erase(it);
+        if (m_timers.erase(fd) > 0) {
+            close(fd);
+        }
+    }
+
+    static constexpr int EVENTS = 64;
+
+    int m_epoll;
+    std::unordered_map<int, Watch> m_watches;
+    // Descriptors of the timers, closed once expired
+    std::unordered_set<int> m_timers;
+};
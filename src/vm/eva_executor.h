@@ -0,0 +1,235 @@
+#pragma once
+
+#include "evavm.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <variant>
+#include <vector>
+
+/*
+ * Runs batches of independent scripts on a pool of threads. Every worker
+ * owns a VM on the heap of its thread. A program is parsed once by
+ * submit() and shared by the workers, each worker compiles it on its first
+ * run and keeps the code for the next ones. Every job starts with the
+ * globals the VM of its worker had once set up, see EvaVM::saveGlobals():
+ * a job never sees the globals of the previous ones.
+ *
+ * Every worker has a deque of jobs: submit() deals the jobs to the deques
+ * in turn, a worker runs the newest job of its own deque first and steals
+ * the oldest job of another deque when its own is empty. submit() blocks
+ * while `queueLimit` jobs wait, so a producer can't outrun the workers.
+ *
+ * A job cancelled before it starts never runs. A running job checks its
+ * cancellation every `slice` units of fuel, see EvaVM::setFuel().
+ *
+ * Besides programs, hosts submit tasks: functions of the VM of the worker,
+ * which read no object of another heap.
+ */
+class EvaExecutor
+{
+public:
+    struct Options
+    {
+        size_t threads{std::thread::hardware_concurrency()};
+        size_t queueLimit{1024};
+        size_t slice{100000};
+        GCOptions gc{};
+        // Registered in the VM of every worker
+        std::vector<EvaVM::NativeSpec> natives{};
+        // The workers boot on it, see EvaVM::compileShared()
+        std::shared_ptr<const EvaSharedCode> code{};
+    };
+
+    struct Result
+    {
+        enum class Status {
+            DONE,
+            CANCELLED,
+        };
+        Status status;
+        // The heap of a worker is private to its thread: strings and other
+        // objects are returned as their text
+        std::variant<double, bool, std::string> value;
+    };
+
+    struct Ticket
+    {
+        std::future<Result> result;
+        std::shared_ptr<std::atomic<bool>> cancelled;
+
+        void cancel() const { cancelled->store(true, std::memory_order_relaxed); }
+    };
+
+    EvaExecutor()
+        : EvaExecutor(Options{})
+    {}
+
+    explicit EvaExecutor(Options options)
+        : m_options(std::move(options))
+        , m_deques(std::max<size_t>(m_options.threads, 1))
+    {
+        for (size_t id = 0; id < m_deques.size(); ++id) {
+            m_workers.emplace_back([this, id] { work(id); });
+        }
+    }
+
+    // Runs the jobs already submitted, then stops the workers
+    ~EvaExecutor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_workAvailable.notify_all();
+        for (auto &worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    EvaExecutor(const EvaExecutor &) = delete;
+    EvaExecutor &operator=(const EvaExecutor &) = delete;
+
+    size_t threads() const { return m_workers.size(); }
+
+    Ticket submit(const std::string &program) { return submit(EvaVM::parse(program)); }
+
+    Ticket submit(EvaVM::Program program) { return submit(Job{std::move(program), {}}); }
+
+    // Runs on a worker, with its VM
+    using Task = std::function<Result(EvaVM &)>;
+
+    Ticket submit(Task task) { return submit(Job{{}, std::move(task)}); }
+
+private:
+    struct Job
+    {
+        EvaVM::Program program;
+        Task task;
+        std::promise<Result> result{};
+        std::shared_ptr<std::atomic<bool>> cancelled{std::make_shared<std::atomic<bool>>(false)};
+    };
+
+    struct JobDeque
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    Ticket submit(Job job)
+    {
+        Ticket ticket{job.result.get_future(), job.cancelled};
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_spaceAvailable.wait(lock, [this] { return m_queued < m_options.queueLimit; });
+            ++m_queued;
+        }
+        auto &deque = m_deques[m_nextDeque++ % m_deques.size()];
+        {
+            std::lock_guard<std::mutex> lock(deque.mutex);
+            deque.jobs.push_back(std::move(job));
+        }
+        m_workAvailable.notify_one();
+        return ticket;
+    }
+
+    void work(size_t id)
+    {
+        // Created on this thread, the objects of the VM are on its heap
+        auto owned = m_options.code ? std::make_unique<EvaVM>(m_options.code)
+                                    : std::make_unique<EvaVM>();
+        auto &vm = *owned;
+        vm.setPrintListing(false);
+        vm.collector().setOptions(m_options.gc);
+        vm.registerNatives(m_options.natives);
+        vm.setFuel(m_options.slice);
+        vm.saveGlobals();
+        while (auto job = next(id)) {
+            job->result.set_value(run(vm, *job));
+        }
+    }
+
+    static Result run(EvaVM &vm, const Job &job)
+    {
+        if (job.cancelled->load(std::memory_order_relaxed)) {
+            return {Result::Status::CANCELLED, false};
+        }
+        vm.restoreGlobals();
+        if (job.task) {
+            return job.task(vm);
+        }
+        auto value = vm.exec(job.program);
+        while (vm.suspended()) {
+            if (job.cancelled->load(std::memory_order_relaxed)) {
+                return {Result::Status::CANCELLED, false};
+            }
+            value = vm.resume();
+        }
+        if (isNumber(value)) {
+            return {Result::Status::DONE, value.asNumber()};
+        }
+        if (isBool(value)) {
+            return {Result::Status::DONE, value.asBool()};
+        }
+        return {Result::Status::DONE, isString(value) ? value.asCppString() : toString(value)};
+    }
+
+    // The next job for worker `id`, nothing once the executor stops
+    std::optional<Job> next(size_t id)
+    {
+        for (;;) {
+            if (auto job = take(id)) {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    --m_queued;
+                }
+                m_spaceAvailable.notify_one();
+                return job;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workAvailable.wait(lock, [this] { return m_queued > 0 || m_stopping; });
+            if (m_queued == 0) {
+                return std::nullopt;
+            }
+        }
+    }
+
+    // Newest job of its own deque, or oldest job of another one
+    std::optional<Job> take(size_t id)
+    {
+        for (size_t i = 0; i < m_deques.size(); ++i) {
+            auto &deque = m_deques[(id + i) % m_deques.size()];
+            std::lock_guard<std::mutex> lock(deque.mutex);
+            if (deque.jobs.empty())
+                continue;
+            Job job;
+            if (i == 0) {
+                job = std::move(deque.jobs.back());
+                deque.jobs.pop_back();
+            } else {
+                job = std::move(deque.jobs.front());
+                deque.jobs.pop_front();
+            }
+            return job;
+        }
+        return std::nullopt;
+    }
+
+    Options m_options;
+    std::vector<JobDeque> m_deques;
+    std::vector<std::thread> m_workers;
+    std::atomic<size_t> m_nextDeque{0};
+
+    // Counts the jobs waiting in the deques
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_spaceAvailable;
+    size_t m_queued{0};
+    bool m_stopping{false};
+};
@@ -0,0 +1,196 @@
+#include "eva_heap.h"
+#include "evavalue.h"
+#include "logger.h"
+
+thread_local std::unique_ptr<uint8_t[]> EvaHeap::s_nursery;
+thread_local std::vector<Traceable *> EvaHeap::s_remembered;
+thread_local std::vector<Traceable *> EvaHeap::s_shaded;
+thread_local EvaHeap::Chunks EvaHeap::s_chunks;
+
+void EvaHeap::setNurserySize(size_t bytes)
+{
+    if (s_youngObjects > 0) {
+        DIE << "Heap: the nursery can only be resized when empty";
+    }
+    s_nurserySize = bytes;
+    s_nursery.reset(bytes > 0 ? new uint8_t[bytes] : nullptr);
+    s_nurseryStart = s_nurseryTop = s_nursery.get();
+    s_nurseryFull = false;
+}
+
+void *EvaHeap::allocate(size_t size)
+{
+    const auto alignedSize = EvaHeap::alignedSize(size);
+    s_allocatedObjectsTotal++;
+    s_allocatedBytesTotal += size;
+    if (size >= s_safepointCountdown) {
+        s_safepointCountdown = SIZE_MAX;
+        requestSafepoint();
+    } else {
+        s_safepointCountdown -= size;
+    }
+
+    if (s_pretenure == 0 && s_nurserySize > 0) {
+        if (s_nurseryStart == nullptr) {
+            setNurserySize(s_nurserySize);
+        }
+        if (s_nurseryTop + alignedSize <= s_nurseryStart + s_nurserySize) {
+            auto object = s_nurseryTop;
+            s_nurseryTop += alignedSize;
+            s_youngObjects++;
+            s_newHeader = {size, false, s_allocationSite};
+            Traceable::bytesAllocated += size;
+            return object;
+        }
+        // Allocations can't collect: ask for a minor collection at the next
+        // safepoint and keep going in the old space meanwhile.
+        s_nurseryFull = true;
+        requestSafepoint();
+    }
+
+    auto object = allocateOld(size);
+    s_newHeader = {size, s_phase != Phase::IDLE, s_allocationSite};
+    // While marking, the fields are not initialized yet: the object is
+    // gray and will be traced by the collector
+    if (s_phase == Phase::MARKING) {
+        s_shaded.push_back((Traceable *) object);
+    }
+    // Until the next minor collection the new object may be initialized
+    // with pointers to young objects. It is not constructed yet, so its
+    // `remembered` flag can't be used: it may end up twice in the set,
+    // which is harmless.
+    if (s_nurserySize > 0) {
+        s_remembered.push_back((Traceable *) object);
+    }
+    return object;
+}
+
+void *EvaHeap::allocateOld(size_t size)
+{
+    void *object = s_useChunks ? allocateInChunk(alignedSize(size)) : ::operator new(size);
+    Traceable::objects.push_back((Traceable *) object);
+    Traceable::bytesAllocated += size;
+    s_oldBytes += size;
+    return object;
+}
+
+void EvaHeap::requestSafepointAfter(size_t bytes)
+{
+    s_safepointRequested.store(s_nurseryFull || bytes == 0, std::memory_order_relaxed);
+    s_safepointCountdown = bytes;
+}
+
+size_t EvaHeap::sizeOf(const Traceable *object)
+{
+    return object->size;
+}
+
+void *EvaHeap::allocateInChunk(size_t bytes)
+{
+    if (s_currentChunk == nullptr || s_currentChunk->top + bytes > s_currentChunk->size) {
+        const auto size = std::max(bytes, OLD_CHUNK_SIZE);
+        Chunk chunk{std::unique_ptr<uint8_t[]>(new uint8_t[size]), size, 0};
+        const uint8_t *start = chunk.memory.get();
+        s_currentChunk = &(s_chunks[start] = std::move(chunk));
+        s_chunkBytes += size;
+    }
+    auto object = s_currentChunk->memory.get() + s_currentChunk->top;
+    s_currentChunk->top += bytes;
+    s_chunkUsed += bytes;
+    return object;
+}
+
+void EvaHeap::setOldSpaceChunks(bool enabled)
+{
+    s_useChunks = enabled;
+}
+
+bool EvaHeap::contains(const Chunks &chunks, const void *ptr)
+{
+    auto it = chunks.upper_bound((const uint8_t *) ptr);
+    if (it == chunks.begin())
+        return false;
+    --it;
+    return (const uint8_t *) ptr < it->first + it->second.size;
+}
+
+double EvaHeap::fragmentation()
+{
+    return s_chunkUsed > 0 ? double(s_chunkFree) / s_chunkUsed : 0;
+}
+
+EvaHeap::Chunks EvaHeap::takeChunks()
+{
+    auto chunks = std::move(s_chunks);
+    s_chunks.clear();
+    s_currentChunk = nullptr;
+    s_chunkBytes = s_chunkUsed = s_chunkFree = 0;
+    return chunks;
+}
+
+void EvaHeap::clearChunks()
+{
+    takeChunks();
+}
+
+void EvaHeap::release(void *memory, size_t size)
+{
+    // Young objects are reclaimed all together by resetNursery()
+    if (isYoung(memory))
+        return;
+    Traceable::bytesAllocated -= size;
+    s_oldBytes -= size;
+    if (contains(s_chunks, memory)) {
+        // The hole is reclaimed by the compaction. Once disabled, the chunks
+        // are freed with their last object.
+        s_chunkFree += alignedSize(size);
+        if (!s_useChunks && s_chunkFree == s_chunkUsed) {
+            clearChunks();
+        }
+    } else {
+        ::operator delete(memory);
+    }
+}
+
+void EvaHeap::releaseSwept(size_t bytes)
+{
+    Traceable::bytesAllocated -= bytes;
+    s_oldBytes -= bytes;
+}
+
+void EvaHeap::resetNursery()
+{
+    auto current = s_nurseryStart;
+    while (current < s_nurseryTop) {
+        auto object = (Traceable *) current;
+        const auto size = object->size;
+        object->~Traceable();
+        Traceable::bytesAllocated -= size;
+        current += alignedSize(size);
+    }
+    s_nurseryTop = s_nurseryStart;
+    s_youngObjects = 0;
+    s_nurseryFull = false;
+}
+
+void EvaHeap::remember(Traceable *object)
+{
+    if (!object->remembered) {
+        object->remembered = true;
+        s_remembered.push_back(object);
+    }
+}
+
+void EvaHeap::clearRememberedSet()
+{
+    for (auto object : s_remembered) {
+        object->remembered = false;
+    }
+    s_remembered.clear();
+}
+
+void EvaHeap::shade(Traceable *object)
+{
+    object->marked = true;
+    s_shaded.push_back(object);
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+struct Traceable;
+
+// Default size of the nursery, where every object is allocated first
+constexpr size_t NURSERY_SIZE = 64 * 1024;
+// Size of the chunks of the old space, bigger objects get a chunk each
+constexpr size_t OLD_CHUNK_SIZE = 256 * 1024;
+
+/*
+ * Memory behind Traceable objects. The heap has two generations:
+ *
+ *  - the nursery, a fixed buffer where objects are bump-allocated. It is
+ *    emptied by the minor collection (EvaCollector::scavenge), which moves
+ *    the surviving objects to the old space.
+ *  - the old space, objects allocated one by one and tracked by
+ *    Traceable::objects. It is collected by the full mark & sweep.
+ *
+ * Old objects that may point to young objects are kept in the remembered
+ * set (see writeBarrier), which is a root set for the minor collection.
+ *
+ * The old space objects are allocated with malloc, or bump-allocated in
+ * chunks owned by the heap when the compaction is enabled: freed objects
+ * leave holes in the chunks until the compaction moves the live objects
+ * to new chunks and frees the old ones.
+ *
+ * Each thread has its own heap, shared by the VMs running on the thread
+ * along with one collector, which visits the roots of all of them: objects
+ * never move between threads, and VMs on different threads run without
+ * any synchronization.
+ */
+class EvaHeap
+{
+public:
+    // 0 disables the nursery, every object is then allocated in the old space
+    static void setNurserySize(size_t bytes);
+    static size_t nurserySize() { return s_nurserySize; }
+
+    static void *allocate(size_t size);
+    // The memory of a destroyed object of `size` bytes
+    static void release(void *memory, size_t size);
+
+    /*
+     * Header of the object constructed in the memory returned by the last
+     * allocate(), the Traceable constructor copies it: the memory holds no
+     * object before.
+     */
+    struct Header
+    {
+        size_t size;
+        bool marked;
+        uint32_t site;
+    };
+    static const Header &newHeader() { return s_newHeader; }
+    // Accounts for old objects freed by the collector without `delete`
+    static void releaseSwept(size_t bytes);
+
+    // Allocate in the old space, used for objects promoted by the collector
+    static void *allocateOld(size_t size);
+
+    static bool isYoung(const void *ptr) { return ptr >= s_nurseryStart && ptr < s_nurseryTop; }
+
+    // The nursery of this thread, for the collector threads
+    struct YoungRange
+    {
+        const void *start;
+        const void *top;
+
+        bool contains(const void *ptr) const { return ptr >= start && ptr < top; }
+    };
+    static YoungRange youngRange() { return {s_nurseryStart, s_nurseryTop}; }
+
+    // A minor collection is needed because the nursery is full
+    static bool isNurseryFull() { return s_nurseryFull; }
+
+    /*
+     * Allocations never collect: when the nursery is full or after the
+     * bytes set by requestSafepointAfter() are allocated, they ask the VM
+     * to call the collector at its next safepoint.
+     */
+    static bool safepointRequested()
+    {
+        return s_safepointRequested.load(std::memory_order_relaxed);
+    }
+    static void requestSafepointAfter(size_t bytes);
+    // Asks for a safepoint now, also from a signal handler or another thread
+    static void requestSafepoint() { s_safepointRequested.store(true, std::memory_order_relaxed); }
+    // The flag of this thread, for signal handlers running on any thread
+    static std::atomic<bool> *safepointRequestFlag() { return &s_safepointRequested; }
+
+    // Runs the destructor of all the nursery objects and makes it empty again
+    static void resetNursery();
+
+    static void remember(Traceable *object);
+    static const std::vector<Traceable *> &rememberedSet() { return s_remembered; }
+    static void clearRememberedSet();
+
+    /*
+     * Phase of the full collection. While the collector is marking or
+     * sweeping incrementally, new old-space objects are allocated marked
+     * so that the running cycle doesn't free them.
+     */
+    enum class Phase {
+        IDLE,
+        MARKING,
+        SWEEPING,
+    };
+    static Phase phase() { return s_phase; }
+    static void setPhase(Phase phase) { s_phase = phase; }
+
+    // Marks an object found by the write barrier during incremental marking,
+    // the collector will trace it at the next marking slice.
+    static void shade(Traceable *object);
+    static std::vector<Traceable *> &shadedObjects() { return s_shaded; }
+
+    struct Chunk
+    {
+        std::unique_ptr<uint8_t[]> memory;
+        size_t size;
+        size_t top;
+    };
+    // Chunks by start address
+    using Chunks = std::map<const uint8_t *, Chunk>;
+
+    // Objects allocated before enabling the chunks stay in malloc memory
+    static void setOldSpaceChunks(bool enabled);
+    static bool contains(const Chunks &chunks, const void *ptr);
+    // Free bytes in the holes over the bytes taken from the chunks
+    static double fragmentation();
+    static size_t chunkBytes() { return s_chunkBytes; }
+    // Starts a compaction: new objects go to new chunks, the old ones are
+    // freed by the caller
+    static Chunks takeChunks();
+    // Frees the chunks once all their objects are deleted
+    static void clearChunks();
+
+    static constexpr size_t alignedSize(size_t size)
+    {
+        constexpr size_t alignment = alignof(std::max_align_t);
+        return (size + alignment - 1) & ~(alignment - 1);
+    }
+
+    // Calls `visit(Traceable *)` for every object in the nursery
+    template<typename Visitor>
+    static void forEachYoung(Visitor &&visit)
+    {
+        auto current = s_nurseryStart;
+        while (current < s_nurseryTop) {
+            auto object = (Traceable *) current;
+            current += alignedSize(sizeOf(object));
+            visit(object);
+        }
+    }
+
+    // Stored in the objects allocated from now on, see Traceable::site
+    static void setAllocationSite(uint32_t site) { s_allocationSite = site; }
+
+    // Allocated since the start of the process, promotions excluded
+    static size_t allocatedObjectsTotal() { return s_allocatedObjectsTotal; }
+    static size_t allocatedBytesTotal() { return s_allocatedBytesTotal; }
+
+    static size_t youngBytes() { return s_nurseryTop - s_nurseryStart; }
+    static size_t youngObjects() { return s_youngObjects; }
+    static size_t oldBytes() { return s_oldBytes; }
+
+    /*
+     * Objects allocated while the scope is alive go directly to the old space.
+     * Used for long lived objects, like the ones created by the compiler.
+     */
+    struct PretenureScope
+    {
+        PretenureScope() { ++s_pretenure; }
+        ~PretenureScope() { --s_pretenure; }
+    };
+
+private:
+    /*
+     * The counters and the pointers are constant initialized in the
+     * header: the interpreter reads them directly, without the call that
+     * initializes the thread locals on first use. The nursery itself is
+     * allocated by the first allocation of the thread.
+     */
+    static thread_local std::unique_ptr<uint8_t[]> s_nursery;
+    static inline thread_local size_t s_nurserySize{NURSERY_SIZE};
+    static inline thread_local uint8_t *s_nurseryStart{nullptr};
+    static inline thread_local uint8_t *s_nurseryTop{nullptr};
+    static inline thread_local bool s_nurseryFull{false};
+    static inline thread_local std::atomic<bool> s_safepointRequested{false};
+    static_assert(std::atomic<bool>::is_always_lock_free, "set by signal handlers");
+    static inline thread_local size_t s_safepointCountdown{SIZE_MAX};
+    static inline thread_local size_t s_youngObjects{0};
+    static inline thread_local size_t s_oldBytes{0};
+    static inline thread_local int s_pretenure{0};
+    static thread_local std::vector<Traceable *> s_remembered;
+    static inline thread_local uint32_t s_allocationSite{0};
+    static inline thread_local Header s_newHeader{};
+    static inline thread_local size_t s_allocatedObjectsTotal{0};
+    static inline thread_local size_t s_allocatedBytesTotal{0};
+    static inline thread_local Phase s_phase{Phase::IDLE};
+    static thread_local std::vector<Traceable *> s_shaded;
+
+    static void *allocateInChunk(size_t bytes);
+    // Traceable is incomplete here
+    static size_t sizeOf(const Traceable *object);
+
+    static inline thread_local bool s_useChunks{false};
+    static thread_local Chunks s_chunks;
+    static inline thread_local Chunk *s_currentChunk{nullptr};
+    // Memory held by the chunks
+    static inline thread_local size_t s_chunkBytes{0};
+    // Bytes allocated from the chunks, and freed since
+    static inline thread_local size_t s_chunkUsed{0};
+    static inline thread_local size_t s_chunkFree{0};
+};
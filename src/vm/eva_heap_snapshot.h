@@ -0,0 +1,255 @@
+#pragma once
+
+#include "eva_collector.h"
+#include "eva_telemetry.h"
+#include "evavalue.h"
+#include "logger.h"
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Every object of the heap with its references, and the roots, written by
+ * EvaVM::writeHeapSnapshot() and read by the eva_heap_analyzer tool.
+ *
+ * Binary format, integers are unsigned LEB128 and strings are a length
+ * followed by the bytes:
+ *
+ *   "EVAHEAP" 0, version
+ *   site count, then function and offset of each site (ids from 1)
+ *   node count, then for each node:
+ *       type, size, site id (0 when unknown), label, reference count,
+ *       the referenced node indices
+ *   root count, then label and node index of each root
+ */
+struct HeapSnapshot
+{
+    static constexpr uint32_t VERSION = 1;
+    // Strings longer than this are truncated in the labels
+    static constexpr size_t LABEL_LENGTH = 80;
+
+    struct Node
+    {
+        ObjectType type;
+        // The object and the memory it owns, like the characters of a string
+        size_t size;
+        uint32_t site;
+        // The string, or the name of the function
+        std::string label;
+        std::vector<uint32_t> references;
+    };
+
+    struct Root
+    {
+        std::string label;
+        uint32_t node;
+    };
+
+    std::vector<AllocationSite> sites;
+    std::vector<Node> nodes;
+    std::vector<Root> roots;
+
+    // The nodes of the objects, young and old
+    static std::vector<Traceable *> heapObjects()
+    {
+        std::vector<Traceable *> objects(Traceable::objects.begin(), Traceable::objects.end());
+        EvaHeap::forEachYoung([&objects](Traceable *object) { objects.push_back(object); });
+        return objects;
+    }
+
+    /*
+     * `listRoots(add)` calls `add(label, Traceable *)` for every root.
+     */
+    template<typename RootLister>
+    static void write(std::ostream &out, const EvaTelemetry &telemetry, RootLister &&listRoots)
+    {
+        out.write("EVAHEAP", 8);
+        writeNumber(out, VERSION);
+
+        const auto &sites = telemetry.allocationSites();
+        writeNumber(out, sites.size());
+        for (uint32_t id = 1; id <= sites.size(); ++id) {
+            auto site = telemetry.allocationSiteById(id);
+            writeString(out, site->function);
+            writeNumber(out, site->offset);
+        }
+
+        const auto objects = heapObjects();
+        std::unordered_map<const Traceable *, uint32_t> indices;
+        for (size_t i = 0; i < objects.size(); ++i) {
+            indices[objects[i]] = i;
+        }
+        writeNumber(out, objects.size());
+        std::vector<uint32_t> references;
+        for (auto object : objects) {
+            auto node = static_cast<Object *>(object);
+            writeNumber(out, size_t(node->type));
+            writeNumber(out, node->size + ownedSize(node));
+            writeNumber(out, node->site);
+            writeString(out, label(node));
+            references.clear();
+            // The shared code is out of the heap
+            EvaCollector::forEachReference(object, [&](Traceable *&ref) {
+                if (ref != nullptr && !ref->frozen) {
+                    references.push_back(indices.at(ref));
+                }
+            });
+            writeNumber(out, references.size());
+            for (auto reference : references) {
+                writeNumber(out, reference);
+            }
+        }
+
+        std::vector<Root> roots;
+        listRoots([&](std::string label, const Traceable *object) {
+            if (object != nullptr && !object->frozen) {
+                roots.push_back({std::move(label), indices.at(object)});
+            }
+        });
+        writeNumber(out, roots.size());
+        for (const auto &root : roots) {
+            writeString(out, root.label);
+            writeNumber(out, root.node);
+        }
+    }
+
+    static HeapSnapshot read(std::istream &in)
+    {
+        char magic[8];
+        if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, "EVAHEAP", 8) != 0) {
+            DIE << "Heap snapshot: not a snapshot";
+        }
+        if (auto version = readNumber(in); version != VERSION) {
+            DIE << "Heap snapshot: unsupported version " << version;
+        }
+
+        HeapSnapshot snapshot;
+        snapshot.sites.resize(readNumber(in));
+        for (auto &site : snapshot.sites) {
+            site.function = readString(in);
+            site.offset = readNumber(in);
+        }
+        snapshot.nodes.resize(readNumber(in));
+        for (auto &node : snapshot.nodes) {
+            node.type = ObjectType(readNumber(in));
+            node.size = readNumber(in);
+            node.site = readNumber(in);
+            node.label = readString(in);
+            node.references.resize(readNumber(in));
+            for (auto &reference : node.references) {
+                reference = readIndex(in, snapshot.nodes.size());
+            }
+        }
+        snapshot.roots.resize(readNumber(in));
+        for (auto &root : snapshot.roots) {
+            root.label = readString(in);
+            root.node = readIndex(in, snapshot.nodes.size());
+        }
+        return snapshot;
+    }
+
+private:
+    static size_t ownedSize(const Object *object)
+    {
+        switch (object->type) {
+        case ObjectType::STRING: {
+            // A shared text belongs to no heap in particular
+            const auto &string = static_cast<const StringObject *>(object)->string;
+            // Short strings are stored in the object
+            return string.capacity() > 15 ? string.capacity() + 1 : 0;
+        }
+        case ObjectType::CODE: {
+            auto co = static_cast<const CodeObject *>(object);
+            return co->code.capacity() + co->positions.bytes()
+                   + co->constants.capacity() * sizeof(EvaValue)
+                   + co->locals.capacity() * sizeof(LocalVar)
+                   + co->upvalues.capacity() * sizeof(UpvalueInfo);
+        }
+        case ObjectType::FUNCTION:
+            return static_cast<const FunctionObject *>(object)->cells.capacity()
+                   * sizeof(CellObject *);
+        case ObjectType::COROUTINE:
+            return static_cast<const CoroutineObject *>(object)->stack
+                       ? STACK_LIMIT * sizeof(EvaValue) + FRAMES_LIMIT * sizeof(CallFrame)
+                       : 0;
+        case ObjectType::NATIVE:
+        case ObjectType::CELL:
+            return 0;
+        }
+        return 0;
+    }
+
+    static std::string label(const Object *object)
+    {
+        switch (object->type) {
+        case ObjectType::STRING:
+            return static_cast<const StringObject *>(object)->text().substr(0, LABEL_LENGTH);
+        case ObjectType::CODE:
+            return static_cast<const CodeObject *>(object)->name;
+        case ObjectType::NATIVE:
+            return static_cast<const NativeFunction *>(object)->name;
+        case ObjectType::FUNCTION: {
+            auto co = static_cast<const FunctionObject *>(object)->co;
+            return co != nullptr ? co->name : "";
+        }
+        case ObjectType::CELL:
+        case ObjectType::COROUTINE:
+            return "";
+        }
+        return "";
+    }
+
+    static void writeNumber(std::ostream &out, uint64_t value)
+    {
+        do {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            out.put(char(value > 0 ? byte | 0x80 : byte));
+        } while (value > 0);
+    }
+
+    static void writeString(std::ostream &out, const std::string &string)
+    {
+        writeNumber(out, string.size());
+        out.write(string.data(), string.size());
+    }
+
+    static uint64_t readNumber(std::istream &in)
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const auto byte = in.get();
+            if (byte == std::istream::traits_type::eof()) {
+                DIE << "Heap snapshot: truncated file";
+            }
+            value |= uint64_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        DIE << "Heap snapshot: invalid number";
+        return 0;
+    }
+
+    static uint32_t readIndex(std::istream &in, size_t nodes)
+    {
+        const auto index = readNumber(in);
+        if (index >= nodes) {
+            DIE << "Heap snapshot: reference to node " << index << " of " << nodes;
+        }
+        return index;
+    }
+
+    static std::string readString(std::istream &in)
+    {
+        std::string string(readNumber(in), '\0');
+        if (!in.read(string.data(), string.size())) {
+            DIE << "Heap snapshot: truncated file";
+        }
+        return string;
+    }
+};
@@ -0,0 +1,331 @@
+#pragma once
+
+#include "eva_shared_code.h"
+#include "evavm.h"
+#include "logger.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Shared code written to a file, for processes to boot their VMs without
+ * compiling nor running the modules:
+ *
+ *   EvaImage::write(out, *EvaVM::compileShared(modules));
+ *   ...
+ *   EvaVM vm(EvaImage::load(path));
+ *
+ * The file is mapped and its objects are rebuilt out of the heap, frozen,
+ * like EvaSharedCode::freeze() would. Objects refer to each other by index
+ * in the image, the references are relocated once every object exists.
+ * The globals table keeps its order: the global indexes in the code are
+ * left untouched. Natives are bound by name to the built-in natives and
+ * those given to load(), with the same arity.
+ *
+ * Binary format, integers are unsigned LEB128, strings are a length
+ * followed by the bytes and numbers the 8 bytes of a double:
+ *
+ *   "EVAIMG" 0 0, version
+ *   object count, then for each object its type and:
+ *       string: the text
+ *       native: name, arity
+ *       code: name, arity, bytecode, encoded positions, upvalue count then
+ *             name, fromParentLocal and index of each, constant count then
+ *             the values
+ *       function: object index of the code
+ *   global count, then name and value of each
+ *
+ * A value is its type then the number, the boolean or the object index.
+ */
+class EvaImage
+{
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    static void write(std::ostream &out, const EvaSharedCode &code)
+    {
+        out.write("EVAIMG\0", 8);
+        writeNumber(out, VERSION);
+
+        std::unordered_map<const Traceable *, size_t> indices;
+        for (size_t i = 0; i < code.m_objects.size(); ++i) {
+            indices[code.m_objects[i]] = i;
+        }
+        auto writeValue = [&](const EvaValue &value) {
+            writeNumber(out, size_t(value.type));
+            switch (value.type) {
+            case EvaValueType::NUMBER:
+                out.write(reinterpret_cast<const char *>(&value.number), sizeof(double));
+                break;
+            case EvaValueType::BOOL:
+                writeNumber(out, value.boolean);
+                break;
+            case EvaValueType::OBJECT:
+                writeNumber(out, indices.at(value.object));
+                break;
+            }
+        };
+
+        writeNumber(out, code.m_objects.size());
+        for (auto traceable : code.m_objects) {
+            auto object = static_cast<const Object *>(traceable);
+            writeNumber(out, size_t(object->type));
+            switch (object->type) {
+            case ObjectType::STRING:
+                writeString(out, static_cast<const StringObject *>(object)->text());
+                break;
+            case ObjectType::NATIVE: {
+                auto native = static_cast<const NativeFunction *>(object);
+                writeString(out, native->name);
+                writeNumber(out, native->arity);
+                break;
+            }
+            case ObjectType::CODE: {
+                auto co = static_cast<const CodeObject *>(object);
+                writeString(out, co->name);
+                writeNumber(out, co->arity);
+                writeBytes(out, co->code);
+                writeBytes(out, co->positions.encoded());
+                writeNumber(out, co->upvalues.size());
+                for (const auto &upvalue : co->upvalues) {
+                    writeString(out, upvalue.name);
+                    writeNumber(out, upvalue.fromParentLocal);
+                    writeNumber(out, upvalue.index);
+                }
+                writeNumber(out, co->constants.size());
+                for (const auto &constant : co->constants) {
+                    writeValue(constant);
+                }
+                break;
+            }
+            case ObjectType::FUNCTION:
+                writeNumber(out, indices.at(static_cast<const FunctionObject *>(object)->co));
+                break;
+            default:
+                DIE << "Image: shared code can't hold " << toString(EvaValue{
+                           .type = EvaValueType::OBJECT, .object = const_cast<Object *>(object)});
+            }
+        }
+
+        const auto &globals = *code.m_globals;
+        writeNumber(out, globals.size());
+        for (const auto &global : globals) {
+            writeString(out, global.name);
+            writeValue(global.value);
+        }
+    }
+
+    // Maps the image at `path`, `natives` come in addition to the built-in ones
+    static std::shared_ptr<const EvaSharedCode> load(
+        const std::string &path, const std::vector<EvaVM::NativeSpec> &natives = {})
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat status;
+        if (fd < 0 || ::fstat(fd, &status) != 0) {
+            DIE << "Image: cannot open " << path;
+        }
+        const size_t size = status.st_size;
+        void *bytes = size > 0 ? ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        ::close(fd);
+        if (bytes == MAP_FAILED) {
+            DIE << "Image: cannot map " << path;
+        }
+        auto code = read(static_cast<const uint8_t *>(bytes), size, natives);
+        if (bytes != nullptr) {
+            ::munmap(bytes, size);
+        }
+        return code;
+    }
+
+    static std::shared_ptr<const EvaSharedCode> read(
+        const uint8_t *bytes, size_t size, const std::vector<EvaVM::NativeSpec> &natives = {})
+    {
+        Reader in{bytes, bytes + size};
+        if (size < 8 || std::memcmp(bytes, "EVAIMG\0", 8) != 0) {
+            DIE << "Image: not an image";
+        }
+        in.next += 8;
+        if (auto version = in.number(); version != VERSION) {
+            DIE << "Image: unsupported version " << version;
+        }
+
+        std::unordered_map<std::string, const EvaVM::NativeSpec *> registry;
+        for (const auto &native : EvaVM::builtinNatives()) {
+            registry[native.name] = &native;
+        }
+        for (const auto &native : natives) {
+            registry[native.name] = &native;
+        }
+
+        std::shared_ptr<EvaSharedCode> code(new EvaSharedCode());
+        // The references to objects, relocated once they all exist
+        std::vector<std::pair<EvaValue *, size_t>> values;
+        std::vector<std::pair<CodeObject **, size_t>> codes;
+        auto readValue = [&](EvaValue &value) {
+            switch (EvaValueType(in.number())) {
+            case EvaValueType::NUMBER:
+                value = NUMBER(in.real());
+                break;
+            case EvaValueType::BOOL:
+                value = BOOLEAN(in.number() != 0);
+                break;
+            case EvaValueType::OBJECT:
+                value.type = EvaValueType::OBJECT;
+                values.push_back({&value, in.number()});
+                break;
+            default:
+                DIE << "Image: invalid value";
+            }
+        };
+
+        const auto objects = in.number();
+        for (size_t i = 0; i < objects; ++i) {
+            switch (ObjectType(in.number())) {
+            case ObjectType::STRING:
+                code->make<StringObject>(std::make_shared<const std::string>(in.string()));
+                break;
+            case ObjectType::NATIVE: {
+                const auto name = in.string();
+                const int arity = in.number();
+                auto it = registry.find(name);
+                if (it == registry.end() || it->second->arity != arity) {
+                    DIE << "Image: no native " << name << " of arity " << arity;
+                }
+                code->make<NativeFunction>(it->second->fn, name, arity);
+                break;
+            }
+            case ObjectType::CODE: {
+                auto name = in.string();
+                const int arity = in.number();
+                auto co = code->make<CodeObject>(std::move(name), arity);
+                co->code = in.bytes();
+                co->positions = PositionTable(in.bytes());
+                co->upvalues.resize(in.number());
+                for (auto &upvalue : co->upvalues) {
+                    upvalue.name = in.string();
+                    upvalue.fromParentLocal = in.number() != 0;
+                    upvalue.index = in.number();
+                }
+                // Sized once, the relocations point into the constants
+                co->constants.resize(in.number());
+                for (auto &constant : co->constants) {
+                    readValue(constant);
+                }
+                break;
+            }
+            case ObjectType::FUNCTION: {
+                auto function = code->make<FunctionObject>(nullptr);
+                codes.push_back({&function->co, in.number()});
+                break;
+            }
+            default:
+                DIE << "Image: invalid object type";
+            }
+        }
+
+        auto table = std::make_shared<std::vector<Globals::Variable>>(in.number());
+        for (auto &global : *table) {
+            global.name = in.string();
+            readValue(global.value);
+        }
+
+        auto object = [&](size_t index) {
+            if (index >= code->m_objects.size()) {
+                DIE << "Image: reference to object " << index << " of " << code->m_objects.size();
+            }
+            return static_cast<Object *>(code->m_objects[index]);
+        };
+        for (auto [value, index] : values) {
+            value->object = object(index);
+        }
+        for (auto [co, index] : codes) {
+            auto target = object(index);
+            if (target->type != ObjectType::CODE) {
+                DIE << "Image: function over object " << index << ", not a code object";
+            }
+            *co = static_cast<CodeObject *>(target);
+        }
+        code->m_globals = std::move(table);
+        return code;
+    }
+
+private:
+    struct Reader
+    {
+        const uint8_t *next;
+        const uint8_t *end;
+
+        uint64_t number()
+        {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                const auto byte = take(1)[0];
+                value |= uint64_t(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {
+                    return value;
+                }
+            }
+            DIE << "Image: invalid number";
+            return 0;
+        }
+
+        double real()
+        {
+            double value;
+            std::memcpy(&value, take(sizeof(value)), sizeof(value));
+            return value;
+        }
+
+        std::string string()
+        {
+            const auto length = number();
+            return {reinterpret_cast<const char *>(take(length)), length};
+        }
+
+        std::vector<uint8_t> bytes()
+        {
+            const auto length = number();
+            const auto data = take(length);
+            return {data, data + length};
+        }
+
+        const uint8_t *take(size_t length)
+        {
+            if (length > size_t(end - next)) {
+                DIE << "Image: truncated file";
+            }
+            const auto data = next;
+            next += length;
+            return data;
+        }
+    };
+
+    static void writeNumber(std::ostream &out, uint64_t value)
+    {
+        do {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            out.put(char(value > 0 ? byte | 0x80 : byte));
+        } while (value > 0);
+    }
+
+    static void writeString(std::ostream &out, const std::string &string)
+    {
+        writeNumber(out, string.size());
+        out.write(string.data(), string.size());
+    }
+
+    static void writeBytes(std::ostream &out, const std::vector<uint8_t> &bytes)
+    {
+        writeNumber(out, bytes.size());
+        out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    }
+};
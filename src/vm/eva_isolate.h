@@ -0,0 +1,75 @@
+#pragma once
+
+#include "eva_channel.h"
+#include "evavm.h"
+
+#include <future>
+#include <thread>
+
+/*
+ * A program running on its own thread, in a VM of its own: nothing of its
+ * heap is shared, the isolates talk with the `send` and `receive` natives
+ * over EvaChannels. Strings cross without being copied, see EvaMessage.
+ *
+ * join() waits for the end of the program and returns its result; the
+ * destructor joins as well.
+ */
+class EvaIsolate
+{
+public:
+    struct Options
+    {
+        GCOptions gc{};
+        // Registered in the VM of the isolate
+        std::vector<EvaVM::NativeSpec> natives{};
+    };
+
+    explicit EvaIsolate(const std::string &program)
+        : EvaIsolate(EvaVM::parse(program), Options{})
+    {}
+
+    EvaIsolate(EvaVM::Program program, Options options)
+    {
+        auto done = std::make_shared<std::promise<EvaMessage>>();
+        m_result = done->get_future();
+        m_thread = std::thread([program = std::move(program), options = std::move(options), done] {
+            // Created on this thread, the objects of the VM are on its heap
+            EvaVM vm;
+            vm.setPrintListing(false);
+            vm.collector().setOptions(options.gc);
+            vm.registerNatives(options.natives);
+            done->set_value(result(vm.exec(program)));
+        });
+    }
+
+    ~EvaIsolate()
+    {
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    EvaIsolate(const EvaIsolate &) = delete;
+    EvaIsolate &operator=(const EvaIsolate &) = delete;
+
+    EvaMessage join()
+    {
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        return m_result.get();
+    }
+
+private:
+    // Objects other than strings are returned as their text
+    static EvaMessage result(const EvaValue &value)
+    {
+        if (isNumber(value) || isBool(value) || isString(value)) {
+            return toMessage(value);
+        }
+        return std::make_shared<const std::string>(toString(value));
+    }
+
+    std::future<EvaMessage> m_result;
+    std::thread m_thread;
+};
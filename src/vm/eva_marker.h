@@ -0,0 +1,149 @@
+#pragma once
+
+#include "evavalue.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Marks the objects reachable from a gray set with several threads.
+ *
+ * Every worker traces the objects on a private stack. When the stack grows
+ * and its shared deque is empty, half of the stack is published there.
+ * Workers that run out of objects take them back from their own deque, or
+ * steal half of the deque of another worker. Objects are marked with an
+ * atomic exchange, so each object is traced by exactly one worker.
+ */
+class ParallelMarker
+{
+public:
+    explicit ParallelMarker(size_t threads)
+        : m_deques(std::max<size_t>(threads, 1))
+    {}
+
+    // Marks `object` unless it was already, returns true if this call did.
+    // Frozen objects are read by other threads, and always marked.
+    static bool tryMark(Traceable *object)
+    {
+        return !object->frozen && !__atomic_exchange_n(&object->marked, true, __ATOMIC_RELAXED);
+    }
+
+    /*
+     * Traces the already marked objects in `gray` and everything reachable
+     * from them. `trace(node, visit)` calls `visit(Traceable *&)` for every
+     * reference of node, like EvaCollector::forEachReference.
+     */
+    template<typename Tracer>
+    void run(std::vector<Traceable *> &gray, Tracer &&trace)
+    {
+        for (size_t i = 0; i < gray.size(); ++i) {
+            auto &deque = m_deques[i % m_deques.size()];
+            deque.objects.push_back(gray[i]);
+            deque.size++;
+        }
+        gray.clear();
+        m_idle = 0;
+
+        // The heap belongs to this thread
+        const auto young = EvaHeap::youngRange();
+        std::vector<std::thread> workers;
+        for (size_t id = 1; id < m_deques.size(); ++id) {
+            workers.emplace_back([this, id, &trace, young] { work(id, trace, young); });
+        }
+        work(0, trace, young);
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+private:
+    // Objects on the private stack before sharing them
+    static constexpr size_t SHARE_THRESHOLD = 64;
+
+    struct MarkDeque
+    {
+        std::mutex mutex;
+        std::deque<Traceable *> objects;
+        // Read without the lock to skip empty deques
+        std::atomic<size_t> size{0};
+    };
+
+    template<typename Tracer>
+    void work(size_t id, Tracer &trace, EvaHeap::YoungRange young)
+    {
+        std::vector<Traceable *> stack;
+        auto shade = [&stack, young](Traceable *&ref) {
+            if (ref != nullptr && !young.contains(ref) && tryMark(ref)) {
+                stack.push_back(ref);
+            }
+        };
+
+        while (true) {
+            while (!stack.empty()) {
+                auto node = stack.back();
+                stack.pop_back();
+                trace(node, shade);
+                if (stack.size() > SHARE_THRESHOLD && m_deques[id].size == 0) {
+                    share(id, stack);
+                }
+            }
+            if (take(id, stack)) {
+                continue;
+            }
+            // Done when all the workers are idle: a worker publishes objects
+            // only before looking for work and becoming idle itself
+            m_idle++;
+            while (m_idle < m_deques.size() && !hasWork()) {
+                std::this_thread::yield();
+            }
+            if (m_idle == m_deques.size()) {
+                return;
+            }
+            m_idle--;
+        }
+    }
+
+    void share(size_t id, std::vector<Traceable *> &stack)
+    {
+        auto &deque = m_deques[id];
+        const auto half = stack.size() / 2;
+        std::lock_guard<std::mutex> lock(deque.mutex);
+        deque.objects.insert(deque.objects.end(), stack.begin(), stack.begin() + half);
+        stack.erase(stack.begin(), stack.begin() + half);
+        deque.size = deque.objects.size();
+    }
+
+    // Takes objects from the own deque first, then from the others
+    bool take(size_t id, std::vector<Traceable *> &stack)
+    {
+        for (size_t i = 0; i < m_deques.size(); ++i) {
+            auto &deque = m_deques[(id + i) % m_deques.size()];
+            if (deque.size == 0)
+                continue;
+            std::lock_guard<std::mutex> lock(deque.mutex);
+            // The owner takes everything, thieves take half
+            const auto count = i == 0 ? deque.objects.size() : (deque.objects.size() + 1) / 2;
+            stack.insert(stack.end(), deque.objects.begin(), deque.objects.begin() + count);
+            deque.objects.erase(deque.objects.begin(), deque.objects.begin() + count);
+            deque.size = deque.objects.size();
+            if (count > 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool hasWork() const
+    {
+        for (const auto &deque : m_deques) {
+            if (deque.size > 0)
+                return true;
+        }
+        return false;
+    }
+
+    std::vector<MarkDeque> m_deques;
+    std::atomic<size_t> m_idle{0};
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "eva_code_image.h"
+#include "eva_executor.h"
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Data parallel natives, running pure functions over a range of integers
+ * on a pool of worker VMs. The language has no arrays, the ranges take
+ * their place:
+ *
+ *   (pmap f from to): the strings (f from) ... (f (- to 1)), concatenated
+ *   (preduce f combine init from to): combines init, (f from) ...
+ *       (f (- to 1)), in this order
+ *
+ * The functions must be pure, see EvaCodeImage: they are checked and
+ * copied once as an image, which every worker loads into its own heap.
+ * Numbers, booleans and strings go between the heaps.
+ *
+ * The range is split into CHUNKS chunks whatever the number of workers,
+ * and the results of the chunks are combined as a balanced tree, in the
+ * order of the range: the result only depends on the arguments, and it is
+ * the one of a sequential fold when `combine` is associative.
+ *
+ * A host registers them with vm.registerNatives(EvaParallel::natives()).
+ * The calling VM blocks until the result is ready.
+ */
+class EvaParallel
+{
+public:
+    static std::vector<EvaVM::NativeSpec> natives()
+    {
+        return {
+            {"pmap", pmap, 3},
+            {"preduce", preduce, 5},
+        };
+    }
+
+    // Shared by the VMs of the process, started on first use
+    static EvaExecutor &executor()
+    {
+        static EvaExecutor pool;
+        return pool;
+    }
+
+    static constexpr size_t CHUNKS = 64;
+
+    // Natives without side effects, the pure functions can call them
+    static inline const std::set<std::string> PURE_NATIVES{"square"};
+
+private:
+    using Value = std::variant<double, bool, std::string>;
+
+    struct Range
+    {
+        int64_t from;
+        int64_t to;
+    };
+
+    static EvaValue pmap(EvaVM &vm, const EvaValue *args, size_t)
+    {
+        auto function = image(vm, args[0], "pmap");
+        std::string result;
+        for (auto &ticket : chunks(range(args[1], args[2]), [&](Range chunk) {
+                 return executor().submit([function, chunk](EvaVM &worker) {
+                     return EvaExecutor::Result{EvaExecutor::Result::Status::DONE,
+                                                mapChunk(worker, *function, chunk)};
+                 });
+             })) {
+            result += std::get<std::string>(ticket.result.get().value);
+        }
+        return allocString(std::move(result));
+    }
+
+    static EvaValue preduce(EvaVM &vm, const EvaValue *args, size_t)
+    {
+        auto function = image(vm, args[0], "preduce");
+        auto combine = image(vm, args[1], "preduce");
+        const auto init = toValue(args[2], "preduce");
+        auto level = chunks(range(args[3], args[4]), [&](Range chunk) {
+            return executor().submit([function, combine, chunk](EvaVM &worker) {
+                return EvaExecutor::Result{EvaExecutor::Result::Status::DONE,
+                                           reduceChunk(worker, *function, *combine, chunk)};
+            });
+        });
+        // Pairs are combined as soon as both are ready, an odd one moves up
+        while (level.size() > 1) {
+            std::vector<EvaExecutor::Ticket> next;
+            for (size_t i = 0; i + 1 < level.size(); i += 2) {
+                next.push_back(combineLater(combine, level[i].result.get().value,
+                                            level[i + 1].result.get().value));
+            }
+            if (level.size() % 2 == 1) {
+                next.push_back(std::move(level.back()));
+            }
+            level = std::move(next);
+        }
+        if (level.empty()) {
+            return fromValue(init);
+        }
+        auto result = combineLater(combine, init, level[0].result.get().value);
+        return fromValue(result.result.get().value);
+    }
+
+    static std::shared_ptr<const EvaCodeImage> image(EvaVM &vm, const EvaValue &function,
+                                                     const std::string &who)
+    {
+        if (!isFunction(function)) {
+            DIE << who << " expects a function, got " << toString(function);
+        }
+        return EvaCodeImage::ofPureFunction(function.asFunction(), vm.globals(), PURE_NATIVES,
+                                            who);
+    }
+
+    static Range range(const EvaValue &from, const EvaValue &to)
+    {
+        if (!isNumber(from) || !isNumber(to)) {
+            DIE << "expected a range of numbers, got " << toString(from) << " " << toString(to);
+        }
+        return {int64_t(from.asNumber()), int64_t(to.asNumber())};
+    }
+
+    // Submits the chunks of `range`, in order
+    template<typename Submit>
+    static std::vector<EvaExecutor::Ticket> chunks(Range range, Submit &&submit)
+    {
+        std::vector<EvaExecutor::Ticket> tickets;
+        const int64_t length = std::max<int64_t>(range.to - range.from, 0);
+        const int64_t size = (length + CHUNKS - 1) / CHUNKS;
+        for (int64_t from = range.from; from < range.to; from += size) {
+            tickets.push_back(submit(Range{from, std::min(from + size, range.to)}));
+        }
+        return tickets;
+    }
+
+    static EvaExecutor::Ticket combineLater(std::shared_ptr<const EvaCodeImage> combine, Value a,
+                                            Value b)
+    {
+        return executor().submit([combine, a = std::move(a), b = std::move(b)](EvaVM &worker) {
+            auto &globals = worker.globals();
+            const auto left = slot(globals, "preduce:left");
+            const auto right = slot(globals, "preduce:right");
+            globals.set(left, fromValue(a));
+            globals.set(right, fromValue(b));
+            const auto result =
+                worker.call(combine->load(globals), {globals.get(left), globals.get(right)});
+            return EvaExecutor::Result{EvaExecutor::Result::Status::DONE,
+                                       toValue(result, "preduce")};
+        });
+    }
+
+    static std::string mapChunk(EvaVM &worker, const EvaCodeImage &function, Range chunk)
+    {
+        auto &globals = worker.globals();
+        const auto f = slot(globals, "pmap:function");
+        globals.set(f, function.load(globals));
+        std::string text;
+        for (auto i = chunk.from; i < chunk.to; ++i) {
+            const auto result = worker.call(globals.get(f), {NUMBER(double(i))});
+            if (!isString(result)) {
+                DIE << "pmap: the function returned " << toString(result) << ", not a string";
+            }
+            text += result.asString()->text();
+        }
+        return text;
+    }
+
+    static Value reduceChunk(EvaVM &worker, const EvaCodeImage &function,
+                             const EvaCodeImage &combine, Range chunk)
+    {
+        auto &globals = worker.globals();
+        const auto f = slot(globals, "preduce:function");
+        const auto c = slot(globals, "preduce:combine");
+        const auto acc = slot(globals, "preduce:acc");
+        globals.set(f, function.load(globals));
+        globals.set(c, combine.load(globals));
+        globals.set(acc, worker.call(globals.get(f), {NUMBER(double(chunk.from))}));
+        for (auto i = chunk.from + 1; i < chunk.to; ++i) {
+            const auto value = worker.call(globals.get(f), {NUMBER(double(i))});
+            globals.set(acc, worker.call(globals.get(c), {globals.get(acc), value}));
+        }
+        return toValue(globals.get(acc), "preduce");
+    }
+
+    // A global of the worker holding a value between calls: the
+    // collections during the calls move the objects
+    static size_t slot(Globals &globals, const std::string &name)
+    {
+        auto index = globals.getGlobalIndex(name);
+        return index ? *index : *globals.define(name);
+    }
+
+    static Value toValue(const EvaValue &value, const std::string &who)
+    {
+        if (isNumber(value)) {
+            return value.asNumber();
+        }
+        if (isBool(value)) {
+            return value.asBool();
+        }
+        if (isString(value)) {
+            return value.asCppString();
+        }
+        DIE << who << ": only numbers, booleans and strings go between VMs, got "
+            << toString(value);
+        return false;
+    }
+
+    static EvaValue fromValue(const Value &value)
+    {
+        if (auto number = std::get_if<double>(&value)) {
+            return NUMBER(*number);
+        }
+        if (auto boolean = std::get_if<bool>(&value)) {
+            return BOOLEAN(*boolean);
+        }
+        return allocString(std::get<std::string>(value));
+    }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "logger.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Makes the Eva functions visible to `perf`. Each function gets its own
+ * copy of a small trampoline, which only calls its target: when the VM
+ * runs a function through its trampoline, the native stack has a frame
+ * at a distinct address for each Eva function. The trampolines are listed
+ * in /tmp/perf-<pid>.map, where perf looks for the symbols of code it
+ * can't find in a binary, so `perf report -g` shows eva::<function>
+ * above EvaVM::run.
+ *
+ * Process-wide: perf reads one map per process, and the trampolines stay
+ * valid until the process exits. Functions with the same name share a
+ * trampoline.
+ */
+class EvaPerfMap
+{
+public:
+    using Target = void (*)(void *argument);
+    // Calls `target(argument)`
+    using Trampoline = void (*)(void *argument, Target target);
+
+    static bool supported() { return sizeof(TEMPLATE) > 1; }
+
+    static EvaPerfMap &instance()
+    {
+        static EvaPerfMap map;
+        return map;
+    }
+
+    Trampoline trampoline(const std::string &function)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (auto it = m_trampolines.find(function); it != m_trampolines.end()) {
+            return it->second;
+        }
+        if (!supported()) {
+            DIE << "perf map: trampolines are not supported on this architecture";
+        }
+        if (m_used + SLOT_SIZE > ARENA_SIZE) {
+            newArena();
+        }
+        auto code = m_arena + m_used;
+        m_used += SLOT_SIZE;
+
+        if (m_file != nullptr) {
+            fprintf(m_file, "%lx %zx eva::%s\n", reinterpret_cast<unsigned long>(code),
+                    sizeof(TEMPLATE), function.c_str());
+            fflush(m_file);
+        }
+        auto trampoline = reinterpret_cast<Trampoline>(code);
+        m_trampolines[function] = trampoline;
+        return trampoline;
+    }
+
+    const std::string &path() const { return m_path; }
+
+private:
+    EvaPerfMap()
+        : m_path("/tmp/perf-" + std::to_string(getpid()) + ".map")
+        , m_file(fopen(m_path.c_str(), "a"))
+    {}
+
+    ~EvaPerfMap()
+    {
+        if (m_file != nullptr) {
+            fclose(m_file);
+        }
+    }
+
+    /*
+     * Every slot of an arena gets its trampoline before the arena becomes
+     * executable, and the arena is never written again: other threads may
+     * be running the trampolines handed out before.
+     */
+    void newArena()
+    {
+        void *memory = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            DIE << "perf map: cannot allocate the trampolines";
+        }
+        auto arena = static_cast<uint8_t *>(memory);
+        for (size_t slot = 0; slot + SLOT_SIZE <= ARENA_SIZE; slot += SLOT_SIZE) {
+            std::memcpy(arena + slot, TEMPLATE, sizeof(TEMPLATE));
+        }
+        __builtin___clear_cache(reinterpret_cast<char *>(arena),
+                                reinterpret_cast<char *>(arena + ARENA_SIZE));
+        if (mprotect(arena, ARENA_SIZE, PROT_READ | PROT_EXEC) != 0) {
+            DIE << "perf map: cannot make the trampolines executable";
+        }
+        m_arena = arena;
+        m_used = 0;
+    }
+
+    // The trampolines save the frame pointer, so perf can unwind through them
+#if defined(__x86_64__)
+    // push rbp; mov rbp, rsp; call *rsi; pop rbp; ret
+    static constexpr uint8_t TEMPLATE[] = {0x55, 0x48, 0x89, 0xe5, 0xff, 0xd6, 0x5d, 0xc3};
+#elif defined(__aarch64__)
+    // stp x29, x30, [sp, #-16]!; mov x29, sp; blr x1; ldp x29, x30, [sp], #16; ret
+    static constexpr uint8_t TEMPLATE[] = {0xfd, 0x7b, 0xbf, 0xa9, 0xfd, 0x03, 0x00, 0x91, 0x20,
+                                           0x00, 0x3f, 0xd6, 0xfd, 0x7b, 0xc1, 0xa8, 0xc0, 0x03,
+                                           0x5f, 0xd6};
+#else
+    static constexpr uint8_t TEMPLATE[] = {0};
+#endif
+    static constexpr size_t SLOT_SIZE = 32;
+    static constexpr size_t ARENA_SIZE = 64 * 1024;
+
+    std::mutex m_mutex;
+    std::string m_path;
+    FILE *m_file;
+    std::map<std::string, Trampoline> m_trampolines;
+    uint8_t *m_arena{nullptr};
+    size_t m_used{ARENA_SIZE};
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Position in the source: lines from 1, columns from 0. Line 0 is unknown.
+struct SourcePosition
+{
+    int line{0};
+    int column{0};
+
+    bool operator==(const SourcePosition &other) const
+    {
+        return line == other.line && column == other.column;
+    }
+    bool operator!=(const SourcePosition &other) const { return !(*this == other); }
+
+    std::string toString() const
+    {
+        return std::to_string(line) + ":" + std::to_string(column);
+    }
+};
+
+/*
+ * Source positions of the instructions of a code object, written by the
+ * compiler and only read on cold paths: errors, profiles, listings. The
+ * bytecode is left untouched.
+ *
+ * An entry applies from its bytecode offset to the next entry. Entries are
+ * stored as LEB128 numbers relative to the previous one: offset delta,
+ * line delta (zigzag encoded, lines may go back) and column. A line of
+ * code usually costs 3 bytes.
+ */
+class PositionTable
+{
+public:
+    PositionTable() = default;
+
+    // From the bytes of encoded(), entries can still be added
+    explicit PositionTable(std::vector<uint8_t> encoded)
+        : m_bytes(std::move(encoded))
+    {
+        size_t i = 0;
+        while (i < m_bytes.size()) {
+            m_lastOffset += readNumber(i);
+            const auto zigzag = readNumber(i);
+            m_last.line += zigzag & 1 ? -int(zigzag >> 1) : int(zigzag >> 1);
+            m_last.column = readNumber(i);
+        }
+    }
+
+    // Ignored when `position` is unknown or the same as the last entry
+    void add(size_t offset, SourcePosition position)
+    {
+        if (position.line == 0 || position == m_last)
+            return;
+        writeNumber(offset - m_lastOffset);
+        const int lineDelta = position.line - m_last.line;
+        writeNumber(lineDelta >= 0 ? uint64_t(lineDelta) << 1 : (uint64_t(-lineDelta) << 1) | 1);
+        writeNumber(position.column);
+        m_lastOffset = offset;
+        m_last = position;
+    }
+
+    // Position of the instruction at `offset`, unknown before the first entry
+    SourcePosition at(size_t offset) const
+    {
+        SourcePosition position;
+        size_t entryOffset = 0;
+        size_t i = 0;
+        while (i < m_bytes.size()) {
+            const auto next = entryOffset + readNumber(i);
+            if (next > offset)
+                break;
+            entryOffset = next;
+            const auto zigzag = readNumber(i);
+            position.line += zigzag & 1 ? -int(zigzag >> 1) : int(zigzag >> 1);
+            position.column = readNumber(i);
+        }
+        return position;
+    }
+
+    size_t bytes() const { return m_bytes.capacity(); }
+
+    const std::vector<uint8_t> &encoded() const { return m_bytes; }
+
+private:
+    void writeNumber(uint64_t value)
+    {
+        do {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            m_bytes.push_back(value > 0 ? byte | 0x80 : byte);
+        } while (value > 0);
+    }
+
+    uint64_t readNumber(size_t &i) const
+    {
+        uint64_t value = 0;
+        for (int shift = 0; i < m_bytes.size(); shift += 7) {
+            const auto byte = m_bytes[i++];
+            value |= uint64_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                break;
+        }
+        return value;
+    }
+
+    std::vector<uint8_t> m_bytes;
+    // The last entry, to encode the next one
+    size_t m_lastOffset{0};
+    SourcePosition m_last;
+};
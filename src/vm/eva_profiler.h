@@ -0,0 +1,226 @@
+#pragma once
+
+#include "../disassemble/eva_disassembler.h"
+#include "evavalue.h"
+#include "opcodes.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Execution counts and time of the instructions run by EvaVM::eval(), by
+ * opcode, by pair of consecutive opcodes and by instruction of each code
+ * object. Enabled with EvaVM::setProfiling().
+ *
+ * Time is measured in ticks: the time stamp counter on x86, nanoseconds
+ * elsewhere. An instruction is charged from its dispatch to the dispatch
+ * of the next one, so a call to a native includes the native, while a GC
+ * safepoint between two instructions is not charged.
+ */
+class EvaProfiler
+{
+public:
+    struct Counter
+    {
+        uint64_t count{0};
+        uint64_t ticks{0};
+    };
+
+    EvaProfiler()
+        : m_pairs(OPCODES * OPCODES)
+    {}
+
+    static uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+
+    // Called by the interpreter when dispatching an instruction
+    void startInstruction(CodeObject *co, size_t offset, uint8_t opcode)
+    {
+        if (co != m_co) {
+            m_co = co;
+            auto &counters = m_instructions[co];
+            counters.resize(co->code.size());
+            m_coCounters = counters.data();
+        }
+        m_opcode = opcode;
+        m_instruction = &m_coCounters[offset];
+        m_opcodes[opcode].count++;
+        m_instruction->count++;
+        if (m_previousOpcode != NONE) {
+            m_pairs[m_previousOpcode * OPCODES + opcode].count++;
+        }
+        m_start = now();
+    }
+
+    // Called after the instruction, before any GC safepoint
+    void finishInstruction()
+    {
+        if (m_instruction == nullptr)
+            return;
+        const auto ticks = now() - m_start;
+        m_opcodes[m_opcode].ticks += ticks;
+        m_instruction->ticks += ticks;
+        if (m_previousOpcode != NONE) {
+            // A superinstruction would replace both
+            m_pairs[m_previousOpcode * OPCODES + m_opcode].ticks += m_previousTicks + ticks;
+        }
+        m_previousOpcode = m_opcode;
+        m_previousTicks = ticks;
+        m_instruction = nullptr;
+    }
+
+    const Counter &opcode(uint8_t opcode) const { return m_opcodes[opcode]; }
+    const Counter &pair(uint8_t first, uint8_t second) const
+    {
+        return m_pairs[first * OPCODES + second];
+    }
+    // The counters of the instruction at `offset`, zero if it never ran
+    Counter instruction(CodeObject *co, size_t offset) const
+    {
+        auto it = m_instructions.find(co);
+        return it != m_instructions.end() && offset < it->second.size() ? it->second[offset]
+                                                                        : Counter{};
+    }
+
+    uint64_t totalTicks() const
+    {
+        uint64_t total = 0;
+        for (const auto &counter : m_opcodes) {
+            total += counter.ticks;
+        }
+        return total;
+    }
+
+    /*
+     * The profiled code objects are roots, so the collector keeps them and
+     * updates the keys when it moves them.
+     */
+    template<typename Visitor>
+    void visitObjects(Visitor &&visit)
+    {
+        decltype(m_instructions) instructions;
+        for (auto &[co, counters] : m_instructions) {
+            Traceable *ref = co;
+            visit(ref);
+            instructions[static_cast<CodeObject *>(ref)] = std::move(counters);
+        }
+        m_instructions = std::move(instructions);
+        // Moving the vectors keeps their data
+        if (m_co != nullptr) {
+            Traceable *ref = m_co;
+            visit(ref);
+            m_co = static_cast<CodeObject *>(ref);
+        }
+    }
+
+    /*
+     * Opcodes and opcode pairs by time, then the listing of every profiled
+     * code object with the share of the time and the executions of each
+     * instruction.
+     */
+    void report(std::ostream &out, EvaDisassembler &disassembler, size_t topPairs = 20) const
+    {
+        const double total = std::max<uint64_t>(totalTicks(), 1);
+        char line[128];
+
+        out << "----------- Opcodes ------------------\n";
+        std::vector<uint8_t> opcodes;
+        for (size_t op = 0; op < OPCODES; ++op) {
+            if (m_opcodes[op].count > 0)
+                opcodes.push_back(op);
+        }
+        std::sort(opcodes.begin(), opcodes.end(),
+                  [this](uint8_t a, uint8_t b) { return m_opcodes[a].ticks > m_opcodes[b].ticks; });
+        snprintf(line, sizeof(line), "%6s %12s %10s %20s\n", "time", "count", "ticks/op", "name");
+        out << line;
+        for (auto op : opcodes) {
+            const auto &counter = m_opcodes[op];
+            snprintf(line, sizeof(line), "%5.1f%% %12llu %10.1f %20s\n",
+                     100.0 * counter.ticks / total, (unsigned long long) counter.count,
+                     double(counter.ticks) / counter.count, opcodeToString(op).c_str());
+            out << line;
+        }
+
+        out << "\n----------- Opcode pairs ------------------\n";
+        std::vector<size_t> pairs;
+        for (size_t pair = 0; pair < m_pairs.size(); ++pair) {
+            if (m_pairs[pair].count > 0)
+                pairs.push_back(pair);
+        }
+        std::sort(pairs.begin(), pairs.end(),
+                  [this](size_t a, size_t b) { return m_pairs[a].ticks > m_pairs[b].ticks; });
+        snprintf(line, sizeof(line), "%6s %12s %s\n", "time", "count", "pair");
+        out << line;
+        for (size_t i = 0; i < std::min(topPairs, pairs.size()); ++i) {
+            const auto &counter = m_pairs[pairs[i]];
+            snprintf(line, sizeof(line), "%5.1f%% %12llu %s %s\n", 100.0 * counter.ticks / total,
+                     (unsigned long long) counter.count,
+                     opcodeToString(pairs[i] / OPCODES).c_str(),
+                     opcodeToString(pairs[i] % OPCODES).c_str());
+            out << line;
+        }
+        out << "\n";
+
+        std::vector<std::pair<CodeObject *, uint64_t>> codeObjects;
+        for (const auto &[co, counters] : m_instructions) {
+            uint64_t ticks = 0;
+            for (const auto &counter : counters) {
+                ticks += counter.ticks;
+            }
+            codeObjects.push_back({co, ticks});
+        }
+        std::sort(codeObjects.begin(), codeObjects.end(),
+                  [](const auto &a, const auto &b) { return a.second > b.second; });
+        for (const auto &entry : codeObjects) {
+            const auto &counters = m_instructions.at(entry.first);
+            disassembler.disassemble(entry.first, out, [&](size_t offset) {
+                if (offset == SIZE_MAX) {
+                    snprintf(line, sizeof(line), "%6s %12s ", "time", "count");
+                } else if (offset < counters.size() && counters[offset].count > 0) {
+                    snprintf(line, sizeof(line), "%5.1f%% %12llu ",
+                             100.0 * counters[offset].ticks / total,
+                             (unsigned long long) counters[offset].count);
+                } else {
+                    snprintf(line, sizeof(line), "%6s %12s ", "", "");
+                }
+                return std::string(line);
+            });
+        }
+    }
+
+private:
+    static constexpr size_t OPCODES = 256;
+    static constexpr int NONE = -1;
+
+    std::array<Counter, OPCODES> m_opcodes{};
+    // Indexed by first * OPCODES + second
+    std::vector<Counter> m_pairs;
+    std::unordered_map<CodeObject *, std::vector<Counter>> m_instructions;
+
+    // Instruction running, and the previous one
+    CodeObject *m_co{nullptr};
+    Counter *m_coCounters{nullptr};
+    Counter *m_instruction{nullptr};
+    uint8_t m_opcode{0};
+    uint64_t m_start{0};
+    int m_previousOpcode{NONE};
+    uint64_t m_previousTicks{0};
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "eva_heap.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <map>
+#include <ostream>
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+/*
+ * Sampling profiler: a SIGPROF timer, counting the CPU time of the process,
+ * asks the VM for a safepoint, where the Eva call stack is recorded. The
+ * interpreter already polls the safepoint flag, so sampling adds no cost
+ * between samples. Samples are exported in the folded stack format of
+ * flame graph tools: one line per distinct stack, "main;f;g count".
+ *
+ * The timer is process-wide, only one sampler runs at a time. It samples
+ * the VM of the thread that started it.
+ */
+class EvaSampler
+{
+public:
+    // Function and bytecode offset of the next instruction, line of the
+    // instruction running, 0 when unknown
+    struct Frame
+    {
+        std::string function;
+        size_t offset;
+        int line{0};
+
+        bool operator<(const Frame &other) const
+        {
+            return function < other.function || (function == other.function && offset < other.offset);
+        }
+    };
+
+    EvaSampler() = default;
+    ~EvaSampler() { stop(); }
+
+    EvaSampler(const EvaSampler &) = delete;
+    EvaSampler &operator=(const EvaSampler &) = delete;
+
+    // Takes a sample every `interval` of CPU time
+    void start(std::chrono::microseconds interval)
+    {
+        EvaSampler *none = nullptr;
+        if (!s_active.compare_exchange_strong(none, this)) {
+            DIE << "Sampler: another sampler is running";
+        }
+        // The signal may be handled by any thread
+        m_safepointRequest = EvaHeap::safepointRequestFlag();
+        struct sigaction action = {};
+        action.sa_handler = onTimer;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &m_previousAction);
+
+        const auto usec = std::max<long long>(interval.count(), 1);
+        itimerval timer = {};
+        timer.it_interval.tv_sec = usec / 1000000;
+        timer.it_interval.tv_usec = usec % 1000000;
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+
+    // Keeps the samples
+    void stop()
+    {
+        if (s_active != this)
+            return;
+        itimerval timer = {};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        // A signal may still be pending, it must not kill the process
+        if (m_previousAction.sa_handler == SIG_DFL) {
+            m_previousAction.sa_handler = SIG_IGN;
+        }
+        sigaction(SIGPROF, &m_previousAction, nullptr);
+        s_active = nullptr;
+    }
+
+    // Timer ticks not recorded yet
+    bool due() const { return m_pending.load(std::memory_order_relaxed) > 0; }
+
+    /*
+     * Records the stack, from the outermost frame, for the ticks since the
+     * previous sample: ticks arriving between two safepoints are all
+     * charged to the same stack.
+     */
+    void record(std::vector<Frame> stack)
+    {
+        const auto ticks = m_pending.exchange(0, std::memory_order_relaxed);
+        if (ticks > 0) {
+            m_stacks[std::move(stack)] += ticks;
+            m_samples += ticks;
+        }
+    }
+
+    size_t samples() const { return m_samples; }
+    const std::map<std::vector<Frame>, size_t> &stacks() const { return m_stacks; }
+
+    // Detail of the frames of the folded stacks
+    enum class Detail { FUNCTIONS, LINES, OFFSETS };
+
+    /*
+     * With LINES every frame is "function:line", with OFFSETS
+     * "function+offset", which tell apart the call sites; with FUNCTIONS
+     * the stacks of a function are merged.
+     */
+    void writeFolded(std::ostream &out, Detail detail = Detail::FUNCTIONS) const
+    {
+        std::map<std::string, size_t> folded;
+        for (const auto &[stack, count] : m_stacks) {
+            std::string line;
+            for (const auto &frame : stack) {
+                if (!line.empty())
+                    line += ';';
+                line += frame.function;
+                if (detail == Detail::LINES)
+                    line += ":" + std::to_string(frame.line);
+                else if (detail == Detail::OFFSETS)
+                    line += "+" + std::to_string(frame.offset);
+            }
+            folded[line] += count;
+        }
+        for (const auto &[line, count] : folded) {
+            out << line << ' ' << count << '\n';
+        }
+    }
+
+private:
+    static void onTimer(int)
+    {
+        // Only lock-free atomics here
+        if (auto sampler = s_active.load(std::memory_order_relaxed)) {
+            sampler->m_pending.fetch_add(1, std::memory_order_relaxed);
+            sampler->m_safepointRequest->store(true, std::memory_order_relaxed);
+        }
+    }
+
+    static inline std::atomic<EvaSampler *> s_active{nullptr};
+
+    std::atomic<size_t> m_pending{0};
+    std::atomic<bool> *m_safepointRequest{nullptr};
+    size_t m_samples{0};
+    std::map<std::vector<Frame>, size_t> m_stacks;
+    struct sigaction m_previousAction = {};
+};
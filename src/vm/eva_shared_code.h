@@ -0,0 +1,136 @@
+#pragma once
+
+#include "evavalue.h"
+#include "globals.h"
+#include "logger.h"
+
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * Compiled modules shared by any number of VMs, on any thread: the
+ * globals defined by the modules, and the code objects, functions,
+ * strings and natives they reach, frozen out of every heap. See
+ * EvaVM::compileShared().
+ *
+ * Frozen objects are immutable and never collected: they are always
+ * marked, so the collectors of the VMs never trace, move nor free them,
+ * and they are freed with the EvaSharedCode. A VM booted from it starts
+ * with a copy on write of the globals table and no object of its own, see
+ * EvaVM(std::shared_ptr<const EvaSharedCode>).
+ *
+ * Closures capturing variables, cells and coroutines are mutable: modules
+ * must not leave them in the globals.
+ */
+class EvaSharedCode
+{
+public:
+    // Copies the globals, and everything they reach, out of the heap
+    static std::shared_ptr<const EvaSharedCode> freeze(const Globals &globals)
+    {
+        std::shared_ptr<EvaSharedCode> code(new EvaSharedCode());
+        auto table = std::make_shared<std::vector<Globals::Variable>>();
+        for (const auto &variable : *globals.m_values) {
+            table->push_back({variable.name, code->freeze(variable.value, variable.name)});
+        }
+        code->m_globals = std::move(table);
+        code->m_copies.clear();
+        return code;
+    }
+
+    ~EvaSharedCode()
+    {
+        for (auto object : m_objects) {
+            object->~Traceable();
+            ::operator delete(object);
+        }
+    }
+
+    EvaSharedCode(const EvaSharedCode &) = delete;
+    EvaSharedCode &operator=(const EvaSharedCode &) = delete;
+
+    const Globals::Snapshot &globals() const { return m_globals; }
+
+    size_t objects() const { return m_objects.size(); }
+
+private:
+    // Writes and reads the shared code as an image file
+    friend class EvaImage;
+
+    EvaSharedCode() = default;
+
+    EvaValue freeze(const EvaValue &value, const std::string &global)
+    {
+        if (!isObject(value) || value.asObject()->frozen) {
+            return value;
+        }
+        return EvaValue{.type = EvaValueType::OBJECT, .object = freeze(value.asObject(), global)};
+    }
+
+    Object *freeze(Object *object, const std::string &global)
+    {
+        if (auto it = m_copies.find(object); it != m_copies.end()) {
+            return it->second;
+        }
+        switch (object->type) {
+        case ObjectType::STRING:
+            return m_copies[object] =
+                       make<StringObject>(static_cast<StringObject *>(object)->share());
+        case ObjectType::NATIVE: {
+            auto native = static_cast<NativeFunction *>(object);
+            return m_copies[object] = make<NativeFunction>(native->fn, native->name, native->arity);
+        }
+        case ObjectType::CODE: {
+            auto co = static_cast<CodeObject *>(object);
+            // Registered first, the constants may lead back to it
+            auto copy = make<CodeObject>(co->name, co->arity);
+            m_copies[object] = copy;
+            copy->code = co->code;
+            copy->positions = co->positions;
+            copy->upvalues = co->upvalues;
+            for (const auto &constant : co->constants) {
+                copy->constants.push_back(freeze(constant, global));
+            }
+            return copy;
+        }
+        case ObjectType::FUNCTION: {
+            auto function = static_cast<FunctionObject *>(object);
+            if (!function->cells.empty()) {
+                DIE << "Shared code: the global " << global << " holds " << function->co->name
+                    << ", which captures variables";
+            }
+            auto copy = make<FunctionObject>(nullptr);
+            m_copies[object] = copy;
+            copy->co = static_cast<CodeObject *>(freeze(function->co, global));
+            return copy;
+        }
+        default:
+            DIE << "Shared code: the global " << global << " holds "
+                << toString(EvaValue{.type = EvaValueType::OBJECT, .object = object})
+                << ", which is mutable";
+            return nullptr;
+        }
+    }
+
+    // Out of the heap, like EvaHeap::allocate() sets the header
+    template<typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        auto object = ::new (::operator new(sizeof(T))) T(std::forward<Args>(args)...);
+        object->marked = true;
+        object->frozen = true;
+        object->site = 0;
+        object->size = sizeof(T);
+        m_objects.push_back(object);
+        return object;
+    }
+
+    std::vector<Traceable *> m_objects;
+    Globals::Snapshot m_globals;
+    // Copies of the objects of the heap, while freezing
+    std::unordered_map<const Object *, Object *> m_copies;
+};
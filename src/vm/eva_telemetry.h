@@ -0,0 +1,212 @@
+#pragma once
+
+#include "evavalue.h"
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Number of values of ObjectType
+constexpr size_t OBJECT_TYPES = 6;
+
+inline const char *objectTypeName(ObjectType type)
+{
+    switch (type) {
+    case ObjectType::STRING:
+        return "string";
+    case ObjectType::CODE:
+        return "code";
+    case ObjectType::NATIVE:
+        return "native";
+    case ObjectType::FUNCTION:
+        return "function";
+    case ObjectType::CELL:
+        return "cell";
+    case ObjectType::COROUTINE:
+        return "coroutine";
+    }
+    return "unknown";
+}
+
+// One minor collection, or one full collection from the marking to the
+// end of the sweep
+struct GCRecord
+{
+    enum class Kind {
+        MINOR,
+        FULL,
+    };
+
+    Kind kind{Kind::MINOR};
+    bool incremental{false};
+    bool compacted{false};
+    // Time the program was stopped, in total and in the longest pause. An
+    // incremental collection stops the program once per slice.
+    std::chrono::nanoseconds pause{0};
+    std::chrono::nanoseconds longestPause{0};
+    std::chrono::nanoseconds markTime{0};
+    // Sweep or compaction, measured on the helper thread for a concurrent
+    // sweep
+    std::chrono::nanoseconds sweepTime{0};
+    // Young and old bytes
+    size_t bytesBefore{0};
+    size_t bytesAfter{0};
+    size_t freedBytes{0};
+    // Indexed by ObjectType
+    std::array<size_t, OBJECT_TYPES> freedObjects{};
+
+    void addPause(std::chrono::nanoseconds duration)
+    {
+        pause += duration;
+        longestPause = std::max(longestPause, duration);
+    }
+
+    void addFreed(Traceable *object)
+    {
+        freedObjects[size_t(static_cast<Object *>(object)->type)]++;
+        freedBytes += object->size;
+    }
+};
+
+struct GCCounters
+{
+    size_t minorCollections{0};
+    size_t fullCollections{0};
+    size_t compactions{0};
+    std::chrono::nanoseconds totalPause{0};
+    std::chrono::nanoseconds maxPause{0};
+    size_t freedObjects{0};
+    size_t freedBytes{0};
+    // Since the start of the process, by all the VMs
+    size_t allocatedObjects{0};
+    size_t allocatedBytes{0};
+};
+
+// Bytecode instruction that allocated objects
+struct AllocationSite
+{
+    std::string function;
+    size_t offset;
+
+    bool operator<(const AllocationSite &other) const
+    {
+        return function < other.function || (function == other.function && offset < other.offset);
+    }
+};
+
+struct AllocationStats
+{
+    // Stored in the objects allocated by the site, from 1
+    uint32_t id{0};
+    size_t objects{0};
+    size_t bytes{0};
+};
+
+/*
+ * What the collector did, queried with records() and counters() or written
+ * as one JSON object per line to a sink, for each collection.
+ */
+class EvaTelemetry
+{
+public:
+    // Records kept in memory, the older ones are dropped
+    static constexpr size_t MAX_RECORDS = 1024;
+
+    const std::deque<GCRecord> &records() const { return m_records; }
+
+    GCCounters counters() const
+    {
+        auto counters = m_counters;
+        counters.allocatedObjects = EvaHeap::allocatedObjectsTotal();
+        counters.allocatedBytes = EvaHeap::allocatedBytesTotal();
+        return counters;
+    }
+
+    // nullptr disables the output
+    void setSink(std::ostream *sink) { m_sink = sink; }
+
+    /*
+     * Counts the allocations of each instruction, see allocationSites().
+     * Disabled by default: the VM looks up the site at every allocating
+     * instruction.
+     */
+    void setTrackAllocationSites(bool enabled) { m_trackAllocationSites = enabled; }
+    bool tracksAllocationSites() const { return m_trackAllocationSites; }
+    const std::map<AllocationSite, AllocationStats> &allocationSites() const
+    {
+        return m_allocationSites;
+    }
+
+    AllocationStats &allocationSite(const AllocationSite &site)
+    {
+        auto [it, inserted] = m_allocationSites.try_emplace(site);
+        if (inserted) {
+            m_sitesById.push_back(&it->first);
+            it->second.id = m_sitesById.size();
+        }
+        return it->second;
+    }
+
+    // The site with `id`, nullptr for 0 or unknown ids
+    const AllocationSite *allocationSiteById(uint32_t id) const
+    {
+        return id > 0 && id <= m_sitesById.size() ? m_sitesById[id - 1] : nullptr;
+    }
+
+    void record(const GCRecord &record)
+    {
+        if (record.kind == GCRecord::Kind::MINOR) {
+            m_counters.minorCollections++;
+        } else {
+            m_counters.fullCollections++;
+        }
+        if (record.compacted) {
+            m_counters.compactions++;
+        }
+        m_counters.totalPause += record.pause;
+        m_counters.maxPause = std::max(m_counters.maxPause, record.longestPause);
+        for (auto freed : record.freedObjects) {
+            m_counters.freedObjects += freed;
+        }
+        m_counters.freedBytes += record.freedBytes;
+
+        if (m_records.size() == MAX_RECORDS) {
+            m_records.pop_front();
+        }
+        m_records.push_back(record);
+        if (m_sink != nullptr) {
+            writeJson(*m_sink, record);
+        }
+    }
+
+    static void writeJson(std::ostream &out, const GCRecord &record)
+    {
+        out << "{\"kind\":\"" << (record.kind == GCRecord::Kind::MINOR ? "minor" : "full")
+            << "\",\"incremental\":" << (record.incremental ? "true" : "false")
+            << ",\"compacted\":" << (record.compacted ? "true" : "false")
+            << ",\"pause_ns\":" << record.pause.count()
+            << ",\"longest_pause_ns\":" << record.longestPause.count()
+            << ",\"mark_ns\":" << record.markTime.count()
+            << ",\"sweep_ns\":" << record.sweepTime.count()
+            << ",\"bytes_before\":" << record.bytesBefore
+            << ",\"bytes_after\":" << record.bytesAfter
+            << ",\"freed_bytes\":" << record.freedBytes << ",\"freed_objects\":{";
+        for (size_t type = 0; type < OBJECT_TYPES; ++type) {
+            out << (type > 0 ? "," : "") << '"' << objectTypeName(ObjectType(type))
+                << "\":" << record.freedObjects[type];
+        }
+        out << "}}\n";
+    }
+
+private:
+    std::deque<GCRecord> m_records;
+    GCCounters m_counters;
+    std::ostream *m_sink{nullptr};
+    bool m_trackAllocationSites{false};
+    std::map<AllocationSite, AllocationStats> m_allocationSites;
+    std::vector<const AllocationSite *> m_sitesById;
+};
@@ -27,7 +27,7 @@ std::string EvaValue::asCppString() const
 {
     if (type == EvaValueType::OBJECT && object->type == ObjectType::STRING) {
         auto sobj = (StringObject *) object;
-        return sobj->string;
+        return sobj->text();
     } else {
         return "";
     }
@@ -57,12 +57,27 @@ FunctionObject *EvaValue::asFunction() const
     return nullptr;
 }
 
-size_t Traceable::bytesAllocated{0};
-std::list<Traceable *> Traceable::objects;
+CellObject *EvaValue::asCell() const
+{
+    if (type == EvaValueType::OBJECT && object->type == ObjectType::CELL) {
+        return (CellObject *) object;
+    }
+    return nullptr;
+}
+
+CoroutineObject *EvaValue::asCoroutine() const
+{
+    if (type == EvaValueType::OBJECT && object->type == ObjectType::COROUTINE) {
+        return (CoroutineObject *) object;
+    }
+    return nullptr;
+}
+
+thread_local std::list<Traceable *> Traceable::objects;
 
 void Traceable::printStats()
 {
-    std::cout << "Objects: " << objects.size() << "\n";
+    std::cout << "Objects: " << objects.size() + EvaHeap::youngObjects() << "\n";
     std::cout << "Memory: " << Traceable::bytesAllocated << "\n";
     std::cout << std::endl;
 }
@@ -1,8 +1,12 @@
 #pragma once
 
-#include <functional>
+#include "eva_heap.h"
+#include "eva_positions.h"
+
 #include <iostream>
 #include <list>
+#include <memory>
+#include <new>
 #include <optional>
 #include <string>
 #include <vector>
@@ -18,15 +22,26 @@ enum class ObjectType {
     CODE,
     NATIVE,
     FUNCTION,
+    CELL,
+    COROUTINE,
 };
 
-using NativeFn = std::function<void()>;
+class EvaVM;
+struct EvaValue;
+
+/*
+ * Native functions receive their arguments as a view on the VM stack
+ * (`args[0]` is the first argument) and return the result directly.
+ */
+using NativeFn = EvaValue (*)(EvaVM &vm, const EvaValue *args, size_t argc);
 
 struct Object;
 struct StringObject;
 struct CodeObject;
 struct NativeFunction;
 struct FunctionObject;
+struct CellObject;
+struct CoroutineObject;
 
 struct EvaValue
 {
@@ -45,40 +60,65 @@ struct EvaValue
     CodeObject *asCodeObject() const;
     NativeFunction *asNativeFunction() const;
     FunctionObject *asFunction() const;
+    CellObject *asCell() const;
+    CoroutineObject *asCoroutine() const;
 };
 
 struct Traceable
 {
-    static void *operator new(size_t sz)
-    {
-        void *object = ::operator new(sz);
-        ((Traceable *) object)->size = sz;
-        Traceable::objects.push_back((Traceable *) object);
-        Traceable::bytesAllocated += sz;
-        return object;
-    }
+    static void *operator new(size_t sz) { return EvaHeap::allocate(sz); }
 
-    static void operator delete(void *ptr)
-    {
-        Traceable::bytesAllocated -= ((Traceable *) ptr)->size;
-        ::operator delete(ptr);
-    }
+    // Sized: the object is destroyed, its `size` can't be read anymore
+    static void operator delete(void *ptr, size_t sz) { EvaHeap::release(ptr, sz); }
+
+    Traceable()
+        : marked(EvaHeap::newHeader().marked)
+        , site(EvaHeap::newHeader().site)
+        , size(EvaHeap::newHeader().size)
+    {}
+    // Objects moved by the collector keep their header, see moveTo()
+    Traceable(const Traceable &) = default;
+
+    // Objects are deleted through a Traceable pointer by the collector,
+    // make sure the members of the concrete type get destroyed too.
+    virtual ~Traceable() = default;
+
+    // Move constructs the object in `memory`, used by the collector to
+    // evacuate young objects.
+    virtual Traceable *moveTo(void *memory) = 0;
 
     static void printStats();
 
     static void clear()
     {
+        EvaHeap::clearRememberedSet();
         for (Traceable *o : objects) {
             delete o;
         }
         objects.clear();
+        EvaHeap::clearChunks();
+        EvaHeap::resetNursery();
+        EvaHeap::setPhase(EvaHeap::Phase::IDLE);
+        EvaHeap::shadedObjects().clear();
     }
 
-    bool marked{false};
+    // From EvaHeap::newHeader(), like `site` and `size`: objects allocated
+    // during a collection cycle start marked
+    bool marked;
+    // Already part of EvaHeap::rememberedSet()
+    bool remembered{false};
+    // Frozen in an EvaSharedCode, out of every heap: immutable and always
+    // marked, the collectors never trace, move nor free it
+    bool frozen{false};
+    // Id of the allocation site in the telemetry, 0 when not tracked
+    uint32_t site;
     size_t size;
+    // New location of a young object moved to the old space
+    Traceable *forward{nullptr};
 
-    static size_t bytesAllocated;
-    static std::list<Traceable *> objects;
+    static inline thread_local size_t bytesAllocated{0};
+    // Objects in the old space
+    static thread_local std::list<Traceable *> objects;
 };
 
 struct Object : public Traceable
@@ -97,13 +137,55 @@ struct StringObject : public Object
         , string(std::move(str))
     {}
 
+    StringObject(std::shared_ptr<const std::string> shared)
+        : Object(ObjectType::STRING)
+        , shared(std::move(shared))
+    {}
+
+    Traceable *moveTo(void *memory) override
+    {
+        return ::new (memory) StringObject(std::move(*this));
+    }
+
+    const std::string &text() const { return shared ? *shared : string; }
+
+    /*
+     * The text in a buffer counted by reference, which other isolates can
+     * read without copying it. Strings are immutable, so the text moves
+     * there the first time it is shared.
+     */
+    std::shared_ptr<const std::string> share()
+    {
+        if (!shared) {
+            shared = std::make_shared<const std::string>(std::move(string));
+            string = std::string();
+        }
+        return shared;
+    }
+
+    // Empty once shared
     std::string string;
+    std::shared_ptr<const std::string> shared;
 };
 
 struct LocalVar
 {
     std::string name;
     int blockLevel{0};
+    // Stack slot relative to the base pointer of the function
+    uint8_t slot{0};
+    // The variable is referenced by an inner function, so its stack slot
+    // holds a CellObject instead of the value itself.
+    bool captured{false};
+};
+
+struct UpvalueInfo
+{
+    std::string name;
+    // If true `index` is a (boxed) local slot of the enclosing function,
+    // otherwise it is an upvalue of the enclosing function itself.
+    bool fromParentLocal;
+    uint8_t index;
 };
 
 struct CodeObject : public Object
@@ -114,61 +196,189 @@ struct CodeObject : public Object
         , arity(arity)
     {}
 
+    Traceable *moveTo(void *memory) override
+    {
+        return ::new (memory) CodeObject(std::move(*this));
+    }
+
     void enterBlock() { currentLevel++; }
     void exitBlock() { currentLevel--; }
     bool isGlobalScope() { return name == "main" && currentLevel == 1; }
-    void addLocal(const std::string &name) { locals.push_back({name, currentLevel}); }
-    void addConst(EvaValue val) { constants.push_back(val); }
-    std::optional<size_t> getLocalIndex(const std::string &name)
+    void addLocal(const std::string &name, uint8_t slot, bool captured = false)
+    {
+        locals.push_back({name, currentLevel, slot, captured});
+    }
+    void addConst(EvaValue val);
+    const LocalVar *getLocal(const std::string &name)
     {
         // Start from the end, which are the latest defined locals.
         // Accept all variable names that have been defined in outer blocks
-        for (int i = locals.size(); i > 0; --i) {
+        for (int i = int(locals.size()) - 1; i >= 0; --i) {
             if (locals[i].name == name && locals[i].blockLevel <= currentLevel)
+                return &locals[i];
+        }
+        return nullptr;
+    }
+    std::optional<size_t> getUpvalueIndex(const std::string &name)
+    {
+        for (size_t i = 0; i < upvalues.size(); ++i) {
+            if (upvalues[i].name == name)
                 return i;
         }
         return {};
     }
+    size_t addUpvalue(const std::string &name, bool fromParentLocal, uint8_t index)
+    {
+        if (auto existing = getUpvalueIndex(name); existing)
+            return existing.value();
+        upvalues.push_back({name, fromParentLocal, index});
+        return upvalues.size() - 1;
+    }
     size_t variableNumberInCurrentBlock()
     {
         size_t count{0};
-        if (locals.size() > 0) {
-            while (locals.back().blockLevel == currentLevel) {
-                locals.pop_back();
-                count++;
-            }
+        while (!locals.empty() && locals.back().blockLevel == currentLevel) {
+            locals.pop_back();
+            count++;
         }
         return count;
     }
 
     std::string name;
     std::vector<uint8_t> code;
+    // Source positions of the instructions, for the diagnostics
+    PositionTable positions;
     std::vector<EvaValue> constants;
     int currentLevel{0};
+    // Number of values the code pushed on top of the base pointer, used
+    // by the compiler to assign stack slots to locals
+    int stackDepth{0};
     std::vector<LocalVar> locals;
+    // Variables of enclosing functions captured by this function
+    std::vector<UpvalueInfo> upvalues;
     int arity{0};
+    // EvaPerfMap::Trampoline running the function, set on its first call
+    // when the VM writes a perf map
+    void *trampoline{nullptr};
 };
 
 struct NativeFunction : public Object
 {
     NativeFunction(NativeFn fn, std::string name, int arity)
         : Object(ObjectType::NATIVE)
-        , fn(std::move(fn))
+        , fn(fn)
         , name(std::move(name))
         , arity(arity)
     {}
+
+    Traceable *moveTo(void *memory) override
+    {
+        return ::new (memory) NativeFunction(std::move(*this));
+    }
     NativeFn fn;
     std::string name;
     int arity{0};
 };
 
+/*
+ * Heap box for a local variable captured by an inner function.
+ */
+struct CellObject : public Object
+{
+    CellObject(EvaValue value)
+        : Object(ObjectType::CELL)
+        , value(value)
+    {}
+
+    Traceable *moveTo(void *memory) override
+    {
+        return ::new (memory) CellObject(std::move(*this));
+    }
+    EvaValue value;
+};
+
+/*
+ * A function is a code object plus the cells captured when the
+ * function has been created (empty for functions without upvalues).
+ */
 struct FunctionObject : public Object
 {
     FunctionObject(CodeObject *co)
         : Object(ObjectType::FUNCTION)
         , co(co)
     {}
+
+    Traceable *moveTo(void *memory) override
+    {
+        return ::new (memory) FunctionObject(std::move(*this));
+    }
+    CodeObject *co;
+    std::vector<CellObject *> cells;
+};
+
+// FIXME: use a largish stack because there are ops that don't pop
+// for example each time we load a const
+constexpr size_t STACK_LIMIT = 128;
+constexpr size_t FRAMES_LIMIT = 64;
+
+// State of the caller saved by OP_CALL, restored by OP_RETURN
+struct CallFrame
+{
+    const uint8_t *ip;
+    EvaValue *bp;
+    const EvaValue *constants;
     CodeObject *co;
+    FunctionObject *fn;
+};
+
+// Registers of the main program or of a coroutine while it doesn't run
+struct ExecutionContext
+{
+    CallFrame frame{};
+    EvaValue *sp{nullptr};
+    CallFrame *fp{nullptr};
+};
+
+/*
+ * A function running on its own operand and frame stacks: OP_YIELD, in
+ * the function or in any function it calls, suspends the coroutine and
+ * continues the code that ran OP_RESUME, which can continue the coroutine
+ * later.
+ */
+struct CoroutineObject : public Object
+{
+    enum class State {
+        CREATED,
+        SUSPENDED,
+        // Running, or waiting for a coroutine it resumed
+        RUNNING,
+        DONE,
+    };
+
+    CoroutineObject(FunctionObject *function)
+        : Object(ObjectType::COROUTINE)
+        , function(function)
+    {}
+
+    Traceable *moveTo(void *memory) override
+    {
+        return ::new (memory) CoroutineObject(std::move(*this));
+    }
+
+    // Until the first resume
+    FunctionObject *function;
+    State state{State::CREATED};
+    // From the first resume until done, out of the object so that the
+    // pointers into them stay valid when the object moves
+    std::unique_ptr<EvaValue[]> stack;
+    std::unique_ptr<CallFrame[]> frames;
+    ExecutionContext context;
+    // Continued by the next OP_YIELD, nullptr for the main program
+    CoroutineObject *resumer{nullptr};
+    // Started by spawn and run by the scheduler of the VM, never resumed
+    bool task{false};
+    // Of a finished task, for await
+    EvaValue result{};
 };
 
 inline bool isNumber(const EvaValue &val)
@@ -205,17 +415,33 @@ inline bool isFunction(const EvaValue &val)
     return isObjectType(val, ObjectType::FUNCTION);
 }
 
+inline bool isCell(const EvaValue &val)
+{
+    return isObjectType(val, ObjectType::CELL);
+}
+
+inline bool isCoroutine(const EvaValue &val)
+{
+    return isObjectType(val, ObjectType::COROUTINE);
+}
+
 inline EvaValue allocString(std::string str)
 {
     return EvaValue{.type = EvaValueType::OBJECT, .object = new StringObject(std::move(str))};
 }
 
+// A string reading a text shared with other isolates
+inline EvaValue allocString(std::shared_ptr<const std::string> shared)
+{
+    return EvaValue{.type = EvaValueType::OBJECT, .object = new StringObject(std::move(shared))};
+}
+
 inline EvaValue allocCode(std::string name, int arity)
 {
     return EvaValue{.type = EvaValueType::OBJECT, .object = new CodeObject(std::move(name), arity)};
 }
 
-inline EvaValue allocNative(std::function<void()> fn, std::string name, int arity)
+inline EvaValue allocNative(NativeFn fn, std::string name, int arity)
 {
     return EvaValue{.type = EvaValueType::OBJECT, .object = new NativeFunction(fn, name, arity)};
 }
@@ -225,13 +451,23 @@ inline EvaValue allocFunction(CodeObject *co)
     return EvaValue{.type = EvaValueType::OBJECT, .object = new FunctionObject(co)};
 }
 
+inline EvaValue allocCell(EvaValue value)
+{
+    return EvaValue{.type = EvaValueType::OBJECT, .object = new CellObject(value)};
+}
+
+inline EvaValue allocCoroutine(FunctionObject *function)
+{
+    return EvaValue{.type = EvaValueType::OBJECT, .object = new CoroutineObject(function)};
+}
+
 inline std::string toString(const EvaValue &value)
 {
     if (isNumber(value)) {
         return std::to_string(value.asNumber());
     }
     if (isString(value)) {
-        return value.asString()->string;
+        return value.asString()->text();
     }
     if (isBool(value)) {
         return std::to_string(value.asBool());
@@ -244,8 +480,39 @@ inline std::string toString(const EvaValue &value)
         return "FUNCTION " + value.asFunction()->co->name + "/"
                + std::to_string(value.asFunction()->co->arity);
     }
+    if (isCell(value)) {
+        return "CELL " + toString(value.asCell()->value);
+    }
+    if (isCoroutine(value)) {
+        return "COROUTINE";
+    }
     return "";
 }
 
+/*
+ * Must be called when storing `value` into `owner`:
+ * - old objects pointing to young ones are roots for the minor collection
+ * - while marking incrementally the stored object may not be traced
+ *   anymore from where it was loaded, so it is marked now (insertion barrier)
+ */
+inline void writeBarrier(Traceable *owner, const EvaValue &value)
+{
+    if (!isObject(value))
+        return;
+    auto object = value.asObject();
+    if (EvaHeap::isYoung(object)) {
+        if (!EvaHeap::isYoung(owner))
+            EvaHeap::remember(owner);
+    } else if (EvaHeap::phase() == EvaHeap::Phase::MARKING && !object->marked) {
+        EvaHeap::shade(object);
+    }
+}
+
+inline void CodeObject::addConst(EvaValue val)
+{
+    writeBarrier(this, val);
+    constants.push_back(val);
+}
+
 #define NUMBER(x) EvaValue({.type = EvaValueType::NUMBER, .number = x})
 #define BOOLEAN(x) EvaValue({.type = EvaValueType::BOOL, .boolean = x})
@@ -5,24 +5,35 @@
 #pragma once
 
 #include "../parser/eva_parser.h"
+#include "eva_channel.h"
 #include "eva_collector.h"
 #include "eva_compiler.h"
+#include "eva_event_loop.h"
+#include "eva_heap_snapshot.h"
+#include "eva_perf_map.h"
+#include "eva_profiler.h"
+#include "eva_sampler.h"
+#include "eva_shared_code.h"
 #include "evavalue.h"
 #include "globals.h"
 #include "logger.h"
 #include "opcodes.h"
 
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fcntl.h>
 #include <memory>
-#include <set>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
-// FIXME: use a largish stack because there are ops that don't pop
-// for example each time we load a const
-constexpr size_t STACK_LIMIT = 128;
-constexpr size_t GC_THRESHOLD = 512;
-
 #define BINARY_OP(bin_op) \
 do { \
     auto op2 = pop().asNumber(); \
@@ -30,6 +41,10 @@ do { \
     push(NUMBER(op1 bin_op op2)); \
 } while (0)
 
+// Instruction stream accessors, `ip` is a local of eval()
+#define READ_BYTE() (*ip++)
+#define READ_ADDRESS() (ip += 2, uint16_t((ip[-2] << 8) | ip[-1]))
+
 #define COMPARE_VALUES(op, v1, v2) \
     do { \
         switch (op) { \
@@ -60,50 +75,680 @@ class EvaVM
 {
 public:
     EvaVM()
-        : m_globals(std::make_shared<Globals>())
-        , parser(std::make_unique<syntax::eva_parser>())
-        , m_compiler(std::make_unique<EvaCompiler>(m_globals))
-        , m_collector(std::make_unique<EvaCollector>())
+        : EvaVM(std::make_shared<Globals>())
     {
         setGlobalVariables();
-    };
+    }
 
-    ~EvaVM() { Traceable::clear(); }
+    /*
+     * Boots on shared code: the globals start as its snapshot, the built-in
+     * natives included, and nothing is compiled nor allocated. The modules
+     * of the shared code are neither copied: the VM only owns the objects
+     * it creates.
+     */
+    explicit EvaVM(std::shared_ptr<const EvaSharedCode> code)
+        : EvaVM(std::make_shared<Globals>(code->globals()))
+    {
+        m_sharedCode = std::move(code);
+    }
+
+    // The objects of the VM are freed with the heap by the last VM of the
+    // thread, or by the next collection
+    ~EvaVM()
+    {
+        auto &vms = s_thread.vms;
+        vms.erase(std::find(vms.begin(), vms.end(), this));
+        if (vms.empty()) {
+            m_collector->waitForSweep();
+            Traceable::clear();
+            s_thread.collector.reset();
+        }
+    }
 
     EvaValue exec(const std::string &program)
     {
-        // Add an implicit block so that all list of instructions are ok
-        auto ast = parser->parse("(begin " + program + ")");
+        co = m_compiler->compile(parseProgram(*parser, program), "main");
+        fn = nullptr;
+        resetStacks();
+        return eval();
+    }
 
-        co = m_compiler->compile(ast, "main");
-        ip = &co->code[0];
-        sp = stack.begin();
+    // A parsed program, immutable: VMs on any thread can run it
+    using Program = std::shared_ptr<const Exp>;
+
+    static Program parse(const std::string &program)
+    {
+        syntax::eva_parser parser;
+        return std::make_shared<const Exp>(parseProgram(parser, program));
+    }
+
+    // The program is compiled by its first run in this VM, the next runs
+    // reuse the code while the globals it defined keep their indexes
+    EvaValue exec(const Program &program)
+    {
+        auto &compiled = m_programs[program];
+        if (compiled.code == nullptr || !defineGlobals(compiled)) {
+            const auto defined = m_globals->m_size;
+            compiled.code = m_compiler->compile(*program, "main");
+            compiled.globals.clear();
+            for (auto index = defined; index < m_globals->m_size; ++index) {
+                compiled.globals.push_back(m_globals->nameForIndex(index));
+            }
+            compiled.firstGlobal = defined;
+        }
+        co = compiled.code;
+        fn = nullptr;
+        resetStacks();
         return eval();
     }
 
+    /*
+     * Keeps the globals as they are now: restoreGlobals() brings them back,
+     * the globals defined and the values set since are dropped. The code of
+     * the programs is kept.
+     */
+    void saveGlobals() { m_globals->save(); }
+    void restoreGlobals() { m_globals->restore(); }
+
     EvaValue exec(const std::vector<uint8_t> &code, std::vector<EvaValue> constants)
     {
         co = allocCode("main", 0).asCodeObject();
         co->constants = std::move(constants);
         co->code = std::move(code);
-        ip = &co->code[0];
-        sp = stack.begin();
+        fn = nullptr;
+        resetStacks();
         return eval();
     }
 
+    /*
+     * Calls a function or a native from the host, as a program of its own:
+     * not while a program runs. Runs to the end, whatever the fuel.
+     */
+    EvaValue call(EvaValue callee, const std::vector<EvaValue> &args)
+    {
+        std::vector<EvaValue> constants{callee};
+        std::vector<uint8_t> code;
+        code.push_back(OP_CONST);
+        code.push_back(0);
+        for (const auto &arg : args) {
+            constants.push_back(arg);
+            code.push_back(OP_CONST);
+            code.push_back(uint8_t(constants.size() - 1));
+        }
+        code.push_back(OP_CALL);
+        code.push_back(uint8_t(args.size()));
+        code.push_back(OP_HALT);
+        auto result = exec(code, std::move(constants));
+        while (suspended()) {
+            result = resume();
+        }
+        return result;
+    }
+
+    struct NativeSpec
+    {
+        std::string name;
+        NativeFn fn;
+        int arity;
+    };
+
+    /*
+     * Natives are resolved by the compiler like global variables, so they
+     * must be registered before compiling the programs that use them. A
+     * name is registered once, the VM dies on a global of the same name.
+     */
+    void registerNative(const std::string &name, NativeFn fn, int arity)
+    {
+        m_globals->addNativeFunction(name, fn, arity);
+    }
+
+    // Register a whole host library at once
+    void registerNatives(const std::vector<NativeSpec> &library)
+    {
+        for (const auto &native : library) {
+            registerNative(native.name, native.fn, native.arity);
+        }
+    }
+
+    // The natives every VM starts with, EvaImage binds to them by name
+    static const std::vector<NativeSpec> &builtinNatives()
+    {
+        static const std::vector<NativeSpec> natives{
+            {
+                "square",
+                [](EvaVM &, const EvaValue *args, size_t) {
+                    auto x = args[0].asNumber();
+                    return NUMBER(x * x);
+                },
+                1,
+            },
+            // (coroutine <function>): the function runs on the first resume,
+            // with the resumed value as argument when it takes one
+            {
+                "coroutine",
+                [](EvaVM &, const EvaValue *args, size_t) {
+                    if (!isFunction(args[0])) {
+                        DIE << "VM: coroutine expects a function, got " << toString(args[0]);
+                    }
+                    return allocCoroutine(args[0].asFunction());
+                },
+                1,
+            },
+            {
+                "finished",
+                [](EvaVM &, const EvaValue *args, size_t) {
+                    if (!isCoroutine(args[0])) {
+                        DIE << "VM: finished expects a coroutine, got " << toString(args[0]);
+                    }
+                    return BOOLEAN(args[0].asCoroutine()->state == CoroutineObject::State::DONE);
+                },
+                1,
+            },
+
+            // (spawn <function>): a task runs the function, without argument,
+            // when the running code waits or ends
+            {
+                "spawn",
+                [](EvaVM &vm, const EvaValue *args, size_t) {
+                    if (!isFunction(args[0]) || args[0].asFunction()->co->arity != 0) {
+                        DIE << "VM: spawn expects a function without parameters, got "
+                            << toString(args[0]);
+                    }
+                    auto task = allocCoroutine(args[0].asFunction());
+                    task.asCoroutine()->task = true;
+                    vm.m_ready.push_back({task.asCoroutine(), BOOLEAN(false)});
+                    return task;
+                },
+                1,
+            },
+            // (await <task>): the result of the task, once finished
+            {
+                "await",
+                [](EvaVM &vm, const EvaValue *args, size_t) {
+                    if (!isCoroutine(args[0]) || !args[0].asCoroutine()->task) {
+                        DIE << "VM: await expects a task, got " << toString(args[0]);
+                    }
+                    auto task = args[0].asCoroutine();
+                    if (task->state == CoroutineObject::State::DONE) {
+                        return task->result;
+                    }
+                    PendingHandle handle;
+                    auto result = vm.pending(handle);
+                    vm.m_joins.push_back({task, handle});
+                    return result;
+                },
+                1,
+            },
+            // (sleep <milliseconds>)
+            {
+                "sleep",
+                [](EvaVM &vm, const EvaValue *args, size_t) {
+                    PendingHandle handle;
+                    auto result = vm.pending(handle);
+                    vm.eventLoop().after(std::chrono::milliseconds(int64_t(args[0].asNumber())),
+                                         [&vm, handle] { vm.complete(handle, BOOLEAN(true)); });
+                    return result;
+                },
+                1,
+            },
+            // (read <fd>): what is available, at least a byte, "" at the end
+            {
+                "read",
+                [](EvaVM &vm, const EvaValue *args, size_t) {
+                    const int fd = int(args[0].asNumber());
+                    setNonBlocking(fd);
+                    PendingHandle handle;
+                    auto result = vm.pending(handle);
+                    vm.eventLoop().whenReadable(fd, [&vm, fd, handle] {
+                        char buffer[4096];
+                        const auto n = ::read(fd, buffer, sizeof(buffer));
+                        vm.complete(handle, allocString(std::string(buffer, n > 0 ? n : 0)));
+                    });
+                    return result;
+                },
+                1,
+            },
+            // (write <fd> <string>): the number of bytes written, all of them
+            // unless the descriptor fails
+            {
+                "write",
+                [](EvaVM &vm, const EvaValue *args, size_t) {
+                    const int fd = int(args[0].asNumber());
+                    setNonBlocking(fd);
+                    PendingHandle handle;
+                    auto result = vm.pending(handle);
+                    vm.writeWhenReady(
+                        fd, std::make_shared<const std::string>(args[1].asCppString()), 0, handle);
+                    return result;
+                },
+                2,
+            },
+            {
+                "close",
+                [](EvaVM &, const EvaValue *args, size_t) {
+                    return BOOLEAN(::close(int(args[0].asNumber())) == 0);
+                },
+                1,
+            },
+
+            // (send <channel> <value>): numbers, booleans and strings, the
+            // receiver reads the text of a string without copying it
+            {
+                "send",
+                [](EvaVM &, const EvaValue *args, size_t) {
+                    findChannel(args[0])->send(toMessage(args[1]));
+                    return BOOLEAN(true);
+                },
+                2,
+            },
+            // (receive <channel>): the oldest message, the call waits for one
+            {
+                "receive",
+                [](EvaVM &vm, const EvaValue *args, size_t) {
+                    auto channel = findChannel(args[0]);
+                    auto &receivers = vm.m_receivers[channel->id()];
+                    // Messages go to the receivers which waited first
+                    if (receivers.empty()) {
+                        if (auto message = channel->tryReceive()) {
+                            vm.m_receivers.erase(channel->id());
+                            return fromMessage(*message);
+                        }
+                    }
+                    PendingHandle handle;
+                    auto result = vm.pending(handle);
+                    receivers.push_back(handle);
+                    if (receivers.size() == 1) {
+                        vm.receiveWhenReady(channel);
+                    }
+                    return result;
+                },
+                1,
+            },
+        };
+        return natives;
+    }
+
+    /*
+     * Runs `modules`, with `natives` registered, and freezes the globals
+     * they define for the VMs to share. Runs on a thread of its own: the
+     * VM compiling the modules clears the heap of its thread when it ends.
+     */
+    static std::shared_ptr<const EvaSharedCode> compileShared(
+        const std::vector<std::string> &modules, const std::vector<NativeSpec> &natives = {})
+    {
+        std::shared_ptr<const EvaSharedCode> code;
+        std::thread([&] {
+            EvaVM vm;
+            vm.setPrintListing(false);
+            vm.registerNatives(natives);
+            for (const auto &module : modules) {
+                vm.exec(module);
+                while (vm.suspended()) {
+                    vm.resume();
+                }
+            }
+            code = EvaSharedCode::freeze(vm.globals());
+        }).join();
+        return code;
+    }
+
+    void setInlineBudget(size_t budget) { m_compiler->setInlineBudget(budget); }
+    void setPrintListing(bool print) { m_compiler->setPrintListing(print); }
+
+    // Shared by the VMs of the thread, like the heap
+    EvaCollector &collector() { return *m_collector; }
+    Globals &globals() { return *m_globals; }
+
+    /*
+     * Counts and times every instruction run by the next programs, see
+     * EvaProfiler. Disabling drops the counters.
+     */
+    void setProfiling(bool enabled)
+    {
+        m_profiler = enabled ? std::make_unique<EvaProfiler>() : nullptr;
+    }
+
+    // nullptr when not profiling
+    const EvaProfiler *profiler() const { return m_profiler.get(); }
+
+    /*
+     * Records the Eva call stack every `interval` of CPU time until
+     * stopSampling(), see EvaSampler. Restarting keeps the samples.
+     */
+    void startSampling(std::chrono::microseconds interval = std::chrono::milliseconds(1))
+    {
+        if (!m_sampler) {
+            m_sampler = std::make_unique<EvaSampler>();
+        }
+        m_sampler->start(interval);
+    }
+
+    void stopSampling()
+    {
+        if (m_sampler) {
+            m_sampler->stop();
+        }
+    }
+
+    // nullptr when sampling was never started
+    const EvaSampler *sampler() const { return m_sampler.get(); }
+
+    // The profile, with the listings of the profiled code annotated
+    void printProfile(std::ostream &out)
+    {
+        if (m_profiler) {
+            EvaDisassembler disassembler(m_globals);
+            m_profiler->report(out, disassembler);
+        }
+    }
+
+    /*
+     * Runs every Eva function through its own trampoline listed in the
+     * perf map, see EvaPerfMap. Also enabled by EVA_PERF_MAP=1.
+     */
+    void setPerfMap(bool enabled)
+    {
+        if (enabled && !EvaPerfMap::supported()) {
+            DIE << "VM: perf map not supported on this architecture";
+        }
+        m_perfMap = enabled ? &EvaPerfMap::instance() : nullptr;
+    }
+
+    /*
+     * Writes every object with its references and the roots to `out`,
+     * see HeapSnapshot. Objects get their allocation site only while the
+     * telemetry tracks the sites.
+     */
+    void writeHeapSnapshot(std::ostream &out)
+    {
+        saveRunningCoroutine();
+        HeapSnapshot::write(out, m_collector->telemetry(), [this](auto &&add) {
+            const auto &main = m_coroutine ? m_main : ExecutionContext{{}, sp, fp};
+            for (auto slot = stack.begin(); slot < main.sp; ++slot) {
+                if (isObject(*slot)) {
+                    add("stack[" + std::to_string(slot - stack.begin()) + "]", slot->object);
+                }
+            }
+            for (auto frame = frames.begin(); frame < main.fp; ++frame) {
+                const auto index = std::to_string(frame - frames.begin());
+                add("frame[" + index + "].co", frame->co);
+                add("frame[" + index + "].fn", frame->fn);
+            }
+            add("co", co);
+            add("fn", fn);
+            if (m_coroutine) {
+                add("main.co", m_main.frame.co);
+                add("main.fn", m_main.frame.fn);
+                add("coroutine", m_coroutine);
+            }
+            for (auto &wakeup : m_ready) {
+                add("ready", wakeup.context);
+                if (isObject(wakeup.value)) {
+                    add("ready value", wakeup.value.object);
+                }
+            }
+            for (auto &[handle, context] : m_waiting) {
+                add("waiting " + std::to_string(handle), context);
+            }
+            for (auto &join : m_joins) {
+                add("await " + std::to_string(join.handle), join.task);
+            }
+            for (auto &g : *m_globals->m_values) {
+                if (isObject(g.value)) {
+                    add("global " + g.name, g.value.object);
+                }
+            }
+            if (m_globals->m_saved && !m_globals->m_savedShared) {
+                for (auto &g : *m_globals->m_saved) {
+                    if (isObject(g.value)) {
+                        add("saved global " + g.name, g.value.object);
+                    }
+                }
+            }
+            m_compiler->visitObjects([&add](Traceable *&object) { add("compiler", object); });
+            if (m_profiler) {
+                m_profiler->visitObjects([&add](Traceable *&object) { add("profiler", object); });
+            }
+        });
+    }
+
     EvaValue eval()
     {
+        m_suspension = Suspension::NONE;
+        return runSlice(co->code.data(), stack.begin());
+    }
+
+    /*
+     * Bounds the work done by exec() and resume(): every backward jump and
+     * every call burns one unit of fuel, and the program is suspended at
+     * the next one once `fuel` units are burnt: every slice runs at least
+     * one of them. Straight-line code between two checks is
+     * bounded by the size of a function, so a slice is bounded too. 0, the
+     * default, never suspends.
+     */
+    void setFuel(size_t fuel) { m_fuel = fuel; }
+
+    enum class Suspension {
+        NONE,
+        // Out of fuel, the result of exec() or resume() is meaningless
+        FUEL,
+        // By a yield out of any coroutine, exec() or resume() returns the
+        // yielded value: the script waits for the host
+        YIELD,
+        // Every task waits for an operation, never returned: exec() and
+        // resume() run the event loop until one can continue
+        WAITING,
+    };
+
+    // Why the last exec() or resume() returned before the end of the program
+    Suspension suspension() const { return m_suspension; }
+    bool suspended() const { return m_suspension != Suspension::NONE; }
+
+    /*
+     * Continues the suspended program where it stopped, with a full tank
+     * of fuel. After a yield, `value` is the result of the yield.
+     */
+    EvaValue resume(EvaValue value = BOOLEAN(false))
+    {
+        if (m_suspension == Suspension::NONE) {
+            DIE << "VM: no suspended program to resume";
+        }
+        if (m_suspension == Suspension::YIELD) {
+            push(value);
+        }
+        m_suspension = Suspension::NONE;
+        return runSlice(m_resumeIp, m_resumeBp);
+    }
+
+    using PendingHandle = uint64_t;
+
+    /*
+     * Async natives: a native that starts an operation returns
+     * pending(handle). The code that called it waits while the other
+     * tasks run, and continues when complete(handle, value) is called,
+     * usually by a callback of eventLoop(), with `value` as the result of
+     * the call.
+     */
+    EvaValue pending(PendingHandle &handle)
+    {
+        handle = m_nextPending++;
+        m_waiting[handle] = m_coroutine;
+        m_callPending = true;
+        return BOOLEAN(false);
+    }
+
+    // Ignored for the handles of an earlier program
+    void complete(PendingHandle handle, EvaValue value)
+    {
+        auto it = m_waiting.find(handle);
+        if (it == m_waiting.end())
+            return;
+        m_ready.push_back({it->second, value});
+        m_waiting.erase(it);
+    }
+
+    EvaEventLoop &eventLoop()
+    {
+        if (!m_loop) {
+            m_loop = std::make_unique<EvaEventLoop>();
+        }
+        return *m_loop;
+    }
+
+private:
+    static constexpr char PROGRAM_PREFIX[] = "(begin ";
+
+    // A program compiled by exec(const Program &), with the globals the
+    // compilation defined from `firstGlobal` on
+    struct CompiledProgram
+    {
+        CodeObject *code{nullptr};
+        size_t firstGlobal{0};
+        std::vector<std::string> globals;
+    };
+
+    explicit EvaVM(std::shared_ptr<Globals> globals)
+        : m_globals(std::move(globals))
+        , parser(std::make_unique<syntax::eva_parser>())
+        , m_compiler(std::make_unique<EvaCompiler>(m_globals))
+    {
+        if (s_thread.vms.empty()) {
+            s_thread.collector = std::make_unique<EvaCollector>();
+        }
+        m_collector = s_thread.collector.get();
+        s_thread.vms.push_back(this);
+        if (const char *perfMap = std::getenv("EVA_PERF_MAP"); perfMap && perfMap[0] == '1') {
+            setPerfMap(true);
+        }
+    }
+
+    static Exp parseProgram(syntax::eva_parser &parser, const std::string &program)
+    {
+        // Add an implicit block so that all list of instructions are ok
+        auto ast = parser.parse(PROGRAM_PREFIX + program + ")");
+        unshiftFirstLine(ast);
+        // The implicit block has no position in the program
+        ast.line = 0;
+        return ast;
+    }
+
+    // The columns of the first line of a program count from after PROGRAM_PREFIX
+    static void unshiftFirstLine(Exp &exp)
+    {
+        if (exp.line == 1) {
+            exp.column = std::max(exp.column - int(sizeof(PROGRAM_PREFIX) - 1), 0);
+        }
+        for (auto &child : exp.list) {
+            unshiftFirstLine(child);
+        }
+    }
+
+    // Defines the globals of a compiled program again after
+    // restoreGlobals(), false when they don't get the same indexes
+    bool defineGlobals(const CompiledProgram &compiled)
+    {
+        for (size_t i = 0; i < compiled.globals.size(); ++i) {
+            auto index = m_globals->getGlobalIndex(compiled.globals[i]);
+            if (!index) {
+                index = m_globals->define(compiled.globals[i]);
+            }
+            if (*index != compiled.firstGlobal + i) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The operations and the tasks of the previous program are dropped
+    void resetStacks()
+    {
+        m_ready.clear();
+        m_waiting.clear();
+        m_joins.clear();
+        m_receivers.clear();
+        m_callPending = false;
+        if (m_loop) {
+            m_loop->clear();
+        }
+        m_coroutine = nullptr;
+        m_stackBase = stack.begin();
+        m_framesBase = frames.begin();
+        sp = stack.begin();
+        fp = frames.begin();
+    }
+
+    EvaValue runSlice(const uint8_t *ip, EvaValue *bp)
+    {
+        m_fuelLeft = m_fuel > 0 ? m_fuel : SIZE_MAX;
         for (;;) {
-            auto opcode = read_byte();
-            //            std::cout << "current opcode " << opcodeToString(opcode) << '\n';
-            //            printStack();
+            EvaValue result;
+            if (m_perfMap) {
+                callThroughTrampoline(co, [&] { result = run(ip, bp, nullptr); });
+            } else {
+                result = run(ip, bp, nullptr);
+            }
+            if (m_suspension != Suspension::WAITING) {
+                // Nested loops unwound by a yield don't return the value
+                return m_suspension == Suspension::YIELD ? m_yielded : result;
+            }
+            waitForWakeup();
+            m_suspension = Suspension::NONE;
+            ip = m_resumeIp;
+            bp = m_resumeBp;
+            wakeNext(ip, bp);
+        }
+    }
+
+    // Every task waits: runs the event loop until one can continue
+    void waitForWakeup()
+    {
+        while (m_ready.empty()) {
+            if (!m_loop || m_loop->idle()) {
+                DIE << "VM: every task waits, and no operation is pending";
+            }
+            m_loop->runOnce();
+        }
+    }
+
+    /*
+     * Runs the code of `co` from `ip` until OP_HALT or until the program is
+     * suspended. With the perf map, every call runs the callee in a nested
+     * loop entered through its trampoline, which returns the result of the
+     * function when OP_RETURN pops `exitFrame`.
+     */
+    EvaValue run(const uint8_t *ip, EvaValue *bp, CallFrame *exitFrame)
+    {
+        // Frame state is kept in locals so that the compiler can keep it in
+        // registers, it is spilled to the frames array only on calls.
+        const uint8_t *code = co->code.data();
+        const EvaValue *constants = co->constants.data();
+        EvaProfiler *profiler = m_profiler.get();
+
+        for (;;) {
+            if (profiler) {
+                profiler->finishInstruction();
+            }
+            if (EvaHeap::safepointRequested()) {
+                maybeGC();
+                if (m_sampler && m_sampler->due()) {
+                    sampleStack(ip - code);
+                }
+            }
+            const uint8_t *instruction = ip;
+            auto opcode = READ_BYTE();
+            if (profiler) {
+                profiler->startInstruction(co, instruction - code, opcode);
+            }
             switch (opcode) {
             case OP_HALT: {
+                if (profiler) {
+                    profiler->finishInstruction();
+                }
                 return pop();
             }
             case OP_CONST: {
-                auto constIndex = read_byte();
-                push(co->constants[constIndex]);
+                auto constIndex = READ_BYTE();
+                push(constants[constIndex]);
                 break;
             }
             case OP_ADD: {
@@ -114,8 +759,9 @@ public:
                 }
                 if (isObjectType(stack2, ObjectType::STRING)
                     && isObjectType(stack1, ObjectType::STRING)) {
-                    maybeGC();
-                    push(allocString(stack1.asCppString() + stack2.asCppString()));
+                    trackAllocations(instruction, code, [&] {
+                        push(allocString(stack1.asCppString() + stack2.asCppString()));
+                    });
                 }
                 break;
             }
@@ -132,7 +778,7 @@ public:
                 break;
             }
             case OP_COMP: {
-                auto op = ComparisonType(read_byte());
+                auto op = ComparisonType(READ_BYTE());
                 auto stack2 = pop();
                 auto stack1 = pop();
                 if (isNumber(stack1) && isNumber(stack2)) {
@@ -143,45 +789,63 @@ public:
                 break;
             }
             case OP_JMP_IF_FALSE: {
-                auto addr = read_address();
+                auto addr = READ_ADDRESS();
                 if (pop().asBool() == false) {
-                    ip = &co->code[addr];
+                    ip = code + addr;
                 }
                 break;
             }
             case OP_JMP: {
-                auto addr = read_address();
-                ip = &co->code[addr];
+                auto addr = READ_ADDRESS();
+                // Only loops jump back. The jump is run again by resume(), which
+                // refills the tank: it needs fuel left to go through.
+                if (code + addr <= instruction) {
+                    if (m_fuelLeft == 0) {
+                        return suspend(instruction, bp, Suspension::FUEL);
+                    }
+                    --m_fuelLeft;
+                }
+                ip = code + addr;
                 break;
             }
             case OP_GET_GLOBAL: {
-                auto index = read_byte();
+                auto index = READ_BYTE();
                 push(m_globals->get(index));
                 break;
             }
             case OP_SET_GLOBAL: {
-                auto index = read_byte();
+                auto index = READ_BYTE();
                 m_globals->set(index, peek(0));
                 break;
             }
+            case OP_GUARD_GLOBAL: {
+                auto index = READ_BYTE();
+                const auto &expected = constants[READ_BYTE()];
+                auto addr = READ_ADDRESS();
+                const auto value = m_globals->get(index);
+                if (!isObject(value) || value.object != expected.object) {
+                    ip = code + addr;
+                }
+                break;
+            }
             case OP_POP:
                 pop();
                 break;
             case OP_GET_LOCAL: {
                 // Local variables are always stored on the stack
-                auto index = read_byte();
+                auto index = READ_BYTE();
                 push(bp[index]);
                 break;
             }
             case OP_SET_LOCAL: {
-                auto index = read_byte();
+                auto index = READ_BYTE();
                 // TODO: at the moment we are working only with a global stack.
                 // It must be changed to support function calls.
                 bp[index] = peek(0);
                 break;
             }
             case OP_SCOPE_EXIT: {
-                auto count = read_byte();
+                auto count = READ_BYTE();
                 // We need to preserve the value of the block on the top of the stack.
                 // Copy it then change the stack pointer
                 *(sp - count - 1) = peek(0);
@@ -189,66 +853,251 @@ public:
                 break;
             }
             case OP_CALL: {
-                auto args = read_byte();
+                if (m_fuelLeft == 0) {
+                    return suspend(instruction, bp, Suspension::FUEL);
+                }
+                --m_fuelLeft;
+                auto args = READ_BYTE();
                 auto fn = peek(args);
                 if (isNative(fn)) {
-                    fn.asNativeFunction()->fn();
-                    auto result = pop();
-                    popN(args + 1);
-                    push(result);
+                    auto native = fn.asNativeFunction();
+                    if (native->arity != args) {
+                        DIE << "VM: native " << native->name << " expects " << native->arity
+                            << " arguments, got " << int(args) << location(instruction - code);
+                    }
+                    // The result replaces the callee slot, the arguments are dropped
+                    EvaValue result;
+                    trackAllocations(instruction, code,
+                                     [&] { result = native->fn(*this, sp - args, args); });
+                    sp -= args;
+                    if (m_callPending) {
+                        // The result is pushed when the operation completes
+                        m_callPending = false;
+                        --sp;
+                        if (!wakeNext(ip, bp)) {
+                            return suspend(ip, bp, Suspension::WAITING);
+                        }
+                        code = co->code.data();
+                        constants = co->constants.data();
+                        if (exitFrame != nullptr) {
+                            return unwind(ip, bp);
+                        }
+                        break;
+                    }
+                    *(sp - 1) = result;
                 }
                 // User defined functions
                 else {
                     auto callee = fn.asFunction();
-                    frames.push(StackFrame{.ip = ip, .bp = bp, .co = co});
+                    auto calleeCode = callee->co;
+                    if (calleeCode->arity != args) {
+                        DIE << "VM: function " << calleeCode->name << " expects "
+                            << calleeCode->arity << " arguments, got " << int(args)
+                            << location(instruction - code);
+                    }
+                    if (fp == m_framesBase + FRAMES_LIMIT) {
+                        DIE << "VM: call stack overflow" << location(instruction - code);
+                    }
+                    *fp++ = CallFrame{
+                        .ip = ip, .bp = bp, .constants = constants, .co = co, .fn = this->fn};
 
-                    ip = &callee->co->code[0];
-                    co = callee->co;
+                    co = calleeCode;
+                    this->fn = callee;
+                    if (m_perfMap) {
+                        // The locals of this loop are still those of the caller
+                        const auto calleeBp = sp - args - 1;
+                        const auto calleeFrame = fp - 1;
+                        callThroughTrampoline(calleeCode, [&] {
+                            run(calleeCode->code.data(), calleeBp, calleeFrame);
+                        });
+                        // The frames are all saved, the rest of the program
+                        // runs without the nested loops
+                        if (m_suspension != Suspension::NONE) {
+                            return BOOLEAN(false);
+                        }
+                        if (m_unwinding) {
+                            if (exitFrame != nullptr) {
+                                return BOOLEAN(false);
+                            }
+                            m_unwinding = false;
+                            ip = m_resumeIp;
+                            bp = m_resumeBp;
+                            code = co->code.data();
+                            constants = co->constants.data();
+                        }
+                        break;
+                    }
+                    ip = code = calleeCode->code.data();
+                    constants = calleeCode->constants.data();
                     bp = sp - args - 1;
                 }
                 break;
             }
             case OP_RETURN: {
-                auto frame = frames.top();
-                frames.pop();
+                // Only the function of a coroutine returns from the first frame
+                if (fp == m_framesBase) {
+                    auto result = peek(0);
+                    auto coroutine = m_coroutine;
+                    coroutine->state = CoroutineObject::State::DONE;
+                    if (coroutine->task) {
+                        coroutine->result = result;
+                        writeBarrier(coroutine, result);
+                        finishTask(coroutine);
+                        if (!wakeNext(ip, bp)) {
+                            return suspend(ip, bp, Suspension::WAITING);
+                        }
+                    } else {
+                        switchTo(coroutine->resumer, ip, bp);
+                        coroutine->resumer = nullptr;
+                        push(result);
+                    }
+                    code = co->code.data();
+                    constants = co->constants.data();
+                    if (exitFrame != nullptr) {
+                        return unwind(ip, bp);
+                    }
+                    break;
+                }
+                const auto &frame = *--fp;
                 ip = frame.ip;
                 bp = frame.bp;
+                constants = frame.constants;
                 co = frame.co;
+                fn = frame.fn;
+                code = co->code.data();
+                if (fp == exitFrame) {
+                    return peek(0);
+                }
+                break;
+            }
+            case OP_MAKE_CELL: {
+                // Box a captured local in place, its slot now holds the cell
+                auto index = READ_BYTE();
+                trackAllocations(instruction, code, [&] { bp[index] = allocCell(bp[index]); });
+                break;
+            }
+            case OP_GET_CELL: {
+                auto index = READ_BYTE();
+                push(bp[index].asCell()->value);
+                break;
+            }
+            case OP_SET_CELL: {
+                auto index = READ_BYTE();
+                auto cell = bp[index].asCell();
+                cell->value = peek(0);
+                writeBarrier(cell, cell->value);
+                break;
+            }
+            case OP_GET_UPVALUE: {
+                auto index = READ_BYTE();
+                push(fn->cells[index]->value);
+                break;
+            }
+            case OP_SET_UPVALUE: {
+                auto index = READ_BYTE();
+                auto cell = fn->cells[index];
+                cell->value = peek(0);
+                writeBarrier(cell, cell->value);
+                break;
+            }
+            case OP_CLOSURE: {
+                auto index = READ_BYTE();
+                auto closureCode = constants[index].asCodeObject();
+                EvaValue closure;
+                trackAllocations(instruction, code, [&] { closure = allocFunction(closureCode); });
+                auto &cells = closure.asFunction()->cells;
+                cells.reserve(closureCode->upvalues.size());
+                for (const auto &upvalue : closureCode->upvalues) {
+                    cells.push_back(upvalue.fromParentLocal ? bp[upvalue.index].asCell()
+                                                            : fn->cells[upvalue.index]);
+                }
+                push(closure);
+                break;
+            }
+            case OP_RESUME: {
+                auto value = pop();
+                auto target = pop();
+                if (!isCoroutine(target)) {
+                    DIE << "VM: resume expects a coroutine, got " << toString(target)
+                        << location(instruction - code);
+                }
+                auto coroutine = target.asCoroutine();
+                if (coroutine->task) {
+                    DIE << "VM: cannot resume a task" << location(instruction - code);
+                }
+                if (coroutine->state == CoroutineObject::State::RUNNING
+                    || coroutine->state == CoroutineObject::State::DONE) {
+                    DIE << "VM: cannot resume a "
+                        << (coroutine->state == CoroutineObject::State::DONE ? "finished"
+                                                                              : "running")
+                        << " coroutine" << location(instruction - code);
+                }
+                if (coroutine->state == CoroutineObject::State::CREATED) {
+                    const auto calleeCode = coroutine->function->co;
+                    if (calleeCode->arity > 1) {
+                        DIE << "VM: the function of a coroutine takes at most one argument, "
+                            << calleeCode->name << " expects " << calleeCode->arity
+                            << location(instruction - code);
+                    }
+                    startCoroutine(coroutine, value);
+                }
+                coroutine->resumer = m_coroutine;
+                if (m_coroutine != nullptr) {
+                    writeBarrier(coroutine,
+                                 EvaValue{.type = EvaValueType::OBJECT, .object = m_coroutine});
+                }
+                switchTo(coroutine, ip, bp);
+                // The result of the pending yield, the argument of a new coroutine
+                if (coroutine->state == CoroutineObject::State::SUSPENDED) {
+                    push(value);
+                }
+                coroutine->state = CoroutineObject::State::RUNNING;
+                code = co->code.data();
+                constants = co->constants.data();
+                if (exitFrame != nullptr) {
+                    return unwind(ip, bp);
+                }
+                break;
+            }
+            case OP_YIELD: {
+                auto value = pop();
+                // Nothing resumes a task
+                if (m_coroutine == nullptr || m_coroutine->task) {
+                    m_yielded = value;
+                    return suspend(ip, bp, Suspension::YIELD);
+                }
+                auto coroutine = m_coroutine;
+                coroutine->state = CoroutineObject::State::SUSPENDED;
+                switchTo(coroutine->resumer, ip, bp);
+                coroutine->resumer = nullptr;
+                push(value);
+                code = co->code.data();
+                constants = co->constants.data();
+                if (exitFrame != nullptr) {
+                    return unwind(ip, bp);
+                }
                 break;
             }
             default:
-                DIE << "VM: Unknown opcode " << std::hex << opcode;
+                DIE << "VM: Unknown opcode " << std::hex << int(opcode) << std::dec
+                    << location(instruction - code);
             }
         }
     }
 
-private:
     void printStack()
     {
         auto csp = sp - 1;
         std::cout << "---- STACK ----\n";
-        while (csp >= stack.begin()) {
+        while (csp >= m_stackBase) {
             std::cout << toString(*csp) << "\n";
             csp--;
         }
         std::cout << std::endl;
     }
-    uint8_t read_byte() {
-        auto ret = *ip;
-        ++ip;
-        return ret;
-    }
-
-    uint16_t read_address()
-    {
-        auto ret = (*ip << 8) | (*(ip + 1));
-        ip += 2;
-        return ret;
-    }
-
     void push(const EvaValue &v)
     {
-        if ((sp - stack.begin()) >= STACK_LIMIT) {
+        if ((sp - m_stackBase) >= STACK_LIMIT) {
             DIE << "Stack overflow";
         }
         *sp = v;
@@ -257,7 +1106,7 @@ private:
 
     EvaValue pop()
     {
-        if (sp - stack.begin() == 0) {
+        if (sp - m_stackBase == 0) {
             DIE << "VM pop: Empty stack";
         }
         sp--;
@@ -266,9 +1115,9 @@ private:
 
     void popN(size_t n)
     {
-        if (sp - stack.begin() < n) {
+        if (sp - m_stackBase < n) {
             DIE << "VM: stack too small, requested popN " << n << " but size is "
-                << sp - stack.begin();
+                << sp - m_stackBase;
         }
 
         sp -= n;
@@ -276,90 +1125,464 @@ private:
 
     EvaValue peek(size_t number)
     {
-        if (sp - stack.begin() == 0) {
+        if (sp - m_stackBase == 0) {
             DIE << "VM peek: Empty stack";
         }
         return *(sp - 1 - number);
     }
 
-    void maybeGC()
+    /*
+     * Runs `allocate`, which allocates for the instruction at `instruction`,
+     * and counts its objects in the allocation sites of the telemetry.
+     */
+    template<typename Allocation>
+    void trackAllocations(const uint8_t *instruction, const uint8_t *code, Allocation &&allocate)
     {
-        if (Traceable::bytesAllocated < GC_THRESHOLD)
+        auto &telemetry = m_collector->telemetry();
+        if (!telemetry.tracksAllocationSites()) {
+            allocate();
             return;
+        }
+        auto &site = telemetry.allocationSite({co->name, size_t(instruction - code)});
+        const auto objects = EvaHeap::allocatedObjectsTotal();
+        const auto bytes = EvaHeap::allocatedBytesTotal();
+        EvaHeap::setAllocationSite(site.id);
+        allocate();
+        EvaHeap::setAllocationSite(0);
+        site.objects += EvaHeap::allocatedObjectsTotal() - objects;
+        site.bytes += EvaHeap::allocatedBytesTotal() - bytes;
+    }
+
+    template<typename Function>
+    void callThroughTrampoline(CodeObject *code, Function &&function)
+    {
+        // Shared code is read by the other threads
+        auto &trampoline = code->frozen ? m_sharedTrampolines[code] : code->trampoline;
+        if (trampoline == nullptr) {
+            trampoline = reinterpret_cast<void *>(m_perfMap->trampoline(code->name));
+        }
+        reinterpret_cast<EvaPerfMap::Trampoline>(trampoline)(&function, [](void *function) {
+            (*static_cast<std::remove_reference_t<Function> *>(function))();
+        });
+    }
+
+    // The instruction at `ip` runs first when resuming
+    EvaValue suspend(const uint8_t *ip, EvaValue *bp, Suspension reason)
+    {
+        m_resumeIp = ip;
+        m_resumeBp = bp;
+        m_suspension = reason;
+        return BOOLEAN(false);
+    }
 
-        // Three sources of roots:
-        // 1. constant objects
-        // 2. the stack
-        // 3. globals
-        auto roots = getStackGCRoots();
+    /*
+     * Leaves a nested loop of the perf map after switching to another
+     * coroutine: the native stack follows the calls of the coroutine that
+     * was running. The outermost loop continues from `ip` and `bp`.
+     */
+    EvaValue unwind(const uint8_t *ip, EvaValue *bp)
+    {
+        m_resumeIp = ip;
+        m_resumeBp = bp;
+        m_unwinding = true;
+        return BOOLEAN(false);
+    }
 
-        // Add current code to roots, so it doesn't get deleted
-        roots.insert(co);
+    // Sets up the stacks of `coroutine` to call its function with `argument`
+    void startCoroutine(CoroutineObject *coroutine, EvaValue argument)
+    {
+        auto function = coroutine->function;
+        coroutine->stack.reset(new EvaValue[STACK_LIMIT]);
+        coroutine->frames.reset(new CallFrame[FRAMES_LIMIT]);
+        auto bp = coroutine->stack.get();
+        auto sp = bp;
+        *sp++ = EvaValue{.type = EvaValueType::OBJECT, .object = function};
+        if (function->co->arity == 1) {
+            *sp++ = argument;
+        }
+        coroutine->context = {
+            {.ip = function->co->code.data(),
+             .bp = bp,
+             .constants = function->co->constants.data(),
+             .co = function->co,
+             .fn = function},
+            sp,
+            coroutine->frames.get()};
+        coroutine->function = nullptr;
+    }
 
-        auto constants = m_compiler->getConstantObjects();
-        roots.insert(constants.begin(), constants.end());
+    /*
+     * Saves the registers of the running code and loads those of `target`,
+     * nullptr for the main program. `ip` and `bp`, locals of the
+     * interpreter loop, are swapped too.
+     */
+    void switchTo(CoroutineObject *target, const uint8_t *&ip, EvaValue *&bp)
+    {
+        ExecutionContext current{
+            {.ip = ip, .bp = bp, .constants = nullptr, .co = co, .fn = fn}, sp, fp};
+        if (m_coroutine != nullptr && m_coroutine->state == CoroutineObject::State::DONE) {
+            // Nothing runs on the stacks of a finished coroutine anymore
+            m_coroutine->stack.reset();
+            m_coroutine->frames.reset();
+            m_coroutine->context = {};
+        } else if (m_coroutine != nullptr) {
+            m_coroutine->context = current;
+            // The stacks were written without barrier while running
+            auto barrier = [this](Object *object) {
+                if (object != nullptr) {
+                    writeBarrier(m_coroutine, EvaValue{.type = EvaValueType::OBJECT, .object = object});
+                }
+            };
+            for (auto slot = m_coroutine->stack.get(); slot < sp; ++slot) {
+                writeBarrier(m_coroutine, *slot);
+            }
+            for (auto frame = m_coroutine->frames.get(); frame < fp; ++frame) {
+                barrier(frame->co);
+                barrier(frame->fn);
+            }
+            barrier(co);
+            barrier(fn);
+        } else {
+            m_main = current;
+        }
 
-        auto globals = getGlobalGCRoots();
-        roots.insert(globals.begin(), globals.end());
+        m_coroutine = target;
+        const auto &context = target != nullptr ? target->context : m_main;
+        m_stackBase = target != nullptr ? target->stack.get() : stack.begin();
+        m_framesBase = target != nullptr ? target->frames.get() : frames.begin();
+        ip = context.frame.ip;
+        bp = context.frame.bp;
+        co = context.frame.co;
+        fn = context.frame.fn;
+        sp = context.sp;
+        fp = context.fp;
+    }
 
-        m_collector->runGC(roots);
+    /*
+     * Switches to the first task of the ready queue, false when it is
+     * empty. A new task starts, a waiting one gets the result of the call
+     * it waits for.
+     */
+    bool wakeNext(const uint8_t *&ip, EvaValue *&bp)
+    {
+        if (m_ready.empty())
+            return false;
+        const auto wakeup = m_ready.front();
+        m_ready.pop_front();
+        auto target = wakeup.context;
+        const bool start = target != nullptr && target->state == CoroutineObject::State::CREATED;
+        if (start) {
+            startCoroutine(target, BOOLEAN(false));
+            target->state = CoroutineObject::State::RUNNING;
+        }
+        switchTo(target, ip, bp);
+        if (!start) {
+            push(wakeup.value);
+        }
+        return true;
     }
 
-    std::set<Traceable *> getStackGCRoots()
+    // Wakes the code waiting for `task`
+    void finishTask(CoroutineObject *task)
     {
-        std::set<Traceable *> ret;
-        auto spCopy = sp;
-        while (spCopy >= stack.begin()) {
-            if (isObject(*spCopy)) {
-                ret.insert(spCopy->asObject());
+        auto join = m_joins.begin();
+        while (join != m_joins.end()) {
+            if (join->task == task) {
+                complete(join->handle, task->result);
+                join = m_joins.erase(join);
+            } else {
+                ++join;
             }
-            spCopy--;
         }
-        return ret;
     }
 
-    std::set<Traceable *> getGlobalGCRoots()
+    // Writes the registers of the running coroutine to it, for the collector
+    void saveRunningCoroutine()
     {
-        std::set<Traceable *> ret;
+        if (m_coroutine != nullptr) {
+            m_coroutine->context.frame.co = co;
+            m_coroutine->context.frame.fn = fn;
+            m_coroutine->context.sp = sp;
+            m_coroutine->context.fp = fp;
+        }
+    }
 
-        for (const auto &g : m_globals->m_values) {
-            if (isObject(g.value)) {
-                ret.insert(g.value.asObject());
+    // " at <function>:<line>:<column>" of the instruction at `offset` of the current function
+    std::string location(size_t offset) const
+    {
+        const auto position = co->positions.at(offset);
+        if (position.line == 0) {
+            return " at " + co->name + "+" + std::to_string(offset);
+        }
+        return " at " + co->name + ":" + position.toString();
+    }
+
+    // `offset` is the next instruction of the current function
+    void sampleStack(size_t offset)
+    {
+        std::vector<EvaSampler::Frame> sample;
+        sample.reserve(fp - m_framesBase + 1);
+        for (auto frame = m_framesBase; frame < fp; ++frame) {
+            const auto offset = size_t(frame->ip - frame->co->code.data());
+            // The return address follows the call, the call has the line
+            sample.push_back({frame->co->name, offset, frame->co->positions.at(offset - 1).line});
+        }
+        sample.push_back({co->name, offset, co->positions.at(offset).line});
+        m_sampler->record(std::move(sample));
+    }
+
+    /*
+     * GC safepoint, called between two instructions when the heap asks for
+     * it: allocations only raise the request, so every allocation path,
+     * natives included, is covered. Every live object is then reachable
+     * from the roots of the VMs of the thread, and no object pointer is
+     * kept in C++ locals.
+     */
+    void maybeGC()
+    {
+        m_collector->safepoint([](auto &&visit, bool youngOnly) {
+            for (auto vm : s_thread.vms) {
+                vm->visitRoots(visit, youngOnly);
+            }
+        });
+    }
+
+    /*
+     * Roots for the collector:
+     * 1. the stacks and the call frames of the main program and of the
+     *    running coroutine, the other coroutines are objects
+     * 2. globals, only the remembered ones for a minor collection
+     * 3. objects created by the compiler, which are allocated in the old
+     *    space and don't need to be visited by a minor collection
+     */
+    template<typename Visitor>
+    void visitRoots(Visitor &&visit, bool youngOnly)
+    {
+        auto visitValue = [&visit](EvaValue &v) {
+            if (isObject(v)) {
+                Traceable *ref = v.object;
+                visit(ref);
+                v.object = static_cast<Object *>(ref);
+            }
+        };
+        auto visitRef = [&visit](auto *&object) {
+            Traceable *ref = object;
+            visit(ref);
+            object = static_cast<std::remove_reference_t<decltype(object)>>(ref);
+        };
+
+        const auto &main = m_coroutine ? m_main : ExecutionContext{{}, sp, fp};
+        for (auto slot = stack.begin(); slot < main.sp; ++slot) {
+            visitValue(*slot);
+        }
+        for (auto frame = frames.begin(); frame < main.fp; ++frame) {
+            visitRef(frame->co);
+            visitRef(frame->fn);
+        }
+        visitRef(co);
+        visitRef(fn);
+        // The stacks of the running coroutine are written without barrier,
+        // they are roots like those of the main program
+        if (m_coroutine) {
+            saveRunningCoroutine();
+            for (auto slot = m_stackBase; slot < sp; ++slot) {
+                visitValue(*slot);
+            }
+            for (auto frame = m_framesBase; frame < fp; ++frame) {
+                visitRef(frame->co);
+                visitRef(frame->fn);
+            }
+            visitRef(m_main.frame.co);
+            visitRef(m_main.frame.fn);
+            visitRef(m_coroutine);
+        }
+        // Tasks and coroutines out of the stacks, waiting for an operation
+        // or ready to run
+        for (auto &wakeup : m_ready) {
+            visitRef(wakeup.context);
+            visitValue(wakeup.value);
+        }
+        for (auto &[handle, context] : m_waiting) {
+            visitRef(context);
+        }
+        for (auto &join : m_joins) {
+            visitRef(join.task);
+        }
+        // The saved globals are not remembered, they are visited by every
+        // collection. Those of a snapshot are all frozen.
+        if (m_globals->m_saved && !m_globals->m_savedShared) {
+            for (auto &g : *m_globals->m_saved) {
+                visitValue(g.value);
             }
         }
 
-        return ret;
+        if (youngOnly) {
+            for (auto index : m_globals->m_rememberedSlots) {
+                visitValue((*m_globals->m_values)[index].value);
+            }
+            // Only a minor collection asks for young roots, after it no
+            // global points to the nursery anymore
+            m_globals->clearRememberedSlots();
+        } else {
+            // The globals of a snapshot are all frozen
+            if (!m_globals->shared()) {
+                for (auto &g : *m_globals->m_values) {
+                    visitValue(g.value);
+                }
+            }
+            m_compiler->visitObjects(visit);
+            for (auto &[program, compiled] : m_programs) {
+                visitRef(compiled.code);
+            }
+            if (m_profiler) {
+                m_profiler->visitObjects(visit);
+            }
+        }
     }
 
+    /*
+     * The VMs of a thread share its heap, so they share one collector: a
+     * collection in any of them keeps the objects of the others alive.
+     */
+    struct ThreadVMs
+    {
+        std::unique_ptr<EvaCollector> collector;
+        std::vector<EvaVM *> vms;
+    };
+    static inline thread_local ThreadVMs s_thread;
+
+    // Destroyed last, the objects of the VM may point to the shared code
+    std::shared_ptr<const EvaSharedCode> m_sharedCode;
     std::shared_ptr<Globals> m_globals;
     std::unique_ptr<syntax::eva_parser> parser;
     std::unique_ptr<EvaCompiler> m_compiler;
-    std::unique_ptr<EvaCollector> m_collector;
+    // Code of the programs run by exec(const Program &)
+    std::unordered_map<Program, CompiledProgram> m_programs;
+    EvaCollector *m_collector;
+    std::unique_ptr<EvaProfiler> m_profiler;
+    std::unique_ptr<EvaSampler> m_sampler;
+    EvaPerfMap *m_perfMap{nullptr};
+    // Trampolines of the shared code objects, for this VM
+    std::unordered_map<CodeObject *, void *> m_sharedTrampolines;
+
+    size_t m_fuel{0};
+    size_t m_fuelLeft{SIZE_MAX};
+    Suspension m_suspension{Suspension::NONE};
+    EvaValue m_yielded{};
+    bool m_unwinding{false};
+    // Where the suspended program continues, `co`, `fn`, the stack and the
+    // frames are left as they were
+    const uint8_t *m_resumeIp{nullptr};
+    EvaValue *m_resumeBp{nullptr};
 
     CodeObject *co = {nullptr};
-    const uint8_t *ip;
+    // Function currently executing, nullptr for the main code
+    FunctionObject *fn{nullptr};
 
     std::array<EvaValue, STACK_LIMIT> stack;
 
-    struct StackFrame
+    std::array<CallFrame, FRAMES_LIMIT> frames;
+    CallFrame *fp{frames.begin()};
+    EvaValue *sp{stack.begin()};
+
+    // Coroutine running, nullptr for the main program
+    CoroutineObject *m_coroutine{nullptr};
+    // Stacks in use, of the main program or of the running coroutine
+    EvaValue *m_stackBase{stack.begin()};
+    CallFrame *m_framesBase{frames.begin()};
+    // Registers of the main program while a coroutine runs
+    ExecutionContext m_main;
+
+    // A task or a coroutine, nullptr for the main program, ready to
+    // continue with the result of the call it waited for
+    struct Wakeup
+    {
+        CoroutineObject *context;
+        EvaValue value;
+    };
+    std::deque<Wakeup> m_ready;
+    // Waiting for an operation
+    std::unordered_map<PendingHandle, CoroutineObject *> m_waiting;
+    // Waiting for the end of a task
+    struct Join
     {
-        const uint8_t *ip;
-        EvaValue *bp;
-        CodeObject *co;
+        CoroutineObject *task;
+        PendingHandle handle;
     };
+    std::vector<Join> m_joins;
+    // Waiting for a message, by channel id, in order of arrival
+    std::unordered_map<size_t, std::deque<PendingHandle>> m_receivers;
+    PendingHandle m_nextPending{1};
+    // Set by pending() during the call of a native
+    bool m_callPending{false};
+    std::unique_ptr<EvaEventLoop> m_loop;
 
-    std::stack<StackFrame> frames;
-    EvaValue *sp{stack.begin()};
-    EvaValue *bp{sp};
+    // Writes `data` from `offset` as `fd` accepts it, the call waits for all of it
+    void writeWhenReady(int fd, std::shared_ptr<const std::string> data, size_t offset,
+                        PendingHandle handle)
+    {
+        eventLoop().whenWritable(fd, [this, fd, data, offset, handle] {
+            const auto n = ::write(fd, data->data() + offset, data->size() - offset);
+            if (n < 0 && errno != EAGAIN) {
+                // The result tells how much was written
+                complete(handle, NUMBER(double(offset)));
+                return;
+            }
+            const auto written = offset + std::max<ssize_t>(n, 0);
+            if (written < data->size()) {
+                writeWhenReady(fd, data, written, handle);
+            } else {
+                complete(handle, NUMBER(double(written)));
+            }
+        });
+    }
+
+    /*
+     * One watch of the channel per VM: the receivers of the VM get the
+     * messages in the order they asked, the channel watched again while
+     * some wait.
+     */
+    void receiveWhenReady(std::shared_ptr<EvaChannel> channel)
+    {
+        eventLoop().whenReadable(channel->eventFd(), [this, channel] {
+            channel->clearSignal();
+            auto &receivers = m_receivers[channel->id()];
+            while (!receivers.empty()) {
+                auto message = channel->tryReceive();
+                if (!message)
+                    break;
+                complete(receivers.front(), fromMessage(*message));
+                receivers.pop_front();
+            }
+            if (receivers.empty()) {
+                m_receivers.erase(channel->id());
+            } else {
+                receiveWhenReady(channel);
+            }
+        });
+    }
+
+    static std::shared_ptr<EvaChannel> findChannel(const EvaValue &id)
+    {
+        auto channel = EvaChannel::find(size_t(id.asNumber()));
+        if (!channel) {
+            DIE << "VM: no channel " << toString(id);
+        }
+        return channel;
+    }
+
+    // The event loop waits for the descriptors, reads and writes must not
+    static void setNonBlocking(int fd)
+    {
+        const int flags = fcntl(fd, F_GETFL);
+        if (flags < 0) {
+            DIE << "VM: bad file descriptor " << fd;
+        }
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
     void setGlobalVariables()
     {
         m_globals->addConst("PI", NUMBER(3.1415));
-        m_globals->addNativeFunction(
-            "square",
-            [&]() {
-                auto x = peek(0).asNumber();
-                push(NUMBER(x * x));
-            },
-            1);
+        registerNatives(builtinNatives());
     }
 };
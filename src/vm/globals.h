@@ -1,41 +1,79 @@
 #pragma once
 
 #include "evavalue.h"
+#include "logger.h"
 
 #include <algorithm>
+#include <memory>
 #include <optional>
 #include <string>
+#include <vector>
 
+/*
+ * The global variables of a VM, by index. A VM booted from shared code
+ * starts with the table of the snapshot, see EvaSharedCode, and copies it
+ * on the first write: until then its values are all frozen objects, which
+ * the collector never visits.
+ */
 class Globals
 {
 public:
+    struct Variable
+    {
+        std::string name;
+        EvaValue value;
+        bool remembered{false};
+    };
+    using Snapshot = std::shared_ptr<const std::vector<Variable>>;
+
+    Globals()
+        : m_values(std::make_shared<std::vector<Variable>>())
+    {}
+
+    explicit Globals(Snapshot snapshot)
+        : m_values(std::const_pointer_cast<std::vector<Variable>>(std::move(snapshot)))
+        , m_shared(true)
+    {
+        cacheTable();
+    }
+
+    // Still the table of a snapshot
+    bool shared() const { return m_shared; }
+
     EvaValue get(size_t index)
     {
-        if (index < m_values.size()) {
-            return m_values[index].value;
+        if (index < m_size) {
+            return m_data[index].value;
         }
         return {};
     }
 
     std::string nameForIndex(size_t index)
     {
-        if (index < m_values.size()) {
-            return m_values[index].name;
+        if (index < m_size) {
+            return m_data[index].name;
         }
         return "";
     }
 
     void set(size_t index, EvaValue v)
     {
-        if (index < m_values.size()) {
-            m_values[index].value = v;
+        if (index < m_size) {
+            values()[index].value = v;
+            rememberIfYoung(index);
         }
     }
 
+    NativeFunction *getNativeFunction(const std::string &name)
+    {
+        auto it = find(name);
+        return it != m_values->end() ? it->value.asNativeFunction() : nullptr;
+    }
+
     std::optional<size_t> getGlobalIndex(const std::string &name)
     {
-        for (int i = 0; i < m_values.size(); ++i) {
-            if (m_values[i].name == name)
+        for (size_t i = 0; i < m_size; ++i) {
+            if (m_data[i].name == name)
                 return i;
         }
         return {};
@@ -43,40 +81,123 @@ public:
     std::optional<size_t> define(const std::string &name)
     {
         if (!exists(name)) {
-            m_values.push_back({name, NUMBER(0)});
-            return m_values.size() - 1;
+            values().push_back({name, NUMBER(0)});
+            cacheTable();
+            return m_size - 1;
         }
         return {};
     }
 
-    bool exists(const std::string &name) { return find(name) != m_values.end(); }
+    bool exists(const std::string &name) { return find(name) != m_values->end(); }
 
     void addConst(const std::string &name, EvaValue v)
     {
         if (exists(name))
             return;
-        m_values.push_back({name, v});
+        values().push_back({name, v});
+        cacheTable();
+        rememberIfYoung(m_size - 1);
     }
 
-    void addNativeFunction(const std::string &name, std::function<void()> fn, int arity)
+    // Code compiled against the global may already call it: no rebinding
+    void addNativeFunction(const std::string &name, NativeFn fn, int arity)
     {
-        if (exists(name))
+        if (exists(name)) {
+            DIE << "Globals: cannot register the native " << name << ", the global exists";
+        }
+        values().push_back({name, allocNative(fn, name, arity)});
+        cacheTable();
+        rememberIfYoung(m_size - 1);
+    }
+
+    /*
+     * Keeps the table as it is now for restore(), which drops the globals
+     * defined and the values set since. The table of a snapshot is kept as
+     * is, another table is copied: its values are roots, see
+     * EvaVM::visitRoots().
+     */
+    void save()
+    {
+        m_savedShared = m_shared;
+        m_saved = m_shared ? m_values : std::make_shared<std::vector<Variable>>(*m_values);
+    }
+
+    void restore()
+    {
+        if (!m_saved) {
+            DIE << "Globals: no saved table to restore";
+        }
+        m_rememberedSlots.clear();
+        if (m_savedShared) {
+            m_values = m_saved;
+            m_shared = true;
+            cacheTable();
             return;
-        m_values.push_back({name, allocNative(fn, name, arity)});
+        }
+        values() = *m_saved;
+        cacheTable();
+        for (size_t i = 0; i < m_size; ++i) {
+            m_data[i].remembered = false;
+            rememberIfYoung(i);
+        }
     }
 
-    struct Variable
+    /*
+     * Write barrier of the globals table: the minor collection only visits
+     * the globals that got a young object since the previous collection.
+     */
+    void rememberIfYoung(size_t index)
     {
-        std::string name;
-        EvaValue value;
-    };
+        auto &variable = m_data[index];
+        if (!variable.remembered && isObject(variable.value)
+            && EvaHeap::isYoung(variable.value.asObject())) {
+            variable.remembered = true;
+            m_rememberedSlots.push_back(index);
+        }
+    }
 
-    std::vector<Variable>::iterator find(const std::string &name)
+    void clearRememberedSlots()
     {
-        return std::find_if(m_values.begin(), m_values.end(), [&name](const Variable &v) {
+        for (auto index : m_rememberedSlots) {
+            m_data[index].remembered = false;
+        }
+        m_rememberedSlots.clear();
+    }
+
+    std::vector<Variable>::const_iterator find(const std::string &name) const
+    {
+        return std::find_if(m_values->begin(), m_values->end(), [&name](const Variable &v) {
             return v.name == name;
         });
     }
 
-    std::vector<Variable> m_values;
+    // For writing: copies the table of a snapshot first
+    std::vector<Variable> &values()
+    {
+        if (m_shared) {
+            m_values = std::make_shared<std::vector<Variable>>(*m_values);
+            m_shared = false;
+            cacheTable();
+        }
+        return *m_values;
+    }
+
+    // After the table is replaced or grows
+    void cacheTable()
+    {
+        m_data = m_values->data();
+        m_size = m_values->size();
+    }
+
+    // Read only while shared()
+    std::shared_ptr<std::vector<Variable>> m_values;
+    bool m_shared{false};
+    // Of m_values, read by the VM at every global access
+    Variable *m_data{nullptr};
+    size_t m_size{0};
+    // Globals that may point to young objects
+    std::vector<size_t> m_rememberedSlots;
+    // Kept by save(), the table of a snapshot when m_savedShared
+    std::shared_ptr<std::vector<Variable>> m_saved;
+    bool m_savedShared{false};
 };
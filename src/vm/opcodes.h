@@ -25,6 +25,16 @@ constexpr uint8_t OP_GET_LOCAL = 0x0D;
 constexpr uint8_t OP_SCOPE_EXIT = 0x10;
 constexpr uint8_t OP_CALL = 0x11;
 constexpr uint8_t OP_RETURN = 0x12;
+constexpr uint8_t OP_MAKE_CELL = 0x13;
+constexpr uint8_t OP_GET_CELL = 0x14;
+constexpr uint8_t OP_SET_CELL = 0x15;
+constexpr uint8_t OP_GET_UPVALUE = 0x16;
+constexpr uint8_t OP_SET_UPVALUE = 0x17;
+constexpr uint8_t OP_CLOSURE = 0x18;
+constexpr uint8_t OP_RESUME = 0x19;
+constexpr uint8_t OP_YIELD = 0x1A;
+// <global> <constant> <address>: jumps unless the global holds the constant
+constexpr uint8_t OP_GUARD_GLOBAL = 0x1B;
 
 enum class ComparisonType : uint8_t {
     GT,
@@ -35,6 +45,30 @@ enum class ComparisonType : uint8_t {
     NEQ,
 };
 
+// Bytes of the operands following `opcode` in the code
+inline size_t operandBytes(uint8_t opcode)
+{
+    switch (opcode) {
+    case OP_HALT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_POP:
+    case OP_RETURN:
+    case OP_RESUME:
+    case OP_YIELD:
+        return 0;
+    case OP_JMP:
+    case OP_JMP_IF_FALSE:
+        return 2;
+    case OP_GUARD_GLOBAL:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
 inline std::string opcodeToString(uint8_t opcode)
 {
     switch (opcode) {
@@ -55,6 +89,15 @@ inline std::string opcodeToString(uint8_t opcode)
         CASE_STR(SCOPE_EXIT);
         CASE_STR(CALL);
         CASE_STR(RETURN);
+        CASE_STR(MAKE_CELL);
+        CASE_STR(GET_CELL);
+        CASE_STR(SET_CELL);
+        CASE_STR(GET_UPVALUE);
+        CASE_STR(SET_UPVALUE);
+        CASE_STR(CLOSURE);
+        CASE_STR(RESUME);
+        CASE_STR(YIELD);
+        CASE_STR(GUARD_GLOBAL);
     }
     DIE << "Unhandled opcodeToString " << std::hex << int(opcode);
     return "";
@@ -1,5 +1,17 @@
+#include "eva_executor.h"
+#include "eva_image.h"
+#include "eva_isolate.h"
+#include "eva_parallel.h"
 #include "evavm.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <sys/socket.h>
+#include <thread>
+
 #define CHECK_NUMBER(evaVal, expected) \
 do { \
   if (evaVal.asNumber() != expected) { \
@@ -33,7 +45,16 @@ do { \
 
 int main()
 {
-    EvaVM vm;
+    // A small nursery moves objects to the old space many times during the tests
+    EvaHeap::setNurserySize(4096);
+    // and a small heap runs the full collection often
+    GCOptions smallHeap;
+    smallHeap.minHeap = 512;
+    // The VMs of a thread share its collector: the next tests get one of
+    // their own once this VM is gone
+    std::optional<EvaVM> suiteVM(std::in_place);
+    auto &vm = *suiteVM;
+    vm.collector().setOptions(smallHeap);
     CHECK_NUMBER(vm.exec({OP_CONST, 0, OP_CONST, 1, OP_ADD, OP_HALT}, {NUMBER(10), NUMBER(3.5)}),
                  13.5);
     CHECK_NUMBER(vm.exec({OP_CONST, 0, OP_CONST, 1, OP_SUB, OP_HALT}, {NUMBER(10), NUMBER(3)}), 7);
@@ -183,6 +204,19 @@ int main()
     )#"),
                  64);
 
+    vm.registerNatives({
+        {"max2",
+         [](EvaVM &, const EvaValue *args, size_t) {
+             return NUMBER(std::max(args[0].asNumber(), args[1].asNumber()));
+         },
+         2},
+        {"zero", [](EvaVM &, const EvaValue *, size_t) { return NUMBER(0); }, 0},
+    });
+    CHECK_NUMBER(vm.exec(R"#(
+    (+ (max2 3 (square 2)) (zero))
+    )#"),
+                 4);
+
     CHECK_NUMBER(vm.exec(R"#(
     (def foo (a b)
         (begin
@@ -203,6 +237,16 @@ int main()
     )#"),
                  120);
 
+    CHECK_NUMBER(vm.exec(R"#(
+    (def sumTo (n)
+        (if (= n 0)
+            0
+            (+ n (sumTo (- n 1)))
+        ))
+    (+ (sumTo 20) (sumTo 3))
+    )#"),
+                 216);
+
     CHECK_NUMBER(vm.exec(R"#(
     (def innerFunction (x)
         (begin
@@ -214,6 +258,1068 @@ int main()
     )#"),
                  20);
 
+    // Blocks used as values keep their locals above the temporaries
+    CHECK_NUMBER(vm.exec(R"#(
+    (+ 1 (begin (var x 5) (* x 2)))
+    )#"),
+                 11);
+
+    // Inlining
+    {
+        auto hasNumericConstant = [](CodeObject *co, double value) {
+            return std::any_of(co->constants.begin(), co->constants.end(), [value](auto c) {
+                return isNumber(c) && c.asNumber() == value;
+            });
+        };
+        const auto program = R"#(
+        (begin
+            (def sum (a b) (+ a b))
+            (sum 2 3)
+        )
+        )#";
+        syntax::eva_parser p;
+        auto g = std::make_shared<Globals>();
+        EvaCompiler c(g);
+        // Literal arguments are substituted and the body is folded
+        CHECK_BOOL(BOOLEAN(hasNumericConstant(c.compile(p.parse(program), "main"), 5)), true);
+
+        auto noInlineGlobals = std::make_shared<Globals>();
+        EvaCompiler noInline(noInlineGlobals);
+        noInline.setInlineBudget(0);
+        CHECK_BOOL(BOOLEAN(hasNumericConstant(noInline.compile(p.parse(program), "main"), 5)),
+                   false);
+    }
+
+    CHECK_NUMBER(vm.exec(R"#(
+    (def add3 (a b c) (+ a (+ b c)))
+    (def twice (x) (begin (var y (* x 2)) y))
+    (def caller (x) (+ x (add3 x 1 (twice x))))
+    (+ (caller 4) (add3 1 (square 3) (twice 2)))
+    )#"),
+                 31);
+
+    // Assigned functions are called, not inlined
+    CHECK_NUMBER(vm.exec(R"#(
+    (def one () 1)
+    (def two () 2)
+    (set one two)
+    (one)
+    )#"),
+                 2);
+
+    // Inlined bodies outlive their program, the next ones can rebind the
+    // callee: the calls then go to the new function
+    CHECK_NUMBER(vm.exec(R"#(
+    (def rebound (a b) (+ a b))
+    (def callsRebound (x) (rebound x 1))
+    (callsRebound 3)
+    )#"),
+                 4);
+    CHECK_NUMBER(vm.exec(R"#(
+    (def rebound (a b) (* a b))
+    (callsRebound 3)
+    )#"),
+                 3);
+
+    // A while loop drops the value of its body at every iteration, its
+    // own value is false. The code after the loop runs from its first
+    // instruction.
+    CHECK_BOOL(vm.exec("(while false 1)"), false);
+    CHECK_NUMBER(vm.exec(R"#(
+    (begin
+        (var i 0)
+        (var loop (while (< i 3) (set i (+ i 1))))
+        (if loop 0 (+ i 10))
+    )
+    )#"),
+                 13);
+
+    CHECK_NUMBER(vm.exec(R"#(
+    (def loopSum (n)
+        (begin
+            (var total 0)
+            (while (> n 0)
+                (begin
+                    (set total (+ total n))
+                    (set n (- n 1))
+                ))
+            (var result total)
+            result
+        ))
+    (loopSum 10000)
+    )#"),
+                 50005000);
+
+    // Closures
+    CHECK_NUMBER(vm.exec(R"#(
+    (def makeCounter ()
+        (begin
+            (var count 0)
+            (def inc ()
+                (begin
+                    (set count (+ count 1))
+                    count
+                ))
+            inc
+        ))
+    (var counter (makeCounter))
+    (counter)
+    (counter)
+    )#"),
+                 2);
+
+    CHECK_NUMBER(vm.exec(R"#(
+    (def outer (x)
+        (begin
+            (def middle ()
+                (begin
+                    (def inner () x)
+                    (inner)
+                ))
+            (middle)
+        ))
+    (outer 7)
+    )#"),
+                 7);
+
+    CHECK_NUMBER(vm.exec(R"#(
+    (def adder (a)
+        (begin
+            (var unused 100)
+            (def add (b) (+ a b))
+            add
+        ))
+    (var add5 (adder 5))
+    (var add10 (adder 10))
+    (+ (add5 1) (add10 1))
+    )#"),
+                 17);
+
+    // Closures and strings surviving many minor collections
+    {
+        std::string expected;
+        for (int i = 0; i < 300; ++i) {
+            expected += "ab";
+        }
+        CHECK_STRING(vm.exec(R"#(
+        (def makeAcc ()
+            (begin
+                (var acc "")
+                (def add (x)
+                    (begin
+                        (set acc (+ acc x))
+                        acc
+                    ))
+                add
+            ))
+        (var append (makeAcc))
+        (var n 0)
+        (while (< n 300)
+            (begin
+                (append (+ "a" "b"))
+                (set n (+ n 1))
+            ))
+        (append "")
+        )#"),
+                     expected);
+    }
+    suiteVM.reset();
+
+    {
+        // Incremental collection in small slices while the program links
+        // closures together, so that the marking interleaves with writes.
+        // Then the same with the sweep on a helper thread, with parallel
+        // marking and with a compaction at every full collection.
+        GCOptions compacting;
+        compacting.compaction = true;
+        compacting.fragmentationLimit = 0;
+        auto incrementalCompacting = compacting;
+        incrementalCompacting.incremental = true;
+        incrementalCompacting.sliceBudget = 8;
+        for (auto options : {GCOptions{true, 8},
+                             GCOptions{false, 0, true},
+                             GCOptions{true, 8, true},
+                             GCOptions{false, 0, false, 4},
+                             GCOptions{true, 8, true, 4},
+                             compacting,
+                             incrementalCompacting}) {
+            EvaVM gcVM;
+            options.minHeap = 512;
+            gcVM.collector().setOptions(options);
+            CHECK_NUMBER(gcVM.exec(R"#(
+            (def cons (head tail)
+                (begin
+                    (def get (i) (if (= i 0) head tail))
+                    get
+                ))
+            (var list 0)
+            (var n 0)
+            (while (< n 500)
+                (begin
+                    (set list (cons n list))
+                    (var garbage (+ "a" "b"))
+                    (set n (+ n 1))
+                ))
+            (var total 0)
+            (while (> n 0)
+                (begin
+                    (set total (+ total (list 0)))
+                    (set list (list 1))
+                    (set n (- n 1))
+                ))
+            total
+            )#"),
+                         124750);
+        }
+    }
+
+    {
+        // Telemetry: one JSON line per collection, and the allocations
+        // counted by instruction
+        EvaVM telemetryVM;
+        telemetryVM.collector().setOptions(smallHeap);
+        // Keep `join` a function of its own
+        telemetryVM.setInlineBudget(0);
+        auto &telemetry = telemetryVM.collector().telemetry();
+        std::ostringstream sink;
+        telemetry.setSink(&sink);
+        telemetry.setTrackAllocationSites(true);
+        CHECK_NUMBER(telemetryVM.exec(R"#(
+        (def join (a b) (+ a b))
+        (var s "")
+        (var n 0)
+        (while (< n 300)
+            (begin
+                (set s (join "a" "b"))
+                (set n (+ n 1))
+            ))
+        n
+        )#"),
+                     300);
+        const auto counters = telemetry.counters();
+        CHECK_BOOL(BOOLEAN(counters.minorCollections > 0), true);
+        CHECK_BOOL(BOOLEAN(counters.fullCollections > 0), true);
+        CHECK_BOOL(BOOLEAN(counters.freedObjects > 0), true);
+        CHECK_CPPNUMBER(telemetry.records().size(),
+                        counters.minorCollections + counters.fullCollections);
+        const auto json = sink.str();
+        CHECK_CPPNUMBER(size_t(std::count(json.begin(), json.end(), '\n')),
+                        telemetry.records().size());
+        CHECK_CPPNUMBER(json.rfind("{\"kind\":", 0), 0);
+        // The string concatenation in `join` is the only allocation site
+        CHECK_CPPNUMBER(telemetry.allocationSites().size(), 1);
+        const auto &[site, stats] = *telemetry.allocationSites().begin();
+        CHECK_BOOL(BOOLEAN(site.function == "join"), true);
+        CHECK_CPPNUMBER(stats.objects, 300);
+
+        // The heap snapshot reads back with the roots and allocation sites
+        std::stringstream image;
+        telemetryVM.writeHeapSnapshot(image);
+        const auto snapshot = HeapSnapshot::read(image);
+        CHECK_CPPNUMBER(snapshot.nodes.size(), HeapSnapshot::heapObjects().size());
+        CHECK_CPPNUMBER(snapshot.sites.size(), 1);
+        auto global = std::find_if(snapshot.roots.begin(), snapshot.roots.end(),
+                                   [](const auto &root) { return root.label == "global s"; });
+        CHECK_BOOL(BOOLEAN(global != snapshot.roots.end()), true);
+        const auto &node = snapshot.nodes[global->node];
+        CHECK_BOOL(BOOLEAN(node.type == ObjectType::STRING && node.label == "ab"), true);
+        CHECK_BOOL(BOOLEAN(snapshot.sites[node.site - 1].function == "join"), true);
+    }
+
+    {
+        // The profiler counts every instruction, across calls and collections
+        EvaVM profiledVM;
+        profiledVM.collector().setOptions(smallHeap);
+        profiledVM.setInlineBudget(0);
+        profiledVM.setProfiling(true);
+        CHECK_NUMBER(profiledVM.exec(R"#(
+        (def join (a b) (+ a b))
+        (var s "")
+        (var n 0)
+        (while (< n 300)
+            (begin
+                (set s (join "a" "b"))
+                (set n (+ n 1))
+            ))
+        n
+        )#"),
+                     300);
+        auto profiler = profiledVM.profiler();
+        CHECK_CPPNUMBER(profiler->opcode(OP_ADD).count, 600);
+        CHECK_CPPNUMBER(profiler->opcode(OP_CALL).count, 300);
+        CHECK_CPPNUMBER(profiler->opcode(OP_RETURN).count, 300);
+        CHECK_CPPNUMBER(profiler->opcode(OP_HALT).count, 1);
+        CHECK_CPPNUMBER(profiler->pair(OP_CALL, OP_GET_LOCAL).count, 300);
+        CHECK_BOOL(BOOLEAN(profiler->totalTicks() > 0), true);
+        std::ostringstream report;
+        profiledVM.printProfile(report);
+        CHECK_BOOL(BOOLEAN(report.str().find("Opcodes for join") != std::string::npos), true);
+    }
+
+    {
+        // The sampler records the Eva stacks, inner functions included
+        EvaVM sampledVM;
+        sampledVM.setInlineBudget(0);
+        sampledVM.startSampling(std::chrono::microseconds(100));
+        CHECK_NUMBER(sampledVM.exec(R"#(
+        (def inc (x) (+ x 1))
+        (var n 0)
+        (while (< n 200000)
+            (set n (inc n)))
+        n
+        )#"),
+                     200000);
+        sampledVM.stopSampling();
+        auto sampler = sampledVM.sampler();
+        CHECK_BOOL(BOOLEAN(sampler->samples() > 0), true);
+        size_t samples = 0;
+        for (const auto &[stack, count] : sampler->stacks()) {
+            CHECK_BOOL(BOOLEAN(stack.front().function == "main"), true);
+            samples += count;
+        }
+        CHECK_CPPNUMBER(samples, sampler->samples());
+        std::ostringstream folded;
+        sampler->writeFolded(folded);
+        CHECK_BOOL(BOOLEAN(folded.str().rfind("main", 0) == 0), true);
+    }
+
+    {
+        // A program out of fuel is suspended, and resumes where it stopped
+        const auto program = R"#(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))
+            ))
+        (var i 0)
+        (var sum 0)
+        (while (< i 50)
+            (begin
+                (set sum (+ sum (fib 8)))
+                (set i (+ i 1))
+            ))
+        sum
+        )#";
+        for (bool perfMap : {false, true}) {
+            if (perfMap && !EvaPerfMap::supported())
+                continue;
+            EvaVM slicedVM;
+            slicedVM.collector().setOptions(smallHeap);
+            slicedVM.setInlineBudget(0);
+            slicedVM.setPerfMap(perfMap);
+            slicedVM.setFuel(100);
+            auto result = slicedVM.exec(program);
+            size_t slices = 1;
+            while (slicedVM.suspended()) {
+                result = slicedVM.resume();
+                slices++;
+            }
+            CHECK_NUMBER(result, 50 * 21);
+            // 67 calls of fib per iteration
+            CHECK_BOOL(BOOLEAN(slices > 50 * 67 / 100), true);
+        }
+
+        // With one unit, every slice goes through one backward jump
+        EvaVM starvedVM;
+        starvedVM.setFuel(1);
+        auto result = starvedVM.exec(R"#(
+        (var i 0)
+        (while (< i 3) (set i (+ i 1)))
+        i
+        )#");
+        size_t slices = 1;
+        while (starvedVM.suspended() && slices < 100) {
+            result = starvedVM.resume();
+            slices++;
+        }
+        CHECK_NUMBER(result, 3);
+        CHECK_CPPNUMBER(slices, 3);
+    }
+
+    {
+        // Coroutines
+        EvaVM coroutineVM;
+        coroutineVM.collector().setOptions(smallHeap);
+        CHECK_NUMBER(coroutineVM.exec(R"#(
+        (def counter (start)
+            (begin
+                (var i start)
+                (while true
+                    (begin
+                        (yield i)
+                        (set i (+ i 1))
+                    ))
+            ))
+        (var gen (coroutine counter))
+        (var a (resume gen 10))
+        (var b (resume gen))
+        (+ a (* b 100))
+        )#"),
+                     1110);
+
+        // Yields from nested calls, values in both directions, coroutines
+        // resuming coroutines
+        CHECK_NUMBER(coroutineVM.exec(R"#(
+        (def wait (x) (yield x))
+        (def worker (first)
+            (begin
+                (var second (wait (* first 2)))
+                (+ second 1)
+            ))
+        (def outer ()
+            (begin
+                (var w (coroutine worker))
+                (var r1 (resume w 5))
+                (yield r1)
+                (var r2 (resume w 100))
+                (if (finished w) r2 0)
+            ))
+        (var o (coroutine outer))
+        (var x (resume o))
+        (var y (resume o))
+        (+ (* x 1000) (if (finished o) y 0))
+        )#"),
+                     10101);
+    }
+
+    {
+        // An old coroutine resumed by a young one, which the collections
+        // during the resume move out of the nursery
+        EvaVM resumerVM;
+        CHECK_NUMBER(resumerVM.exec(R"#(
+        (def fb (x)
+            (begin
+                (var i 0)
+                (while (< i 3000)
+                    (begin
+                        (var g (+ "a" "b"))
+                        (set i (+ i 1))
+                    ))
+                (yield 42)
+            ))
+        (var b (coroutine fb))
+        (var j 0)
+        (while (< j 3000)
+            (begin
+                (var g (+ "a" "b"))
+                (set j (+ j 1))
+            ))
+        (def fa (x) (+ 1 (resume b 0)))
+        (var a (coroutine fa))
+        (resume a 0)
+        )#"),
+                     43);
+    }
+
+    {
+        // Out of any coroutine, yield suspends the script for the host
+        EvaVM hostVM;
+        auto yielded = hostVM.exec(R"#(
+        (var request (+ 5 2))
+        (var reply (yield request))
+        (* reply 2)
+        )#");
+        CHECK_BOOL(BOOLEAN(hostVM.suspension() == EvaVM::Suspension::YIELD), true);
+        CHECK_NUMBER(yielded, 7);
+        CHECK_NUMBER(hostVM.resume(NUMBER(21)), 42);
+        CHECK_BOOL(BOOLEAN(hostVM.suspended()), false);
+    }
+
+    {
+        // Many coroutines alive across collections, with the perf map and
+        // with fuel suspending them anywhere
+        const auto program = R"#(
+        (def gen (k)
+            (begin
+                (var i 0)
+                (while true
+                    (begin
+                        (var garbage (+ "a" "b"))
+                        (yield (+ k i))
+                        (set i (+ i 1))
+                    ))
+            ))
+        (var prev (coroutine gen))
+        (resume prev 0)
+        (var n 0)
+        (var sum 0)
+        (while (< n 500)
+            (begin
+                (var c (coroutine gen))
+                (resume c n)
+                (set sum (+ sum (resume prev)))
+                (set prev c)
+                (set n (+ n 1))
+            ))
+        sum
+        )#";
+        GCOptions incremental;
+        incremental.incremental = true;
+        incremental.sliceBudget = 8;
+        incremental.compaction = true;
+        incremental.fragmentationLimit = 0;
+        incremental.minHeap = 512;
+        for (bool perfMap : {false, true}) {
+            if (perfMap && !EvaPerfMap::supported())
+                continue;
+            for (size_t fuel : {0, 7}) {
+                for (const auto &options : {smallHeap, incremental}) {
+                    EvaVM coroutineVM;
+                    coroutineVM.collector().setOptions(options);
+                    coroutineVM.setPerfMap(perfMap);
+                    coroutineVM.setFuel(fuel);
+                    auto result = coroutineVM.exec(program);
+                    while (coroutineVM.suspended()) {
+                        result = coroutineVM.resume();
+                    }
+                    CHECK_NUMBER(result, 1 + 499 * 500 / 2);
+                }
+            }
+        }
+    }
+
+    {
+        // One-shot callbacks on descriptors and timers, timers by deadline
+        EvaEventLoop loop;
+        int pair[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        std::string order;
+        loop.after(std::chrono::milliseconds(20), [&] { order += "late "; });
+        loop.after(std::chrono::milliseconds(1), [&] { order += "early "; });
+        loop.whenReadable(pair[1], [&] {
+            char buffer[8];
+            order += std::string(buffer, read(pair[1], buffer, sizeof(buffer))) + " ";
+        });
+        loop.whenWritable(pair[0], [&] { order += "writable "; });
+        CHECK_CPPNUMBER(loop.runOnce(), 1);
+        CHECK_CPPNUMBER(write(pair[0], "ping", 4), 4);
+        loop.run();
+        CHECK_STRING(allocString(order), "writable ping early late ");
+        CHECK_CPPNUMBER(loop.runOnce(), 0);
+        close(pair[0]);
+        close(pair[1]);
+    }
+
+    {
+        // Tasks waiting for sockets: the echo task answers the main program
+        EvaVM asyncVM;
+        asyncVM.collector().setOptions(smallHeap);
+        int pair[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        const auto fds = "(var client " + std::to_string(pair[0]) + ")(var server "
+                         + std::to_string(pair[1]) + ")";
+        CHECK_STRING(asyncVM.exec(fds + R"#(
+        (def echo ()
+            (begin
+                (var request (read server))
+                (write server (+ request " pong"))
+                (close server)
+            ))
+        (var task (spawn echo))
+        (write client "ping")
+        (var reply (read client))
+        (await task)
+        (+ reply (read client))
+        )#"),
+                     "ping pong");
+        close(pair[0]);
+
+        // Tasks overlap their waits, and a parked coroutine waits too
+        const auto start = std::chrono::steady_clock::now();
+        CHECK_NUMBER(asyncVM.exec(R"#(
+        (def nap () (begin (sleep 100) 1))
+        (def napThenYield (x) (begin (sleep 100) (yield (+ x 1))))
+        (var a (spawn nap))
+        (var b (spawn nap))
+        (var c (spawn nap))
+        (var gen (coroutine napThenYield))
+        (var fromGen (resume gen 10))
+        (+ fromGen (+ (await a) (+ (await b) (await c))))
+        )#"),
+                     14);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        CHECK_BOOL(BOOLEAN(elapsed < std::chrono::milliseconds(300)), true);
+
+        // The event loop also runs under fuel and with the perf map, and
+        // collections move the waiting tasks
+        for (bool perfMap : {false, true}) {
+            if (perfMap && !EvaPerfMap::supported())
+                continue;
+            for (size_t fuel : {0, 3}) {
+                asyncVM.setPerfMap(perfMap);
+                asyncVM.setFuel(fuel);
+                auto result = asyncVM.exec(R"#(
+                (def worker ()
+                    (begin
+                        (var i 0)
+                        (var s "")
+                        (while (< i 20)
+                            (begin
+                                (sleep 0)
+                                (set s (+ s "x"))
+                                (set i (+ i 1))
+                            ))
+                        s
+                    ))
+                (var t1 (spawn worker))
+                (var t2 (spawn worker))
+                (+ (await t1) (await t2))
+                )#");
+                while (asyncVM.suspended()) {
+                    result = asyncVM.resume();
+                }
+                CHECK_STRING(result, std::string(40, 'x'));
+            }
+        }
+    }
+
+    {
+        // Scripts on a pool of VMs: a prepared program runs on every worker,
+        // the producer waits for room in the queues
+        EvaExecutor::Options options;
+        options.threads = 4;
+        options.queueLimit = 3;
+        options.slice = 1000;
+        options.gc = smallHeap;
+        EvaExecutor executor(options);
+        const auto fib = EvaVM::parse(R"#(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))
+            ))
+        (fib 15)
+        )#");
+        std::vector<EvaExecutor::Ticket> tickets;
+        for (int i = 0; i < 20; ++i) {
+            tickets.push_back(executor.submit(fib));
+        }
+        auto text = executor.submit(R"#((+ "eva" "vm"))#");
+        // Cancelled before it starts or at its next slice
+        auto endless = executor.submit("(while true 0)");
+        endless.cancel();
+        for (auto &ticket : tickets) {
+            const auto result = ticket.result.get();
+            CHECK_BOOL(BOOLEAN(result.status == EvaExecutor::Result::Status::DONE), true);
+            CHECK_CPPNUMBER(std::get<double>(result.value), 610);
+        }
+        CHECK_STRING(allocString(std::get<std::string>(text.result.get().value)), "evavm");
+        CHECK_BOOL(
+            BOOLEAN(endless.result.get().status == EvaExecutor::Result::Status::CANCELLED), true);
+    }
+
+    {
+        // Every job starts with the globals of the worker once set up, the
+        // programs run again keep their code
+        EvaExecutor::Options options;
+        options.threads = 1;
+        EvaExecutor executor(options);
+        auto number = [&executor](const auto &program) {
+            return std::get<double>(executor.submit(program).result.get().value);
+        };
+        const auto defineX = EvaVM::parse("(var x 1) x");
+        CHECK_CPPNUMBER(number(defineX), 1);
+        CHECK_CPPNUMBER(number("(var x 2) x"), 2);
+        CHECK_CPPNUMBER(number("(var y 3) y"), 3);
+        CHECK_CPPNUMBER(number(defineX), 1);
+        // More jobs than global indexes
+        for (int i = 0; i < 300; ++i) {
+            const auto name = "g" + std::to_string(i);
+            CHECK_CPPNUMBER(number("(var " + name + " " + std::to_string(i) + ") " + name), i);
+        }
+    }
+
+    {
+        // VMs booted on shared code: the modules are compiled once, the
+        // globals table is copied on the first write
+        const auto prelude = EvaVM::compileShared({R"#(
+        (var greeting "hello")
+        (def twice (x) (* x 2))
+        (def adder (n)
+            (begin
+                (def add (x) (+ x n))
+                add
+            ))
+        (def greet (name) (+ greeting name))
+        (def quadruple (x) (twice (twice x)))
+        )#"});
+        EvaVM first(prelude);
+        EvaVM second(prelude);
+        first.setPrintListing(false);
+        second.setPrintListing(false);
+        first.collector().setOptions(smallHeap);
+        CHECK_NUMBER(first.exec("(twice 21)"), 42);
+        CHECK_BOOL(BOOLEAN(first.globals().shared()), true);
+        const auto twice = first.globals().getGlobalIndex("twice").value();
+        CHECK_BOOL(BOOLEAN(first.globals().get(twice).object == second.globals().get(twice).object),
+                   true);
+        // The closures of the shared functions are in the heap of the VM,
+        // collected as it runs
+        CHECK_NUMBER(first.exec(R"#(
+        (var i 0)
+        (var total 0)
+        (while (< i 300)
+            (begin
+                (var add (adder i))
+                (set total (+ total (add 1)))
+                (set i (+ i 1))
+            ))
+        total
+        )#"),
+                     45150);
+        CHECK_BOOL(BOOLEAN(first.globals().shared()), false);
+        // The shared code inlines twice, each VM can rebind it
+        CHECK_NUMBER(first.exec("(def twice (x) (+ x 1)) (quadruple 1)"), 3);
+        CHECK_NUMBER(second.exec("(quadruple 1)"), 4);
+        CHECK_STRING(second.exec(R"#((greet " eva"))#"), "hello eva");
+        CHECK_BOOL(BOOLEAN(second.globals().shared()), true);
+
+        EvaExecutor::Options options;
+        options.threads = 2;
+        options.code = prelude;
+        EvaExecutor executor(options);
+        std::vector<EvaExecutor::Ticket> tickets;
+        for (int i = 0; i < 4; ++i) {
+            tickets.push_back(executor.submit("(twice 4)"));
+        }
+        for (auto &ticket : tickets) {
+            CHECK_CPPNUMBER(std::get<double>(ticket.result.get().value), 8);
+        }
+    }
+
+    {
+        // The VMs of a thread share its heap: a collection in one of them
+        // keeps the objects of the others, a VM ending leaves them alone
+        EvaVM idle;
+        CHECK_STRING(idle.exec(R"#(
+        (var greeting "hello")
+        (def greet (name) (+ greeting name))
+        (greet " idle")
+        )#"),
+                     "hello idle");
+        EvaVM busy;
+        busy.collector().setOptions(smallHeap);
+        CHECK_NUMBER(busy.exec(R"#(
+        (var i 0)
+        (while (< i 2000)
+            (begin
+                (var garbage (+ "a" "b"))
+                (set i (+ i 1))
+            ))
+        i
+        )#"),
+                     2000);
+        CHECK_BOOL(BOOLEAN(busy.collector().telemetry().counters().fullCollections > 0), true);
+        CHECK_NUMBER(idle.exec("(square 3)"), 9);
+        {
+            EvaVM ended;
+            CHECK_STRING(ended.exec(R"#((+ "a" "b"))#"), "ab");
+        }
+        CHECK_STRING(idle.exec(R"#((greet " again"))#"), "hello again");
+    }
+
+    {
+        // An image of shared code boots VMs in another process, natives
+        // bound by name: here the same process, from the file
+        const std::vector<EvaVM::NativeSpec> natives{
+            {"triple", [](EvaVM &, const EvaValue *args, size_t) {
+                 return NUMBER(args[0].asNumber() * 3);
+             },
+             1},
+        };
+        const auto prelude = EvaVM::compileShared({R"#(
+        (var greeting "hello")
+        (def area (r) (* PI (square r)))
+        (def sum (n)
+            (begin
+                (var total 0)
+                (while (> n 0)
+                    (begin
+                        (set total (+ total (triple n)))
+                        (set n (- n 1))
+                    ))
+                total
+            ))
+        (def greet (name) (+ greeting name))
+        )#"},
+                                                  natives);
+        char path[] = "/tmp/eva_image_XXXXXX";
+        ::close(mkstemp(path));
+        {
+            std::ofstream out(path, std::ios::binary);
+            EvaImage::write(out, *prelude);
+        }
+        const auto image = EvaImage::load(path, natives);
+        std::remove(path);
+        CHECK_CPPNUMBER(image->objects(), prelude->objects());
+        EvaVM booted(image);
+        booted.setPrintListing(false);
+        booted.collector().setOptions(smallHeap);
+        CHECK_BOOL(BOOLEAN(booted.globals().shared()), true);
+        CHECK_NUMBER(booted.exec("(sum 100)"), 15150);
+        CHECK_NUMBER(booted.exec("(area 2)"), 3.1415 * 4);
+        CHECK_STRING(booted.exec(R"#((greet " image"))#"), "hello image");
+        // The code of the image is the code compiled from the source
+        EvaVM compiled(prelude);
+        const auto sum = booted.globals().getGlobalIndex("sum").value();
+        CHECK_CPPNUMBER(compiled.globals().getGlobalIndex("sum").value(), sum);
+        CHECK_BOOL(BOOLEAN(booted.globals().get(sum).asFunction()->co->code
+                           == compiled.globals().get(sum).asFunction()->co->code),
+                   true);
+    }
+
+    {
+        // Pure functions over ranges on the worker VMs: the chunks are
+        // combined in the order of the range
+        EvaVM parallelVM;
+        parallelVM.setPrintListing(false);
+        parallelVM.registerNatives(EvaParallel::natives());
+        CHECK_NUMBER(parallelVM.exec(R"#(
+        (var offset 1)
+        (def squarePlus (i) (+ (square i) offset))
+        (def add (a b) (+ a b))
+        (preduce squarePlus add 0 0 1000)
+        )#"),
+                     332833500 + 1000);
+        CHECK_STRING(parallelVM.exec(R"#(
+        (def digit (i)
+            (if (< i 5) "a" "b"))
+        (def concat (a b) (+ a b))
+        (+ (preduce digit concat ">" 0 10) (pmap digit 3 7))
+        )#"),
+                     ">aaaaabbbbbaabb");
+        // Recursion through the globals, and the empty range
+        CHECK_NUMBER(parallelVM.exec(R"#(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))
+            ))
+        (def add (a b) (+ a b))
+        (+ (preduce fib add 0 0 20) (preduce fib add 7 5 5))
+        )#"),
+                     10945 + 7);
+    }
+
+    {
+        // Isolates pass messages over channels, strings without copies
+        auto requests = EvaChannel::create();
+        auto replies = EvaChannel::create();
+        const auto ids = "(var requests " + std::to_string(requests->id()) + ")(var replies "
+                         + std::to_string(replies->id()) + ")";
+        EvaIsolate echo(ids + R"#(
+        (var n 0)
+        (while (< n 4)
+            (begin
+                (send replies (receive requests))
+                (set n (+ n 1))
+            ))
+        n
+        )#");
+        const auto text = std::make_shared<const std::string>(std::string(4096, 'e'));
+        requests->send(text);
+        const auto reply = replies->receive();
+        CHECK_BOOL(BOOLEAN(std::get<std::shared_ptr<const std::string>>(reply) == text), true);
+        requests->send(1.5);
+        CHECK_CPPNUMBER(std::get<double>(replies->receive()), 1.5);
+
+        // A VM waiting for a message runs its other tasks meanwhile
+        EvaVM channelVM;
+        channelVM.collector().setOptions(smallHeap);
+        CHECK_NUMBER(channelVM.exec(ids + R"#(
+        (var ticks 0)
+        (def ticker ()
+            (begin
+                (while (< ticks 3)
+                    (begin
+                        (sleep 10)
+                        (set ticks (+ ticks 1))
+                    ))
+                ticks
+            ))
+        (var t (spawn ticker))
+        (def ask () (begin (sleep 20) (send requests "ping") (receive replies)))
+        (var a (spawn ask))
+        (var b (spawn ask))
+        (var pongs (+ (await a) (await b)))
+        (await t)
+        (if (= pongs "pingping") ticks 0)
+        )#"),
+                     3);
+        CHECK_CPPNUMBER(std::get<double>(echo.join()), 4);
+    }
+
+    {
+        // Instructions map back to the innermost expression of the source
+        auto g = std::make_shared<Globals>();
+        EvaCompiler c(g);
+        c.setInlineBudget(0);
+        c.setPrintListing(false);
+        syntax::eva_parser p;
+        auto co = c.compile(p.parse("(begin\n(var a 1)\n(def f (x)\n  (* x 2))\n(f a))"), "main");
+        CHECK_BOOL(BOOLEAN(co->positions.at(0).toString() == "2:7"), true);
+        CodeObject *f = nullptr;
+        for (const auto &constant : co->constants) {
+            if (isObjectType(constant, ObjectType::CODE) && constant.asCodeObject()->name == "f") {
+                f = constant.asCodeObject();
+            }
+        }
+        CHECK_BOOL(BOOLEAN(f != nullptr), true);
+        // GET_LOCAL x, CONST 2, MUL
+        CHECK_BOOL(BOOLEAN(f->positions.at(0).toString() == "4:5"), true);
+        CHECK_BOOL(BOOLEAN(f->positions.at(2).toString() == "4:7"), true);
+        CHECK_BOOL(BOOLEAN(f->positions.at(4).toString() == "4:2"), true);
+
+        // Lines may go back, repeated positions add no entry
+        PositionTable table;
+        table.add(0, {5, 1});
+        table.add(3, {2, 4});
+        const auto bytes = table.bytes();
+        table.add(7, {2, 4});
+        CHECK_CPPNUMBER(table.bytes(), bytes);
+        CHECK_CPPNUMBER(table.at(2).line, 5);
+        CHECK_CPPNUMBER(table.at(3).line, 2);
+        CHECK_CPPNUMBER(table.at(100).column, 4);
+    }
+
+    if (EvaPerfMap::supported()) {
+        // Functions run through their trampolines, listed in the perf map
+        EvaVM perfVM;
+        perfVM.collector().setOptions(smallHeap);
+        perfVM.setInlineBudget(0);
+        perfVM.setPerfMap(true);
+        CHECK_NUMBER(perfVM.exec(R"#(
+        (def factorial (x)
+            (if (= x 1)
+                1
+                (* x (factorial (- x 1)))
+            ))
+        (def cons (head tail)
+            (begin
+                (def get (i) (if (= i 0) head tail))
+                get
+            ))
+        (var list 0)
+        (var n 0)
+        (while (< n 500)
+            (begin
+                (set list (cons (factorial 10) list))
+                (set n (+ n 1))
+            ))
+        (+ n (list 0))
+        )#"),
+                     500 + 3628800);
+        std::ifstream map(EvaPerfMap::instance().path());
+        std::string symbols((std::istreambuf_iterator<char>(map)), std::istreambuf_iterator<char>());
+        for (auto function : {" eva::main\n", " eva::factorial\n", " eva::cons\n"}) {
+            CHECK_BOOL(BOOLEAN(symbols.find(function) != std::string::npos), true);
+        }
+        std::remove(EvaPerfMap::instance().path().c_str());
+    }
+
+    std::thread([] {
+        // The compaction moves the live objects out of the chunks left with
+        // holes by the previous collection, and fixes the references. On its
+        // own thread, clear() leaves the objects of the VM alone.
+        EvaCollector collector;
+        GCOptions options;
+        options.compaction = true;
+        collector.setOptions(options);
+        std::vector<Traceable *> roots;
+        {
+            EvaHeap::PretenureScope pretenure;
+            for (int i = 0; i < 10000; ++i) {
+                auto cell = allocCell(allocString(std::string(i % 64, 'x')));
+                if (i % 10 == 0) {
+                    roots.push_back(cell.asObject());
+                }
+            }
+        }
+        auto visitRoots = [&roots](auto &&visit, bool) {
+            for (auto &root : roots) {
+                visit(root);
+            }
+        };
+        collector.runGC(visitRoots);
+        CHECK_BOOL(BOOLEAN(EvaHeap::fragmentation() > 0.8), true);
+        const auto chunkBytes = EvaHeap::chunkBytes();
+        collector.runGC(visitRoots);
+        CHECK_CPPNUMBER(EvaHeap::fragmentation(), 0);
+        CHECK_BOOL(BOOLEAN(EvaHeap::chunkBytes() < chunkBytes / 4), true);
+        for (size_t i = 0; i < roots.size(); ++i) {
+            auto value = static_cast<CellObject *>(roots[i])->value;
+            CHECK_STRING(value, std::string(i * 10 % 64, 'x'));
+        }
+        Traceable::clear();
+    }).join();
+
+    std::thread([] {
+        // Disabling the compaction keeps the objects of the chunks off the
+        // concurrent sweeper, the chunks go with the last of them
+        EvaCollector collector;
+        GCOptions options;
+        options.compaction = true;
+        collector.setOptions(options);
+        std::vector<Traceable *> roots;
+        {
+            EvaHeap::PretenureScope pretenure;
+            for (int i = 0; i < 1000; ++i) {
+                roots.push_back(allocString(std::string(i % 64, 'x')).asObject());
+            }
+        }
+        auto visitRoots = [&roots](auto &&visit, bool) {
+            for (auto &root : roots) {
+                visit(root);
+            }
+        };
+        collector.runGC(visitRoots);
+        CHECK_BOOL(BOOLEAN(EvaHeap::chunkBytes() > 0), true);
+        options.compaction = false;
+        options.concurrentSweep = true;
+        collector.setOptions(options);
+        roots.resize(500);
+        collector.runGC(visitRoots);
+        CHECK_BOOL(BOOLEAN(EvaHeap::chunkBytes() > 0), true);
+        roots.clear();
+        collector.runGC(visitRoots);
+        CHECK_CPPNUMBER(EvaHeap::chunkBytes(), 0);
+        Traceable::clear();
+    }).join();
+
+    {
+        // Only the captured variable is boxed
+        auto g = std::make_shared<Globals>();
+        EvaCompiler c(g);
+        syntax::eva_parser p;
+        auto co{c.compile(p.parse(R"#(
+        (def foo (a)
+            (begin
+                (var y a)
+                (def bar () y)
+                (+ a (bar))
+            ))
+        )#"),
+                          "test")};
+        auto foo = co->constants[0].asCodeObject();
+        // The locals of the block are gone after compiling, the cells are
+        // in the code: only the slot of y is boxed
+        std::vector<uint8_t> cells;
+        for (size_t offset = 0; offset < foo->code.size();
+             offset += 1 + operandBytes(foo->code[offset])) {
+            if (foo->code[offset] == OP_MAKE_CELL) {
+                cells.push_back(foo->code[offset + 1]);
+            }
+        }
+        CHECK_CPPNUMBER(cells.size(), 1);
+        CHECK_CPPNUMBER(int(cells[0]), 2);
+        auto bar = foo->constants[0].asCodeObject();
+        CHECK_CPPNUMBER(bar->upvalues.size(), 1);
+        CHECK_CPPNUMBER(bar->upvalues[0].fromParentLocal, true);
+        CHECK_CPPNUMBER(int(bar->upvalues[0].index), 2);
+        // No VM of the thread is left to free the code
+        Traceable::clear();
+    }
+
     //    CHECK_NUMBER(vm.exec(R"#(
     //    (begin
     //        (var count 0)